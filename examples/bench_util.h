@@ -0,0 +1,290 @@
+// Helpers shared by the nbdbench and nbdreplay examples, which drive
+// NbdServers through the client end of a socketpair.
+#ifndef _BENCH_UTIL_H_
+#define _BENCH_UTIL_H_
+
+#include "nbd_server.h"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+// Blocking writev() of all of iov, which it consumes.
+inline bool write_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t ret = writev(fd, iov, iovcnt);
+    if (ret <= 0)
+      return false;
+    while ((iovcnt > 0) && ((size_t)ret >= iov->iov_len)) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  return true;
+}
+
+// Blocking read of exactly len bytes.
+inline bool read_all(int fd, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = recv(fd, buf, len, MSG_WAITALL);
+    if (ret <= 0)
+      return false;
+    buf = (char *)buf + ret;
+    len -= ret;
+  }
+  return true;
+}
+
+inline void hist_add(NbdHistogram *h, uint64_t ns) {
+  h->counts[NbdHistogram::Bucket(ns)]++;
+  h->count++;
+  h->sum_ns += ns;
+  h->max_ns = max(h->max_ns, ns);
+}
+
+// Prints h as a JSON member, followed by a comma unless last is set.
+inline void print_hist(const char *name, const NbdHistogram &h, bool last) {
+  printf("\"%s\":{\"mean\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,"
+         "\"p999\":%lu,\"max\":%lu}%s", name, h.Mean(), h.Percentile(50),
+         h.Percentile(90), h.Percentile(99), h.Percentile(99.9), h.max_ns,
+         last ? "" : ",");
+}
+
+// One connection, a server and the client driving it over a socketpair.
+// A submitter thread sends requests and a reaper thread reads the
+// replies. Handles are slots, which the reaper hands back to the
+// submitter through a single producer, single consumer ring.
+struct BenchConn {
+  explicit BenchConn(unsigned depth) :
+      depth(depth), sent_ticks(depth), len(depth), type(depth),
+      free_slots(depth), free_tail(depth), submitted(0), done(false) {
+    for (unsigned slot = 0; slot < depth; slot++)
+      free_slots[slot] = slot;
+  }
+
+  // Submitter side. A free slot, -1 if all of them are in flight.
+  int GetSlot() {
+    if (free_head == free_tail.load(memory_order_acquire))
+      return -1;
+    return free_slots[free_head++ % depth];
+  }
+  // Sends a request in slot, type can have NBD_CMD_FLAG_* set. Returns
+  // false on failure.
+  bool Send(uint32_t slot, uint32_t type, uint64_t offset, uint32_t size,
+            const void *data) {
+    struct nbd_request req;
+    req.magic = htobe32(NBD_REQUEST_MAGIC);
+    req.type = htobe32(type);
+    uint64_t handle = slot;
+    memcpy(req.handle, &handle, sizeof(handle));
+    req.from = htobe64(offset);
+    req.len = htobe32(size);
+    len[slot] = size;
+    this->type[slot] = type & 0xffff;
+    struct iovec iov[2];
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+    sent_ticks[slot] = NbdStatsCounters::Now();
+    // Published before the request goes out, the reaper may see the reply
+    // right after.
+    uint64_t n = submitted.load(memory_order_relaxed);
+    submitted.store(n + 1, memory_order_release);
+    if (!write_all(fd, iov, (data != nullptr) ? 2 : 1)) {
+      fprintf(stderr, "Failed to send request : %s\n", strerror(errno));
+      submitted.store(n, memory_order_release);
+      return false;
+    }
+    return true;
+  }
+  // No more requests follow.
+  void Finish() { done.store(true, memory_order_release); }
+
+  // Reaper side, returns once every request sent got its reply.
+  void Reap(uint32_t max_len, double ns_per_tick) {
+    vector<char> data(max_len);
+    uint64_t replied = 0;
+    while (true) {
+      if (replied == submitted.load(memory_order_acquire)) {
+        if (done.load(memory_order_acquire) &&
+            (replied == submitted.load(memory_order_acquire))) {
+          break;
+        }
+        // Nothing in flight, the submitter may be done.
+        struct pollfd pfd = {fd, POLLIN, 0};
+        poll(&pfd, 1, 10);
+        continue;
+      }
+      struct nbd_reply reply;
+      if (!read_all(fd, &reply, sizeof(reply)) ||
+          (reply.magic != htobe32(NBD_REPLY_MAGIC))) {
+        fprintf(stderr, "Failed to read reply\n");
+        break;
+      }
+      uint64_t handle;
+      memcpy(&handle, reply.handle, sizeof(handle));
+      uint32_t slot = handle;
+      bool read = (type[slot] == NBD_CMD_READ);
+      if (reply.error != 0) {
+        errors++;
+      } else if (read && !read_all(fd, data.data(), len[slot])) {
+        fprintf(stderr, "Failed to read data\n");
+        break;
+      }
+      uint64_t now = NbdStatsCounters::Now();
+      if (read) {
+        reads++;
+        bytes += len[slot];
+      } else if (type[slot] == NBD_CMD_WRITE) {
+        writes++;
+        bytes += len[slot];
+      } else {
+        others++;
+      }
+      hist_add(&latency, (now - sent_ticks[slot]) * ns_per_tick);
+      replied++;
+      uint64_t tail = free_tail.load(memory_order_relaxed);
+      free_slots[tail % depth] = slot;
+      free_tail.store(tail + 1, memory_order_release);
+    }
+  }
+
+  int fd = -1;  // Client end.
+  unique_ptr<NbdServer> server;
+  unsigned depth;
+  // By slot.
+  vector<uint64_t> sent_ticks;
+  vector<uint32_t> len;
+  vector<uint16_t> type;
+  vector<uint32_t> free_slots;
+  uint64_t free_head = 0;
+  atomic<uint64_t> free_tail;
+  atomic<uint64_t> submitted;
+  atomic<bool> done;
+  // Written by the reaper.
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+  uint64_t others = 0;
+  uint64_t bytes = 0;  // Of reads and writes.
+  uint64_t errors = 0;
+  NbdHistogram latency;
+};
+
+// Creates a server for params on a new socketpair. Returns 0 on success,
+// errno otherwise.
+inline int bench_connect(const NbdParams &params, BenchConn *conn) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    return errno;
+  int st = NbdServer::New(sv[1], params, &conn->server);
+  if (st != 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return st;
+  }
+  conn->fd = sv[0];
+  return 0;
+}
+
+// Polls every server until stop is set, starting each round at server
+// first. Pollers sharing the servers contend on their receive and send
+// sides in DataPoll(), starting apart they mostly take turns.
+inline void bench_poll(vector<unique_ptr<BenchConn>> *conns,
+                       unsigned first, atomic<bool> *stop) {
+  size_t n = conns->size();
+  while (!stop->load(memory_order_relaxed)) {
+    bool any_work = false;
+    for (size_t i = 0; i < n; i++) {
+      bool did_work = false;
+      (*conns)[(first + i) % n]->server->DataPoll(&did_work);
+      any_work |= did_work;
+    }
+    // Leaves the CPU to the clients on small machines.
+    if (!any_work)
+      this_thread::yield();
+  }
+}
+
+// Sends a disconnect on every connection and waits for the servers to
+// see it, the pollers still have to be running.
+inline void bench_disconnect(vector<unique_ptr<BenchConn>> *conns) {
+  for (auto &conn : *conns)
+    conn->Send(0, NBD_CMD_DISC, 0, 0, nullptr);
+  for (auto &conn : *conns) {
+    string reason;
+    for (int i = 0; (i < 1000) && !conn->server->CheckShutdown(&reason); i++)
+      usleep(1000);
+  }
+}
+
+// Parses a size like 4096, 4k or 1m.
+inline uint64_t parse_size(const char *str) {
+  char *end;
+  uint64_t size = strtoull(str, &end, 0);
+  if ((*end == 'k') || (*end == 'K')) {
+    size *= 1024;
+  } else if ((*end == 'm') || (*end == 'M')) {
+    size *= 1024 * 1024;
+  }
+  return size;
+}
+
+// Tuning fields of NbdParams set_param() knows, for the usage texts.
+constexpr const char *kTuningParams =
+    "rcv_buf_size, send_batch_size, merge_max_size, merge_window,\n"
+    "  stream_chunk_size, cmd_slab, zerocopy_threshold, max_io_size,\n"
+    "  zero_detect_size, prefetch_size, prefetch_max_window";
+
+// Sets a tuning field of NbdParams from an -o name=value option. Returns
+// false if there is no such field.
+inline bool set_param(NbdParams *params, const string &opt) {
+  size_t eq = opt.find('=');
+  if (eq == string::npos)
+    return false;
+  string name = opt.substr(0, eq);
+  uint64_t value = parse_size(opt.c_str() + eq + 1);
+  if (name == "rcv_buf_size") {
+    params->rcv_buf_size = value;
+  } else if (name == "send_batch_size") {
+    params->send_batch_size = value;
+  } else if (name == "merge_max_size") {
+    params->merge_max_size = value;
+  } else if (name == "merge_window") {
+    params->merge_window = value;
+  } else if (name == "stream_chunk_size") {
+    params->stream_chunk_size = value;
+  } else if (name == "cmd_slab") {
+    params->cmd_slab = (value != 0);
+  } else if (name == "zerocopy_threshold") {
+    params->zerocopy_threshold = value;
+  } else if (name == "max_io_size") {
+    params->max_io_size = value;
+  } else if (name == "zero_detect_size") {
+    params->zero_detect_size = value;
+  } else if (name == "prefetch_size") {
+    params->prefetch_size = value;
+  } else if (name == "prefetch_max_window") {
+    params->prefetch_max_window = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+#endif  // _BENCH_UTIL_H_
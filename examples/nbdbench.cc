@@ -0,0 +1,342 @@
+// Benchmark of the nbd data path which needs neither root nor the nbd
+// module: NbdServer instances on socketpairs, each driven by a userspace
+// nbd client generating requests, in front of an in-memory backend.
+//
+// Usage: nbdbench [-r read_pct] [-b sizes] [-q depth] [-p rand|seq]
+//                 [-c conns] [-t pollers] [-d secs] [-s size_mb]
+//                 [-e socket|uring] [-n] [-S] [-z zero_pct]
+//                 [-C capture_file] [-o name=value]...
+//   -r  Percentage of reads, the rest are writes (default 100).
+//   -b  Request sizes, comma separated with an optional k or m suffix,
+//       each request picks one at random (default 4k).
+//   -q  Requests in flight per connection (default 32).
+//   -p  Random offsets, or a sequential stream per connection (default
+//       rand).
+//   -c  Connections, each with a server and a client (default 1).
+//   -t  Poller threads, each of them polls every server (default 1).
+//   -d  Seconds to run (default 10).
+//   -s  Device size in MB (default 256).
+//   -e  I/O engine of the servers (default socket).
+//   -n  Null backend, completes requests without touching any data.
+//   -S  Turns on NbdParams::stats and reports the server side phases.
+//   -z  Percentage of writes whose payload is all zeroes (default 0),
+//       for zero_detect_size.
+//   -C  Captures the requests, with payload hashes, for nbdreplay.
+//   -o  Sets a tuning field of NbdParams: rcv_buf_size, send_batch_size,
+//       merge_max_size, merge_window, stream_chunk_size, cmd_slab,
+//       zerocopy_threshold, max_io_size (which also bounds -b),
+//       zero_detect_size, prefetch_size or prefetch_max_window.
+//
+// Prints the results as one line of JSON, latencies in ns as seen by
+// the clients.
+
+#include "nbd_server.h"
+#include "buffer_pool.h"
+#include "nbd_capture.h"
+#include "bench_util.h"
+
+#include <chrono>
+
+constexpr uint32_t kBlockSize = 4096;
+uint64_t mem_size = 256 * 1024 * 1024;
+char *mem = nullptr;
+bool null_backend = false;
+
+void bench_read(void *arg, NbdCmd *cmd) {
+  if ((cmd->io_offset + cmd->io_size) > mem_size) {
+    cmd->ret_error = ENOSPC;
+  } else {
+    if (!null_backend)
+      memcpy(cmd->data_buf, mem + cmd->io_offset, cmd->io_size);
+    cmd->ret_error = 0;
+  }
+  cmd->completion_cb(cmd);
+}
+
+void bench_write(void *arg, NbdCmd *cmd) {
+  if ((cmd->io_offset + cmd->io_size) > mem_size) {
+    cmd->ret_error = ENOSPC;
+  } else {
+    if (!null_backend)
+      memcpy(mem + cmd->io_offset, cmd->data_buf, cmd->io_size);
+    cmd->ret_error = 0;
+  }
+  cmd->completion_cb(cmd);
+}
+
+void bench_zero(void *arg, NbdCmd *cmd) {
+  if ((cmd->io_offset + cmd->io_size) > mem_size) {
+    cmd->ret_error = ENOSPC;
+  } else {
+    if (!null_backend)
+      memset(mem + cmd->io_offset, 0, cmd->io_size);
+    cmd->ret_error = 0;
+  }
+  cmd->completion_cb(cmd);
+}
+
+void bench_other(void *arg, NbdCmd *cmd) {
+  cmd->ret_error = 0;
+  cmd->completion_cb(cmd);
+}
+
+// Request generator settings.
+unsigned read_pct = 100;
+unsigned zero_pct = 0;
+vector<uint32_t> sizes;
+bool sequential = false;
+// Payloads of the writes, zero_data those of zero_pct of them.
+char *write_data = nullptr;
+char *zero_data = nullptr;
+
+uint64_t random64(unsigned *seed) {
+  return ((uint64_t)rand_r(seed) << 31) | rand_r(seed);
+}
+
+void submitter(BenchConn *conn, unsigned seed, uint64_t next_offset,
+               chrono::steady_clock::time_point end) {
+  while (chrono::steady_clock::now() < end) {
+    int slot = conn->GetSlot();
+    if (slot < 0) {
+      this_thread::yield();
+      continue;
+    }
+    uint32_t len = sizes[rand_r(&seed) % sizes.size()];
+    bool read = (unsigned)(rand_r(&seed) % 100) < read_pct;
+    const char *data = nullptr;
+    if (!read) {
+      data = ((unsigned)(rand_r(&seed) % 100) < zero_pct) ? zero_data :
+                                                             write_data;
+    }
+    uint64_t offset;
+    if (sequential) {
+      if (next_offset + len > mem_size)
+        next_offset = 0;
+      offset = next_offset;
+      next_offset += len;
+    } else {
+      offset = (random64(&seed) % ((mem_size - len) / kBlockSize + 1)) *
+               kBlockSize;
+    }
+    if (!conn->Send(slot, read ? NBD_CMD_READ : NBD_CMD_WRITE, offset, len,
+                    data)) {
+      break;
+    }
+  }
+  conn->Finish();
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-r read_pct] [-b sizes] [-q depth] "
+          "[-p rand|seq] [-c conns] [-t pollers] [-d secs] [-s size_mb] "
+          "[-e socket|uring] [-n] [-S] [-z zero_pct] [-C capture_file] "
+          "[-o name=value]...\n"
+          "-o name is one of: %s\n", prog, kTuningParams);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  unsigned num_conns = 1;
+  unsigned num_pollers = 1;
+  unsigned secs = 10;
+  unsigned queue_depth = 32;
+  NbdParams params;
+  params.block_size = kBlockSize;
+  params.arg = nullptr;
+  params.read = bench_read;
+  params.write = bench_write;
+  params.trim = bench_other;
+  params.write_zeroes = bench_zero;
+  params.flush = bench_other;
+  params.disconnect = nullptr;
+  string sizes_str = "4k";
+  const char *capture_file = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:b:q:p:c:t:d:s:e:nSz:C:o:")) != -1) {
+    switch (opt) {
+      case 'r':
+        read_pct = min(atoi(optarg), 100);
+        break;
+      case 'b':
+        sizes_str = optarg;
+        break;
+      case 'q':
+        queue_depth = atoi(optarg);
+        break;
+      case 'p':
+        if (strcmp(optarg, "seq") == 0) {
+          sequential = true;
+        } else if (strcmp(optarg, "rand") != 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'c':
+        num_conns = atoi(optarg);
+        break;
+      case 't':
+        num_pollers = atoi(optarg);
+        break;
+      case 'd':
+        secs = atoi(optarg);
+        break;
+      case 's':
+        mem_size = strtoull(optarg, nullptr, 0) * 1024 * 1024;
+        break;
+      case 'e':
+        if (strcmp(optarg, "uring") == 0) {
+          params.io_engine = NBD_IO_ENGINE_URING;
+        } else if (strcmp(optarg, "socket") != 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'n':
+        null_backend = true;
+        break;
+      case 'S':
+        params.stats = true;
+        break;
+      case 'z':
+        zero_pct = min(atoi(optarg), 100);
+        break;
+      case 'C':
+        capture_file = optarg;
+        break;
+      case 'o':
+        if (!set_param(&params, optarg)) {
+          fprintf(stderr, "Unknown tuning option %s\n", optarg);
+          exit(1);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  for (size_t pos = 0; pos < sizes_str.size();) {
+    size_t comma = sizes_str.find(',', pos);
+    if (comma == string::npos)
+      comma = sizes_str.size();
+    uint64_t size = parse_size(sizes_str.substr(pos, comma - pos).c_str());
+    if ((size == 0) || (size % kBlockSize) || (size > params.max_io_size)) {
+      fprintf(stderr, "Sizes have to be multiples of %u up to %u\n",
+              kBlockSize, params.max_io_size);
+      exit(1);
+    }
+    sizes.push_back(size);
+    pos = comma + 1;
+  }
+  uint32_t max_size = *max_element(sizes.begin(), sizes.end());
+  if ((num_conns == 0) || (num_pollers == 0) || (queue_depth == 0) ||
+      (mem_size < max_size)) {
+    usage(argv[0]);
+  }
+  params.num_blocks = mem_size / kBlockSize;
+  params.queue_depth = queue_depth;
+
+  mem = (char *)calloc(1, mem_size);
+  write_data = (char *)malloc(max_size);
+  zero_data = (char *)calloc(1, max_size);
+  if ((mem == nullptr) || (write_data == nullptr) || (zero_data == nullptr)) {
+    fprintf(stderr, "Unable to allocate memory\n");
+    exit(1);
+  }
+  memset(write_data, 0xa5, max_size);
+  shared_ptr<BufferPool> pool;
+  BufferPoolParams pool_params;
+  pool_params.min_size = kBlockSize;
+  pool_params.max_size = params.max_io_size;
+  int st = BufferPool::New(pool_params, &pool);
+  if (st != 0) {
+    fprintf(stderr, "Failed to create buffer pool : %s\n", strerror(st));
+    exit(1);
+  }
+  pool->SetCallbacks(&params);
+  if (capture_file != nullptr) {
+    st = NbdCapture::New(capture_file, params, true, &params.capture);
+    if (st != 0) {
+      fprintf(stderr, "Failed to create %s : %s\n", capture_file,
+              strerror(st));
+      exit(1);
+    }
+  }
+
+  NbdStatsCounters::StartClock();
+  double ns_per_tick = NbdStatsCounters::NsPerTick();
+  vector<unique_ptr<BenchConn>> conns;
+  for (unsigned i = 0; i < num_conns; i++) {
+    unique_ptr<BenchConn> conn(new BenchConn(queue_depth));
+    st = bench_connect(params, conn.get());
+    if (st != 0) {
+      fprintf(stderr, "Failed to create server : %s\n", strerror(st));
+      exit(1);
+    }
+    conns.push_back(move(conn));
+  }
+
+  atomic<bool> stop_pollers(false);
+  vector<thread> pollers;
+  for (unsigned i = 0; i < num_pollers; i++)
+    pollers.emplace_back(bench_poll, &conns, i, &stop_pollers);
+  auto start = chrono::steady_clock::now();
+  auto end = start + chrono::seconds(secs);
+  vector<thread> clients;
+  for (unsigned i = 0; i < num_conns; i++) {
+    BenchConn *conn = conns[i].get();
+    // Sequential streams start apart from each other.
+    uint64_t offset = (mem_size / num_conns) * i / kBlockSize * kBlockSize;
+    clients.emplace_back(submitter, conn, i + 1, offset, end);
+    clients.emplace_back([conn, max_size, ns_per_tick]() {
+        conn->Reap(max_size, ns_per_tick);
+      });
+  }
+  for (auto &t : clients)
+    t.join();
+  double elapsed = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  bench_disconnect(&conns);
+  stop_pollers = true;
+  for (auto &t : pollers)
+    t.join();
+
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+  uint64_t bytes = 0;
+  uint64_t errors = 0;
+  NbdHistogram latency;
+  NbdStats stats;
+  for (auto &conn : conns) {
+    reads += conn->reads;
+    writes += conn->writes;
+    bytes += conn->bytes;
+    errors += conn->errors;
+    latency.Add(conn->latency);
+    NbdStats conn_stats;
+    conn->server->GetStats(&conn_stats);
+    stats.Add(conn_stats);
+  }
+  printf("{\"engine\":\"%s\",\"conns\":%u,\"pollers\":%u,\"queue_depth\":%u,"
+         "\"read_pct\":%u,\"zero_pct\":%u,\"sizes\":\"%s\",\"pattern\":\"%s\","
+         "\"null_backend\":%s,\"secs\":%.3f,\"reads\":%lu,\"writes\":%lu,"
+         "\"errors\":%lu,\"iops\":%.0f,\"mib_per_sec\":%.1f,",
+         (params.io_engine == NBD_IO_ENGINE_URING) ? "uring" : "socket",
+         num_conns, num_pollers, queue_depth, read_pct, zero_pct,
+         sizes_str.c_str(), sequential ? "seq" : "rand", null_backend ? "true" : "false",
+         elapsed, reads, writes, errors, (reads + writes) / elapsed,
+         bytes / elapsed / (1024 * 1024));
+  printf("\"latency_ns\":{");
+  print_hist("total", latency, !params.stats);
+  if (params.stats) {
+    print_hist("server_recv", stats.latency[NBD_PHASE_RECV], false);
+    print_hist("server_backend", stats.latency[NBD_PHASE_BACKEND], false);
+    print_hist("server_send", stats.latency[NBD_PHASE_SEND], true);
+  }
+  printf("}}\n");
+
+  for (auto &conn : conns) {
+    conn->server.reset();
+    close(conn->fd);
+  }
+  free(write_data);
+  free(zero_data);
+  free(mem);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,335 @@
+// Replays a capture of the requests an nbd device received (see
+// NbdParams::capture and nbd_capture.h) against NbdServers on
+// socketpairs, one per captured connection, in front of an in-memory
+// backend of the captured size.
+//
+// Usage: nbdreplay [-f] [-q depth] [-t pollers] [-n] [-S]
+//                  [-e socket|uring] [-o name=value]... capture_file
+//   -f  Sends requests as fast as possible instead of at their original
+//       times.
+//   -q  Max requests in flight per connection (default 128). A request
+//       due while that many are in flight waits.
+//   -t  Poller threads, each of them polls every server (default 1).
+//   -n  Null backend, completes requests without touching any data.
+//   -S  Turns on NbdParams::stats and reports the server side phases.
+//   -e  I/O engine of the servers (default socket).
+//   -o  Sets a tuning field of NbdParams, as with nbdbench:
+//       rcv_buf_size, send_batch_size, merge_max_size, merge_window,
+//       stream_chunk_size, cmd_slab, zerocopy_threshold, max_io_size,
+//       zero_detect_size, prefetch_size or prefetch_max_window.
+//
+// Write payloads are made up: all zeroes if the captured hash is that of
+// a zero payload, otherwise bytes derived from the hash, so that equal
+// payloads replay equal. Prints the results as one line of JSON.
+
+#include "nbd_capture.h"
+#include "buffer_pool.h"
+#include "bench_util.h"
+
+#include <chrono>
+#include <map>
+#include <sys/mman.h>
+
+uint64_t mem_size = 0;
+char *mem = nullptr;
+bool null_backend = false;
+
+bool in_range(NbdCmd *cmd) {
+  if ((cmd->io_offset + cmd->io_size) > mem_size) {
+    cmd->ret_error = ENOSPC;
+    cmd->completion_cb(cmd);
+    return false;
+  }
+  cmd->ret_error = 0;
+  return true;
+}
+
+void replay_read(void *arg, NbdCmd *cmd) {
+  if (!in_range(cmd))
+    return;
+  if (!null_backend)
+    memcpy(cmd->data_buf, mem + cmd->io_offset, cmd->io_size);
+  cmd->completion_cb(cmd);
+}
+
+void replay_write(void *arg, NbdCmd *cmd) {
+  if (!in_range(cmd))
+    return;
+  if (!null_backend)
+    memcpy(mem + cmd->io_offset, cmd->data_buf, cmd->io_size);
+  cmd->completion_cb(cmd);
+}
+
+void replay_zero(void *arg, NbdCmd *cmd) {
+  if (!in_range(cmd))
+    return;
+  if (!null_backend)
+    memset(mem + cmd->io_offset, 0, cmd->io_size);
+  cmd->completion_cb(cmd);
+}
+
+void replay_flush(void *arg, NbdCmd *cmd) {
+  cmd->ret_error = 0;
+  cmd->completion_cb(cmd);
+}
+
+bool as_fast_as_possible = false;
+
+// Fills buf with len bytes of a payload whose hash was hash.
+void make_payload(uint64_t hash, uint32_t len, char *buf) {
+  static thread_local map<uint32_t, uint64_t> zero_hashes;
+  if (hash == 0) {
+    memset(buf, 0xa5, len);
+    return;
+  }
+  auto it = zero_hashes.find(len);
+  if (it == zero_hashes.end()) {
+    memset(buf, 0, len);
+    struct iovec iov = {buf, len};
+    it = zero_hashes.emplace(len, NbdCapture::Hash(&iov, 1)).first;
+  }
+  if (hash == it->second) {
+    memset(buf, 0, len);
+    return;
+  }
+  uint64_t x = hash;
+  for (uint32_t off = 0; off < len; off += sizeof(x)) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    memcpy(buf + off, &x, min<uint32_t>(sizeof(x), len - off));
+  }
+}
+
+// Replays the records of one connection, which are in arrival order.
+// Adds how far behind their original times requests went out to lag.
+void submitter(BenchConn *conn, const vector<NbdCaptureRecord> *records,
+               uint32_t max_len, chrono::steady_clock::time_point start,
+               NbdHistogram *lag) {
+  vector<char> payload(max_len);
+  for (const NbdCaptureRecord &rec : *records) {
+    auto due = start + chrono::nanoseconds(rec.time_ns);
+    if (!as_fast_as_possible) {
+      auto now = chrono::steady_clock::now();
+      if (due - now > chrono::microseconds(100))
+        this_thread::sleep_until(due - chrono::microseconds(50));
+      while (chrono::steady_clock::now() < due)
+        ;
+    }
+    int slot;
+    while ((slot = conn->GetSlot()) < 0)
+      this_thread::yield();
+    if (!as_fast_as_possible) {
+      int64_t behind = chrono::duration_cast<chrono::nanoseconds>(
+          chrono::steady_clock::now() - due).count();
+      hist_add(lag, max<int64_t>(behind, 0));
+    }
+    uint32_t type = rec.type;
+    if (rec.flags & NBD_CAPTURE_FUA)
+      type |= NBD_CMD_FLAG_FUA;
+    if (rec.flags & NBD_CAPTURE_NO_HOLE)
+      type |= NBD_CMD_FLAG_NO_HOLE;
+    const char *data = nullptr;
+    if (rec.type == NBD_CMD_WRITE) {
+      make_payload(rec.hash, rec.len, payload.data());
+      data = payload.data();
+    }
+    if (!conn->Send(slot, type, rec.offset, rec.len, data))
+      break;
+  }
+  conn->Finish();
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-f] [-q depth] [-t pollers] [-n] [-S] "
+          "[-e socket|uring] [-o name=value]... capture_file\n"
+          "-o name is one of: %s\n", prog, kTuningParams);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  unsigned queue_depth = 128;
+  unsigned num_pollers = 1;
+  NbdParams params;
+  params.arg = nullptr;
+  params.read = replay_read;
+  params.write = replay_write;
+  params.trim = replay_zero;
+  params.write_zeroes = replay_zero;
+  params.flush = replay_flush;
+  params.disconnect = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "fq:t:nSe:o:")) != -1) {
+    switch (opt) {
+      case 'f':
+        as_fast_as_possible = true;
+        break;
+      case 'q':
+        queue_depth = atoi(optarg);
+        break;
+      case 't':
+        num_pollers = atoi(optarg);
+        break;
+      case 'n':
+        null_backend = true;
+        break;
+      case 'S':
+        params.stats = true;
+        break;
+      case 'e':
+        if (strcmp(optarg, "uring") == 0) {
+          params.io_engine = NBD_IO_ENGINE_URING;
+        } else if (strcmp(optarg, "socket") != 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'o':
+        if (!set_param(&params, optarg)) {
+          fprintf(stderr, "Unknown tuning option %s\n", optarg);
+          exit(1);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if ((optind + 1 != argc) || (queue_depth == 0) || (num_pollers == 0))
+    usage(argv[0]);
+
+  NbdCaptureHeader header;
+  vector<NbdCaptureRecord> records;
+  int st = NbdCapture::Read(argv[optind], &header, &records);
+  if (st != 0) {
+    fprintf(stderr, "Failed to read %s : %s\n", argv[optind], strerror(st));
+    exit(1);
+  }
+  // Requests of each connection, the disconnects are sent at the end.
+  map<uint16_t, vector<NbdCaptureRecord>> by_conn;
+  uint32_t max_len = 0;
+  for (const NbdCaptureRecord &rec : records) {
+    if ((rec.type != NBD_CMD_DISC) && (rec.type <= NBD_CMD_WRITE_ZEROES)) {
+      by_conn[rec.conn].push_back(rec);
+      if ((rec.type == NBD_CMD_READ) || (rec.type == NBD_CMD_WRITE))
+        max_len = max(max_len, rec.len);
+    }
+  }
+  if (by_conn.empty()) {
+    fprintf(stderr, "Nothing to replay\n");
+    exit(1);
+  }
+  params.block_size = header.block_size;
+  params.num_blocks = header.num_blocks;
+  params.queue_depth = queue_depth;
+  if (max_len > params.max_io_size) {
+    params.max_io_size = (max_len + header.block_size - 1) /
+                         header.block_size * header.block_size;
+  }
+  mem_size = header.block_size * header.num_blocks;
+  // Pages get allocated as they are written.
+  mem = (char *)mmap(nullptr, mem_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %lu bytes : %s\n", mem_size,
+            strerror(errno));
+    exit(1);
+  }
+  shared_ptr<BufferPool> pool;
+  BufferPoolParams pool_params;
+  pool_params.min_size = header.block_size;
+  pool_params.max_size = params.max_io_size;
+  st = BufferPool::New(pool_params, &pool);
+  if (st != 0) {
+    fprintf(stderr, "Failed to create buffer pool : %s\n", strerror(st));
+    exit(1);
+  }
+  pool->SetCallbacks(&params);
+
+  NbdStatsCounters::StartClock();
+  double ns_per_tick = NbdStatsCounters::NsPerTick();
+  vector<unique_ptr<BenchConn>> conns;
+  for (unsigned i = 0; i < by_conn.size(); i++) {
+    unique_ptr<BenchConn> conn(new BenchConn(queue_depth));
+    st = bench_connect(params, conn.get());
+    if (st != 0) {
+      fprintf(stderr, "Failed to create server : %s\n", strerror(st));
+      exit(1);
+    }
+    conns.push_back(move(conn));
+  }
+
+  atomic<bool> stop_pollers(false);
+  vector<thread> pollers;
+  for (unsigned i = 0; i < num_pollers; i++)
+    pollers.emplace_back(bench_poll, &conns, i, &stop_pollers);
+  vector<NbdHistogram> lags(conns.size());
+  auto start = chrono::steady_clock::now();
+  vector<thread> clients;
+  unsigned i = 0;
+  for (auto &entry : by_conn) {
+    BenchConn *conn = conns[i].get();
+    clients.emplace_back(submitter, conn, &entry.second, max_len, start,
+                         &lags[i]);
+    clients.emplace_back([conn, max_len, ns_per_tick]() {
+        conn->Reap(max_len, ns_per_tick);
+      });
+    i++;
+  }
+  for (auto &t : clients)
+    t.join();
+  double elapsed = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  bench_disconnect(&conns);
+  stop_pollers = true;
+  for (auto &t : pollers)
+    t.join();
+
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+  uint64_t others = 0;
+  uint64_t bytes = 0;
+  uint64_t errors = 0;
+  NbdHistogram latency;
+  NbdHistogram lag;
+  NbdStats stats;
+  for (unsigned i = 0; i < conns.size(); i++) {
+    BenchConn *conn = conns[i].get();
+    reads += conn->reads;
+    writes += conn->writes;
+    others += conn->others;
+    bytes += conn->bytes;
+    errors += conn->errors;
+    latency.Add(conn->latency);
+    lag.Add(lags[i]);
+    NbdStats conn_stats;
+    conn->server->GetStats(&conn_stats);
+    stats.Add(conn_stats);
+  }
+  uint64_t ops = reads + writes + others;
+  double captured = 0;
+  for (const NbdCaptureRecord &rec : records)
+    captured = max(captured, rec.time_ns / 1e9);
+  printf("{\"file\":\"%s\",\"conns\":%zu,\"mode\":\"%s\","
+         "\"captured_secs\":%.3f,\"secs\":%.3f,\"reads\":%lu,\"writes\":%lu,"
+         "\"others\":%lu,\"errors\":%lu,\"iops\":%.0f,\"mib_per_sec\":%.1f,",
+         argv[optind], conns.size(),
+         as_fast_as_possible ? "fast" : "timed", captured, elapsed, reads,
+         writes, others, errors, ops / elapsed,
+         bytes / elapsed / (1024 * 1024));
+  printf("\"latency_ns\":{");
+  print_hist("total", latency, !params.stats && as_fast_as_possible);
+  if (!as_fast_as_possible)
+    print_hist("lag", lag, !params.stats);
+  if (params.stats) {
+    print_hist("server_recv", stats.latency[NBD_PHASE_RECV], false);
+    print_hist("server_backend", stats.latency[NBD_PHASE_BACKEND], false);
+    print_hist("server_send", stats.latency[NBD_PHASE_SEND], true);
+  }
+  printf("}}\n");
+
+  for (auto &conn : conns) {
+    conn->server.reset();
+    close(conn->fd);
+  }
+  munmap(mem, mem_size);
+  return 0;
+}
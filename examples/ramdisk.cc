@@ -1,11 +1,33 @@
 // A test program using nbd loopback server.
 //
 // Allocates a 100MB block and exposes that as a ramdisk using nbd.
+//
+// Usage: ramdisk [-l latency_us] [-c cache_mb] [-w] [-t trace_file]
+//                [-N address]
+//   -l  Completes every backend call after this many microseconds, from
+//       a thread of its own, like a slower device would.
+//   -c  Puts a block cache of this many MB in front of the ramdisk.
+//   -w  Makes the cache write-back.
+//   -t  Traces the states of the last 64K cmds per thread, written to
+//       this file as Chrome trace JSON on exit.
+//   -N  Serves the ramdisk to nbd clients over the network instead of
+//       as a local nbd device, which needs neither root nor the nbd
+//       module. address is host:port, :port or a Unix socket path, e.g.
+//       nbd-client localhost 10809 /dev/nbd0 -N "" or
+//       qemu-nbd --list -k /tmp/rd.sock.
 
 #include "nbd_loopback_server.h"
+#include "nbd_net_server.h"
+#include "buffer_pool.h"
+#include "block_cache.h"
+#include "nbd_trace.h"
 
 #include <thread>
+#include <deque>
+#include <condition_variable>
+#include <chrono>
 #include <strings.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -15,17 +37,22 @@ constexpr uint32_t kBlockSize = 4096;
 constexpr uint64_t kNumBlocks = kMemSize/kBlockSize;
 char *mem = nullptr;
 
-void *rd_alloc_mem(unsigned size) {
-  return malloc(size);
-}
-
-void rd_free_mem(void *ptr) {
-  free(ptr);
+// Reads and writes go straight to and from the ramdisk memory, no copy.
+int rd_alloc_iov(void *arg, NbdCmd *cmd, struct iovec *iov,
+                 unsigned max_iov) {
+  if ((cmd->io_offset + cmd->io_size) > kMemSize) {
+    return 0;  // Gets a buffer from the pool and fails in rd_read/write.
+  }
+  iov[0].iov_base = mem + cmd->io_offset;
+  iov[0].iov_len = cmd->io_size;
+  return 1;
 }
 
 void rd_read(void *arg, NbdCmd *cmd) {
   if ((cmd->io_offset + cmd->io_size) > kMemSize) {
     cmd->ret_error = ENOSPC;
+  } else if (cmd->data_iovcnt > 0) {
+    cmd->ret_error = 0;  // Sent from mem as it is.
   } else {
     bcopy(mem + cmd->io_offset, cmd->data_buf, cmd->io_size);
     cmd->ret_error = 0;
@@ -36,6 +63,8 @@ void rd_read(void *arg, NbdCmd *cmd) {
 void rd_write(void *arg, NbdCmd *cmd) {
   if ((cmd->io_offset + cmd->io_size) > kMemSize) {
     cmd->ret_error = ENOSPC;
+  } else if (cmd->data_iovcnt > 0) {
+    cmd->ret_error = 0;  // Already received into mem.
   } else {
     bcopy(cmd->data_buf, mem + cmd->io_offset, cmd->io_size);
     cmd->ret_error = 0;
@@ -53,50 +82,238 @@ void rd_trim(void *arg, NbdCmd *cmd) {
   cmd->completion_cb(cmd);
 }
 
-int main() {
-  int st = NbdLoopbackInit();
+void rd_write_zeroes(void *arg, NbdCmd *cmd) {
+  if ((cmd->io_offset + cmd->io_size) > kMemSize) {
+    cmd->ret_error = ENOSPC;
+  } else {
+    memset(mem + cmd->io_offset, 0, cmd->io_size);
+    cmd->ret_error = 0;
+  }
+  cmd->completion_cb(cmd);
+}
+
+// Artificial latency, see -l. Calls are queued with the time they are
+// due and run by the delay thread.
+uint32_t latency_us = 0;
+mutex delay_lock;
+condition_variable delay_cv;
+deque<pair<chrono::steady_clock::time_point, function<void()>>> delay_queue;
+bool delay_stop = false;
+
+void delay_loop() {
+  unique_lock<mutex> l(delay_lock);
+  while (!delay_stop) {
+    if (delay_queue.empty()) {
+      delay_cv.wait(l);
+      continue;
+    }
+    auto due = delay_queue.front().first;
+    if (chrono::steady_clock::now() < due) {
+      delay_cv.wait_until(l, due);
+      continue;
+    }
+    function<void()> fn = move(delay_queue.front().second);
+    delay_queue.pop_front();
+    l.unlock();
+    fn();
+    l.lock();
+  }
+}
+
+// Wraps a backend callback so that it runs latency_us later.
+function<void(void *, NbdCmd *)> delayed(void (*fn)(void *, NbdCmd *)) {
+  return [fn](void *arg, NbdCmd *cmd) {
+    unique_lock<mutex> l(delay_lock);
+    delay_queue.emplace_back(chrono::steady_clock::now() +
+                                 chrono::microseconds(latency_us),
+                             [fn, arg, cmd]() { fn(arg, cmd); });
+    delay_cv.notify_one();
+  };
+}
+
+// Serves params as the default export at address until a key is pressed.
+int serve_net(const NbdParams &params, const string &address) {
+  NbdNetParams net_params;
+  size_t colon = address.rfind(':');
+  if ((address.find('/') == string::npos) && (colon != string::npos)) {
+    net_params.address = address.substr(0, colon);
+    net_params.port = atoi(address.c_str() + colon + 1);
+  } else {
+    net_params.address = address;
+  }
+  unique_ptr<NbdNetServer> server;
+  int st = NbdNetServer::New(net_params, &server);
   if (st != 0) {
-    fprintf(stderr, "Failed to init loopback : %s\n", strerror(st));
-    exit(1);
+    fprintf(stderr, "Failed to listen on %s : %s\n", address.c_str(),
+            strerror(st));
+    return st;
+  }
+  st = server->AddExport("", params, "ramdisk");
+  if (st != 0) {
+    fprintf(stderr, "Failed to add export : %s\n", strerror(st));
+    return st;
+  }
+  atomic<bool> terminate(false);
+  thread t([&server, &terminate]() {
+      while (!terminate)
+        server->Wait(100);
+    });
+  if (server->port() != 0)
+    printf("Serving NBD on port %u\n", server->port());
+  else
+    printf("Serving NBD on %s\n", address.c_str());
+  printf("Press any key to stop ...\n");
+  getchar();
+  terminate = true;
+  t.join();
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  uint64_t cache_mb = 0;
+  bool write_back = false;
+  const char *trace_file = nullptr;
+  const char *net_address = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:c:wt:N:")) != -1) {
+    switch (opt) {
+      case 'l':
+        latency_us = atoi(optarg);
+        break;
+      case 'c':
+        cache_mb = atoll(optarg);
+        break;
+      case 'w':
+        write_back = true;
+        break;
+      case 't':
+        trace_file = optarg;
+        break;
+      case 'N':
+        net_address = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-l latency_us] [-c cache_mb] [-w] "
+                "[-t trace_file] [-N address]\n", argv[0]);
+        exit(1);
+    }
+  }
+  int st = 0;
+  if (net_address == nullptr) {
+    st = NbdLoopbackInit();
+    if (st != 0) {
+      fprintf(stderr, "Failed to init loopback : %s\n", strerror(st));
+      exit(1);
+    }
   }
   mem = (char *)malloc(kMemSize);
   if (mem == nullptr) {
     fprintf(stderr, "Unable to allocate memory\n");
     exit(1);
   }
+  // Data buffers come from the library's pool instead of malloc().
+  shared_ptr<BufferPool> pool;
+  BufferPoolParams pool_params;
+  pool_params.min_size = kBlockSize;
+  st = BufferPool::New(pool_params, &pool);
+  if (st != 0) {
+    fprintf(stderr, "Failed to create buffer pool : %s\n", strerror(st));
+    exit(1);
+  }
   NbdParams params;
   params.block_size = kBlockSize;
   params.num_blocks = kNumBlocks;
   params.arg = nullptr;
-  params.alloc_data_mem = rd_alloc_mem;
-  params.free_data_mem = rd_free_mem;
+  pool->SetCallbacks(&params);
+  params.alloc_data_iov = rd_alloc_iov;
   params.read = rd_read;
   params.write = rd_write;
   params.trim = rd_trim;
   params.flush = rd_flush;
   params.disconnect = nullptr;
+  if (net_address != nullptr) {
+    // Network clients use it, and get several connections if they ask.
+    params.write_zeroes = rd_write_zeroes;
+    params.num_connections = 4;
+  }
+  thread delay_thread;
+  if (latency_us > 0) {
+    // Buffers are handed out right away, only I/O is slow.
+    params.alloc_data_iov = nullptr;
+    params.read = delayed(rd_read);
+    params.write = delayed(rd_write);
+    params.trim = delayed(rd_trim);
+    params.flush = delayed(rd_flush);
+    if (params.write_zeroes)
+      params.write_zeroes = delayed(rd_write_zeroes);
+    delay_thread = thread(delay_loop);
+  }
+  shared_ptr<BlockCache> cache;
+  if (cache_mb > 0) {
+    BlockCacheParams cache_params;
+    cache_params.size = cache_mb * 1024 * 1024;
+    cache_params.write_back = write_back;
+    st = BlockCache::New(cache_params, params, &cache);
+    if (st != 0) {
+      fprintf(stderr, "Failed to create block cache : %s\n", strerror(st));
+      exit(1);
+    }
+    cache->SetCallbacks(&params);
+  }
 
-  int nbd_num = -1;
-  string nbd_dev;
-  st = NbdLoopbackStart(params, &nbd_num, &nbd_dev);
-  if (st != 0) {
-    fprintf(stderr, "Failed to start loopback : %s\n", strerror(st));
-    exit(1);
+  if (trace_file != nullptr)
+    NbdTraceStart(NBD_TRACE_NUM_EVENTS * 64 * 1024);
+
+  if (net_address != nullptr) {
+    if (serve_net(params, net_address) != 0)
+      exit(1);
+  } else {
+    int nbd_num = -1;
+    string nbd_dev;
+    st = NbdLoopbackStart(params, &nbd_num, &nbd_dev);
+    if (st != 0) {
+      fprintf(stderr, "Failed to start loopback : %s\n", strerror(st));
+      exit(1);
+    }
+    bool terminate = false;
+    thread t([&terminate]() {
+        // Sleeps while idle, spins for 50us after each burst of work.
+        while(!terminate) {
+          NbdLoopbackWait(100, 50);
+        }
+      });
+
+    printf("Started NBD, dev = %s\n", nbd_dev.c_str());
+    printf("Press any key to stop ...\n");
+    getchar();
+    NbdLoopbackStop(nbd_dev);
+    terminate = true;
+    t.join();
+  }
+  if (trace_file != nullptr) {
+    NbdTraceStop();
+    st = NbdTraceDump(trace_file);
+    if (st != 0)
+      fprintf(stderr, "Failed to write trace : %s\n", strerror(st));
+  }
+  if (cache) {
+    BlockCacheStats stats;
+    cache->GetStats(&stats);
+    printf("Cache hit ratio %.2f, %lu read hits, %lu misses, %lu bytes "
+           "dirty, %lu bytes written back\n", stats.hit_ratio,
+           stats.read_hits, stats.read_misses, stats.dirty_bytes,
+           stats.destaged_bytes);
+    // Writes back what is still dirty, the ramdisk has to be around.
+    params = NbdParams();
+    cache.reset();
+  }
+  if (delay_thread.joinable()) {
+    unique_lock<mutex> l(delay_lock);
+    delay_stop = true;
+    delay_cv.notify_one();
+    l.unlock();
+    delay_thread.join();
   }
-  bool terminate = false;
-  thread t([&terminate]() {
-      while(!terminate) {
-        NbdLoopbackPoll();
-        usleep(100);
-      }
-    });
-  
-  printf("Started NBD, dev = %s\n", nbd_dev.c_str());
-  printf("Press any key to stop ...\n");
-  getchar();
-  NbdLoopbackStop(nbd_dev);
-  terminate = true;
-  t.join();
   free(mem);
 
   return 0;
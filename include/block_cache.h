@@ -0,0 +1,299 @@
+// Block cache which can be put in front of the backend callbacks of
+// NbdParams. Data is cached in pages of the device's block size, spread
+// over independently locked shards, each one replacing pages by ARC (or
+// plain LRU). Reads it has the data for complete without calling the
+// backend. Writes either go straight through to the backend, or in
+// write-back mode complete as soon as their data is in the cache and are
+// written back (destaged) later, contiguous dirty pages together and many
+// of them at once. Flushes and FUA writes complete only after the dirty
+// data before them is on the backend and the backend has flushed it.
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include "nbd_server.h"
+#include "list.h"
+
+#include <time.h>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <set>
+#include <unordered_map>
+
+using namespace std;
+
+// Replacement policies.
+#define BLOCK_CACHE_LRU	0
+#define BLOCK_CACHE_ARC	1  // Adaptive replacement cache.
+
+struct BlockCacheParams {
+  // Bytes of data cached, in pages of the device's block size.
+  uint64_t size = 256 * 1024 * 1024;
+  // Pages are spread over this many shards, each with a lock of its own
+  // and an equal share of size. Runs of destage_io_size bytes stay in
+  // one shard.
+  uint32_t num_shards = 16;
+  // One of BLOCK_CACHE_*.
+  uint32_t policy = BLOCK_CACHE_ARC;
+  // Complete writes once their data is in the cache and write them to
+  // the backend later. Otherwise writes go straight to the backend and
+  // drop the pages they cover.
+  bool write_back = false;
+  // Write-back only. Dirty data is written back once there is more than
+  // this many bytes of it (0 = a quarter of size), or once it has been
+  // dirty for dirty_expire_secs (checked from housekeeping).
+  uint64_t dirty_threshold = 0;
+  uint32_t dirty_expire_secs = 5;
+  // Max write backs in flight, each of up to destage_io_size bytes of
+  // contiguous dirty pages.
+  uint32_t destage_depth = 32;
+  uint32_t destage_io_size = 256 * 1024;
+};
+
+struct BlockCacheStats {
+  // Reads served without the backend, and those which needed it for
+  // some or all of their pages.
+  uint64_t read_hits;
+  uint64_t read_misses;
+  // Same, per page. hit_ratio is page_hits over all pages read.
+  uint64_t page_hits;
+  uint64_t page_misses;
+  double hit_ratio;
+  // Pages holding data, and how much of it is not on the backend yet.
+  uint64_t cached_bytes;
+  uint64_t dirty_bytes;
+  // Written back, in how many backend writes, and how many failed.
+  uint64_t destaged_bytes;
+  uint64_t destages;
+  uint64_t destage_errors;
+  // Writes which had to wait for dirty data to be written back first.
+  uint64_t write_stalls;
+};
+
+class BlockCache : public enable_shared_from_this<BlockCache> {
+ public:
+  // Writes back whatever is still dirty first, the backend has to be
+  // around until then.
+  ~BlockCache();
+
+  // Factory method. backend is the NbdParams of the device with the
+  // backend callbacks already set, the cache calls those. Page memory is
+  // allocated up front, destage buffers come from alloc_data_mem().
+  // Returns 0 on success, errno on error.
+  static int New(const BlockCacheParams &params, const NbdParams &backend,
+                 shared_ptr<BlockCache> *ret_cache);
+
+  // Points read, write, flush, trim, write_zeroes (if set) and
+  // housekeeping of params at the cache, and clears submit_batch and
+  // alloc_data_iov: the cache hands the backend batches of its own, and
+  // payloads have to land in server buffers, not in backend storage.
+  // The callbacks keep the cache alive. Call it after anything else which
+  // sets housekeeping (e.g. BufferPool::SetCallbacks()), the cache chains
+  // the one it finds.
+  void SetCallbacks(NbdParams *params);
+
+  // Callbacks, all async except HouseKeeping(). I/O has to be in whole
+  // blocks, anything else fails with EINVAL.
+  void Read(NbdCmd *cmd);
+  void Write(NbdCmd *cmd);
+  void Flush(NbdCmd *cmd);
+  // Trim and write zeroes.
+  void Discard(NbdCmd *cmd);
+  // Writes back data dirty for longer than dirty_expire_secs, then calls
+  // the housekeeping callback of the backend.
+  void HouseKeeping(time_t cur_time);
+
+  void GetStats(BlockCacheStats *stats);
+
+ private:
+  // Page states.
+  enum { kFilling, kClean, kDirty };
+  // Lists a page is on.
+  enum { kNone, kT1, kT2 };
+
+  struct Page {
+    uint64_t index;  // Block number.
+    char *data;
+    uint8_t state = kClean;
+    uint8_t list = kNone;
+    // Written back right now, and written again since that started.
+    bool destaging = false;
+    bool redirtied = false;
+    // Of a kFilling page, the read filling it.
+    void *fill = nullptr;
+    // Write sequence it became dirty at, and of the write which made it
+    // dirty again while destaging.
+    uint64_t dirty_seq = 0;
+    uint64_t redirty_seq = 0;
+    time_t dirty_time = 0;
+    ListLink lru_link;  // In t1 or t2.
+  };
+
+  // ARC history of a page evicted recently.
+  struct Ghost {
+    uint64_t index;
+    uint8_t list;  // kT1 for b1, kT2 for b2.
+    ListLink link;
+  };
+
+  struct alignas(64) Shard {
+    Shard();
+    mutex lock;
+    unordered_map<uint64_t, Page *> pages;
+    // ARC lists, LRU first. With BLOCK_CACHE_LRU only t1 is used.
+    List<Page> t1;
+    List<Page> t2;
+    unordered_map<uint64_t, Ghost *> ghosts;
+    List<Ghost> b1;
+    List<Ghost> b2;
+    uint64_t target_t1 = 0;  // ARC's p, in pages.
+    uint64_t capacity = 0;  // In pages.
+    vector<Page *> free_pages;
+    vector<Ghost *> free_ghosts;
+    // Dirty pages not being written back, by (dirty_seq, index), and the
+    // dirty_seq of each one being written back.
+    set<pair<uint64_t, uint64_t>> dirty;
+    multiset<uint64_t> destaging;
+    uint64_t page_hits = 0;
+    uint64_t page_misses = 0;
+  };
+
+  // A cmd of the cache to the backend.
+  struct Io;
+  enum { kIoFill, kIoWrite, kIoDiscard, kIoDestage, kIoFlush };
+
+  // A write waiting for room, from page next on, or a discard waiting
+  // for write backs of its range to finish.
+  struct Stalled {
+    NbdCmd *cmd;
+    uint64_t next;
+  };
+
+  // A flush, or a FUA write, waiting for the dirty data up to seq.
+  struct FlushWaiter {
+    NbdCmd *cmd;
+    uint64_t seq;
+  };
+
+  BlockCache(const BlockCacheParams &params, const NbdParams &backend);
+  int Init();
+  Shard *ShardOf(uint64_t index) {
+    return &shards_[(index / run_pages_) % num_shards_];
+  }
+  // Block range of cmd. Returns false if it is not in whole blocks.
+  bool PageRange(NbdCmd *cmd, uint64_t *first, uint64_t *end);
+
+  // Replacement, with the shard locked.
+  void Touch(Shard *s, Page *page);
+  // Gets a page for index into the cache, nullptr if every page is
+  // pinned (filling or dirty).
+  Page *Insert(Shard *s, uint64_t index);
+  Page *Evict(Shard *s, bool in_b2);
+  // Least recently used page of list which is not pinned.
+  Page *Victim(List<Page> *list);
+  void Remove(Shard *s, Page *page);
+  void AddGhost(Shard *s, uint64_t index, uint8_t list);
+  void DropGhost(Shard *s, Ghost *ghost);
+  void MarkDirty(Shard *s, Page *page, uint64_t seq, time_t t);
+  void MarkClean(Shard *s, Page *page);
+
+  // Copies the write payload of cmd from page *next on into the cache.
+  // Returns false if it ran out of room, *next is then where it
+  // stopped.
+  bool Absorb(NbdCmd *cmd, uint64_t *next);
+  // Drops pages of [first, end), dirty ones too unless clean_only.
+  void DropRange(uint64_t first, uint64_t end, bool clean_only);
+  // With lock_ held. Whether a write back or discard in flight overlaps
+  // [first, end).
+  bool Overlaps(const vector<pair<uint64_t, uint64_t>> &ranges,
+                uint64_t first, uint64_t end);
+  // With lock_ held. Sends a discard on to the backend, or returns false
+  // if a write back of its range is still in flight.
+  bool StartDiscard(NbdCmd *cmd, vector<NbdCmd *> *ios);
+
+  Io *AllocIo(NbdCmd *orig, uint8_t kind, uint32_t type, uint64_t first,
+              uint64_t end, void *data);
+  void FreeIo(Io *io);
+  // Hands cmds to the backend, in one submit_batch call if it has one.
+  void Submit(vector<NbdCmd *> *cmds);
+  static void IoDone(NbdCmd *cmd);
+  void FillDone(Io *io);
+  void DestageDone(Io *io);
+  void DiscardDone(Io *io);
+
+  // Runs whatever can make progress: write backs, stalled writes and
+  // discards, and flushes. Never runs nested, a call while one is
+  // running makes that one go around again.
+  void Kick();
+  // With lock_ held. Backend cmds to submit go to *ios, client cmds to
+  // complete to *done.
+  void RunDestage(vector<NbdCmd *> *ios);
+  void RunStalled(vector<NbdCmd *> *ios, vector<NbdCmd *> *done);
+  void RunFlushes(vector<NbdCmd *> *ios, vector<NbdCmd *> *done);
+  // Lowest dirty_seq of the dirty data, UINT64_MAX if there is none.
+  uint64_t OldestDirty();
+
+  BlockCacheParams params_;
+  NbdParams backend_;
+  uint32_t block_size_;
+  uint64_t num_blocks_;
+  // Pages per destage_io_size, and the dirty_threshold in pages.
+  uint32_t run_pages_;
+  uint64_t dirty_threshold_;
+  uint64_t num_pages_;
+  unsigned num_shards_;
+  unique_ptr<Shard[]> shards_;
+  unique_ptr<Page[]> pages_;
+  unique_ptr<Ghost[]> ghosts_;
+  // Page memory, mapped up front.
+  void *mem_ = nullptr;
+  size_t mem_size_ = 0;
+  // Coarse clock for dirty_time, set by HouseKeeping().
+  atomic<time_t> now_;
+
+  atomic<uint64_t> write_seq_;
+  atomic<uint64_t> dirty_pages_;
+  atomic<uint64_t> cached_pages_;
+  atomic<uint64_t> read_hits_;
+  atomic<uint64_t> read_misses_;
+  atomic<uint64_t> destaged_bytes_;
+  atomic<uint64_t> destages_;
+  atomic<uint64_t> destage_errors_;
+  atomic<uint64_t> write_stalls_;
+  // Backend cmds in flight, the destructor waits for them.
+  atomic<uint32_t> pending_ios_;
+  // Writes have to queue up behind stalled ones.
+  atomic<bool> stalled_;
+
+  mutex io_lock_;
+  vector<Io *> free_ios_;
+
+  // Protects everything below. Taken before any shard lock.
+  mutex lock_;
+  deque<Stalled> stalled_cmds_;
+  vector<FlushWaiter> flushes_;
+  // Block ranges of write backs and discards in flight. A discard does
+  // not start while a write back of its range is out, and nothing of a
+  // discard's range is written back while it is out.
+  vector<pair<uint64_t, uint64_t>> destage_runs_;
+  vector<pair<uint64_t, uint64_t>> discards_;
+  unsigned destages_out_ = 0;
+  uint64_t destaging_pages_ = 0;
+  // Shard the next write back pass starts at.
+  unsigned destage_shard_ = 0;
+  // Write back everything dirty since before this time.
+  time_t expire_before_ = 0;
+  // A failed write back, reported by the next flush.
+  unsigned destage_error_ = 0;
+  // Set by the destructor, writes back everything.
+  bool closing_ = false;
+
+  // See Kick().
+  mutex kick_lock_;
+  bool kicking_ = false;
+  bool kick_again_ = false;
+};
+
+#endif  // _BLOCK_CACHE_H_
@@ -0,0 +1,165 @@
+// Data buffer pool which can be plugged into NbdParams::alloc_data_mem and
+// free_data_mem. Buffers come in power of two size classes and are carved
+// out of page aligned slabs, optionally backed by hugepages. Every thread
+// allocates from a small per-thread cache which is refilled from, and
+// flushed to, the shared free lists a batch at a time. Idle memory is
+// handed back to the OS lazily from HouseKeeping().
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include "nbd_server.h"
+
+#include <time.h>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// Slabs are at least this big and aligned to it.
+#define BUFFER_POOL_SLAB_SIZE	(2 * 1024 * 1024)
+// Max number of size classes.
+#define BUFFER_POOL_MAX_CLASSES	16
+
+struct BufferPoolParams {
+  // Smallest size class, typically the block size. Rounded up to a power
+  // of two.
+  uint32_t min_size = 4096;
+  // Largest size class, i.e. the max I/O size. Rounded up to a power of
+  // two. Slabs are max(max_size, BUFFER_POOL_SLAB_SIZE) bytes.
+  uint32_t max_size = 1024 * 1024;
+  // Address space reserved up front. The pool never holds more memory
+  // than this, Alloc() fails instead.
+  uint64_t max_bytes = 1ULL << 30;
+  // Back slabs with hugetlb pages. Falls back to transparent hugepages if
+  // none are available.
+  bool hugepages = false;
+  // Bytes per size class kept in each per-thread cache (at least one
+  // buffer), and max number of buffers moved between a cache and the
+  // shared free lists at once.
+  uint32_t cache_bytes = 2 * 1024 * 1024;
+  uint32_t batch_size = 16;
+};
+
+struct BufferPoolClassStats {
+  uint32_t size;
+  // Slabs carved into buffers of this class.
+  uint64_t slabs;
+  // Buffers handed out and not freed yet.
+  uint64_t in_use;
+  // Free buffers in the shared free lists and in the per-thread caches.
+  uint64_t free;
+  uint64_t cached;
+  // Number of Alloc() calls, and how many of them failed.
+  uint64_t allocs;
+  uint64_t failures;
+};
+
+struct BufferPoolStats {
+  uint64_t reserved_bytes;
+  // Memory currently backing slabs, and how much of it is hugetlb.
+  uint64_t slab_bytes;
+  uint64_t hugetlb_bytes;
+  vector<BufferPoolClassStats> classes;
+};
+
+class BufferPool : public enable_shared_from_this<BufferPool> {
+ public:
+  ~BufferPool();
+
+  // Factory method. Returns 0 on success, errno on error.
+  static int New(const BufferPoolParams &params,
+                 shared_ptr<BufferPool> *ret_pool);
+
+  // Returns a page aligned (for sizes of at least a page) buffer of at
+  // least size bytes, nullptr if size is above max_size or the pool is
+  // exhausted. Thread safe.
+  void *Alloc(uint32_t size);
+  // buf has to come from Alloc() of this pool. Thread safe.
+  void Free(void *buf);
+
+  // Flushes caches which were idle since the last call and returns
+  // completely free slabs beyond what was recently needed to the OS.
+  // Does nothing if called again within the same second.
+  void HouseKeeping(time_t cur_time = time(nullptr));
+
+  void GetStats(BufferPoolStats *stats);
+
+  // Points alloc_data_mem, free_data_mem and housekeeping of params at
+  // this pool. The callbacks keep the pool alive.
+  void SetCallbacks(NbdParams *params);
+
+ private:
+  BufferPool(const BufferPoolParams &params);
+  int Init();
+
+  // Per-thread cache. Threads are spread over a fixed number of them, so
+  // the lock is normally uncontended.
+  struct alignas(64) Cache {
+    mutex lock;
+    vector<void *> bufs[BUFFER_POOL_MAX_CLASSES];
+    uint64_t allocs[BUFFER_POOL_MAX_CLASSES] = {};
+    uint64_t frees[BUFFER_POOL_MAX_CLASSES] = {};
+    // Set by Alloc(), cleared by HouseKeeping().
+    bool used[BUFFER_POOL_MAX_CLASSES] = {};
+  };
+
+  struct SizeClass {
+    uint32_t size;
+    uint32_t per_slab;
+    // Per-thread cache limit and transfer batch.
+    uint32_t cache_max;
+    uint32_t batch;
+    vector<void *> free;
+    // Fewest free buffers since the last HouseKeeping(), i.e. buffers
+    // nobody needed.
+    size_t low_water = 0;
+    uint64_t slabs = 0;
+    uint64_t failures = 0;
+  };
+
+  unsigned ClassOf(uint32_t size);
+  Cache *ThreadCache();
+  size_t SlabOf(void *buf) {
+    return ((char *)buf - base_) / slab_size_;
+  }
+  // Moves up to n free buffers of class c to bufs. Caller should be
+  // holding lock_.
+  void Get(unsigned c, unsigned n, vector<void *> *bufs);
+  // Returns the last n buffers of bufs. Caller should be holding lock_.
+  void Put(unsigned c, unsigned n, vector<void *> *bufs);
+  // Backs a slab with memory and fills class c with its buffers.
+  bool CarveSlab(unsigned c);
+  void ReleaseSlab(size_t slab);
+
+  BufferPoolParams params_;
+  unsigned min_shift_;
+  unsigned num_classes_;
+  size_t slab_size_;
+  size_t num_slabs_;
+  // Reserved address range and the slab aligned part of it.
+  void *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  char *base_ = nullptr;
+
+  unique_ptr<Cache[]> caches_;
+  unsigned num_caches_;
+
+  // Protects everything below.
+  mutex lock_;
+  SizeClass classes_[BUFFER_POOL_MAX_CLASSES];
+  // Per slab: owning class (-1 if unused), free buffers of it in the
+  // shared free list and whether it is hugetlb backed.
+  vector<int8_t> slab_class_;
+  vector<uint32_t> slab_free_;
+  vector<bool> slab_hugetlb_;
+  // Released slabs, and the first slab never used.
+  vector<size_t> unused_slabs_;
+  size_t next_slab_ = 0;
+  uint64_t slab_bytes_ = 0;
+  uint64_t hugetlb_bytes_ = 0;
+  atomic<time_t> last_time_;
+};
+
+#endif  // _BUFFER_POOL_H_
@@ -4,7 +4,10 @@
 #include "list.h"
 #include <mutex>
 #include <time.h>
+#include <stddef.h>
 #include <functional>
+#include <memory>
+#include <algorithm>
 
 using namespace std;
 
@@ -120,4 +123,179 @@ void CacheAllocator<T>::HouseKeeping(unique_lock<mutex> *l, time_t cur_time) {
   l->lock();
 }
 
+// Magazine layer in front of an object allocator, after Bonwick's
+// "Magazines and Vmem". Every user (a thread, or anything else that is
+// serialized on its own) has a Cache with two magazines, small stacks of
+// objects. Alloc() and Free() only touch those and take the depot lock
+// just to swap a full or empty magazine once every mag_size calls. The
+// depot keeps full and empty magazines, and HouseKeeping() frees what
+// was not part of the working set since its last run.
+// Unlike CacheAllocator, objects need no ListLink and no lock has to be
+// held by the caller.
+template <class T>
+class MagazineAllocator {
+ public:
+  class Magazine {
+   public:
+    Magazine(unsigned size) : objs(new T*[size]) {}
+    ListLink link;
+    unsigned rounds = 0;
+    unique_ptr<T*[]> objs;
+  };
+
+  // Per user magazines. Must only be used by one thread at a time.
+  class Cache {
+   public:
+    Magazine *loaded = nullptr;
+    Magazine *previous = nullptr;
+  };
+
+  MagazineAllocator(function<T*(void*)> alloc_func, void *alloc_arg,
+                    function<void(void*, T*)> free_func, void *free_arg,
+                    unsigned mag_size = 32);
+  // Every Cache has to be Drain()ed before this.
+  ~MagazineAllocator();
+  T *Alloc(Cache *c);
+  void Free(Cache *c, T *e);
+  // Hands the magazines of c back to the depot.
+  void Drain(Cache *c);
+
+  // Polling function, called at regular intervals. Typically expected to be
+  // called at 1 second boundary.
+  void HouseKeeping(time_t cur_time=time(nullptr));
+
+ private:
+  // Frees mag and all objects in it. Called without the lock.
+  void FreeMagazine(Magazine *mag);
+
+  unsigned mag_size_;
+  function<T*(void*)> alloc_func_;
+  void *alloc_arg_;
+  function<void(void*, T*)> free_func_;
+  void *free_arg_;
+  // Depot, protected by lock_.
+  mutex lock_;
+  List<Magazine> full_mags_;
+  List<Magazine> empty_mags_;
+  // Fewest magazines in each list since the last HouseKeeping(), i.e.
+  // how many were not needed.
+  unsigned full_low_ = 0;
+  unsigned empty_low_ = 0;
+  time_t last_time_ = 0;
+};
+
+template <class T>
+MagazineAllocator<T>::MagazineAllocator(
+    function<T*(void*)> alloc_func, void *alloc_arg,
+    function<void(void*, T*)> free_func, void *free_arg,
+    unsigned mag_size) :
+    mag_size_(mag_size),
+    full_mags_(offsetof(Magazine, link)),
+    empty_mags_(offsetof(Magazine, link)) {
+  alloc_func_ = alloc_func;
+  alloc_arg_ = alloc_arg;
+  free_func_ = free_func;
+  free_arg_ = free_arg;
+}
+
+template <class T>
+MagazineAllocator<T>::~MagazineAllocator() {
+  Magazine *mag;
+  while ((mag = full_mags_.PopFront()) != nullptr)
+    FreeMagazine(mag);
+  while ((mag = empty_mags_.PopFront()) != nullptr)
+    FreeMagazine(mag);
+}
+
+template <class T>
+void MagazineAllocator<T>::FreeMagazine(Magazine *mag) {
+  for (unsigned i = 0; i < mag->rounds; i++)
+    free_func_(free_arg_, mag->objs[i]);
+  delete mag;
+}
+
+template <class T>
+T* MagazineAllocator<T>::Alloc(Cache *c) {
+  if (c->loaded && (c->loaded->rounds > 0))
+    return c->loaded->objs[--c->loaded->rounds];
+  if (c->previous && (c->previous->rounds > 0)) {
+    swap(c->loaded, c->previous);
+    return c->loaded->objs[--c->loaded->rounds];
+  }
+  unique_lock<mutex> l(lock_);
+  Magazine *full = full_mags_.PopFront();
+  if (full != nullptr) {
+    full_low_ = min(full_low_, full_mags_.size());
+    // loaded is empty, keep it around for frees.
+    if (c->previous)
+      empty_mags_.PushFront(c->previous);
+    c->previous = c->loaded;
+    c->loaded = full;
+    return full->objs[--full->rounds];
+  }
+  l.unlock();
+  return alloc_func_(alloc_arg_);
+}
+
+template <class T>
+void MagazineAllocator<T>::Free(Cache *c, T *e) {
+  if (c->loaded && (c->loaded->rounds < mag_size_)) {
+    c->loaded->objs[c->loaded->rounds++] = e;
+    return;
+  }
+  if (c->previous && (c->previous->rounds < mag_size_)) {
+    swap(c->loaded, c->previous);
+    c->loaded->objs[c->loaded->rounds++] = e;
+    return;
+  }
+  unique_lock<mutex> l(lock_);
+  // previous (if any) is full, loaded becomes the new previous.
+  if (c->previous)
+    full_mags_.PushFront(c->previous);
+  c->previous = c->loaded;
+  Magazine *empty = empty_mags_.PopFront();
+  empty_low_ = min(empty_low_, empty_mags_.size());
+  l.unlock();
+  if (empty == nullptr)
+    empty = new Magazine(mag_size_);
+  c->loaded = empty;
+  empty->objs[empty->rounds++] = e;
+}
+
+template <class T>
+void MagazineAllocator<T>::Drain(Cache *c) {
+  unique_lock<mutex> l(lock_);
+  for (Magazine *mag : { c->loaded, c->previous }) {
+    if (mag == nullptr)
+      continue;
+    if (mag->rounds > 0)
+      full_mags_.PushFront(mag);
+    else
+      empty_mags_.PushFront(mag);
+  }
+  c->loaded = c->previous = nullptr;
+}
+
+template <class T>
+void MagazineAllocator<T>::HouseKeeping(time_t cur_time) {
+  unique_lock<mutex> l(lock_);
+  if (cur_time == last_time_)
+    return;
+  last_time_ = cur_time;
+  // Free half of what sat unused in the depot all along.
+  List<Magazine> freed(offsetof(Magazine, link));
+  unsigned excess = full_low_ >> 1;
+  for (unsigned i = 0; i < excess; i++)
+    freed.PushFront(full_mags_.PopBack());
+  excess = empty_low_ >> 1;
+  for (unsigned i = 0; i < excess; i++)
+    freed.PushFront(empty_mags_.PopBack());
+  full_low_ = full_mags_.size();
+  empty_low_ = empty_mags_.size();
+  l.unlock();
+  Magazine *mag;
+  while ((mag = freed.PopFront()) != nullptr)
+    FreeMagazine(mag);
+}
+
 #endif  // _CACHE_ALLOCATOR_H_
@@ -0,0 +1,93 @@
+// Lock free, allocation free, multi producer single consumer queue.
+// This is the intrusive queue by Dmitry Vyukov: Push() is a single
+// atomic exchange and never waits, Pop() must only be called by one
+// thread at a time.
+#ifndef _MPSC_QUEUE_H_
+#define _MPSC_QUEUE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+class MpscLink {
+ public:
+  MpscLink() { next = nullptr; }
+  std::atomic<MpscLink *> next;
+};
+
+template <class T>
+class MpscQueue {
+ public:
+  MpscQueue(int offset) : off_(offset) {
+    head_ = &stub_;
+    tail_ = &stub_;
+  }
+
+  // Can be called by any number of threads.
+  void Push(T *obj) {
+    Push(Link(obj));
+  }
+
+  // Pushes n objects, in order, with a single atomic exchange.
+  void PushBatch(T **objs, unsigned n) {
+    if (n == 0)
+      return;
+    for (unsigned i = 0; i + 1 < n; i++)
+      Link(objs[i])->next.store(Link(objs[i + 1]), std::memory_order_relaxed);
+    MpscLink *last = Link(objs[n - 1]);
+    last->next.store(nullptr, std::memory_order_relaxed);
+    MpscLink *prev = head_.exchange(last);
+    prev->next.store(Link(objs[0]), std::memory_order_release);
+  }
+
+  // Returns nullptr if the queue is empty, or if the only remaining
+  // object is still being pushed. Consumer only.
+  T *Pop() {
+    MpscLink *tail = tail_;
+    MpscLink *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+      if (next == nullptr)
+        return nullptr;
+      tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+      tail_ = next;
+      return At(tail);
+    }
+    if (tail != head_.load(std::memory_order_acquire))
+      return nullptr;
+    // tail is the last object, put the stub behind it so that it can be
+    // unlinked.
+    Push(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail_ = next;
+      return At(tail);
+    }
+    return nullptr;
+  }
+
+  // Safe from any thread. Once the consumer has popped everything, the
+  // stub is the last object pushed.
+  bool Empty() { return head_.load() == &stub_; }
+
+ private:
+  void Push(MpscLink *link) {
+    link->next.store(nullptr, std::memory_order_relaxed);
+    MpscLink *prev = head_.exchange(link);
+    prev->next.store(link, std::memory_order_release);
+  }
+  T *At(MpscLink *link) { return (T *)(((uint8_t *)link) - off_); }
+  MpscLink *Link(T *obj) { return (MpscLink *)(((uint8_t *)obj) + off_); }
+
+  // Producers only touch head_, keep it away from the consumer's tail_.
+  alignas(64) std::atomic<MpscLink *> head_;
+  alignas(64) MpscLink *tail_;
+  MpscLink stub_;
+  int off_;
+};
+
+#endif  // _MPSC_QUEUE_H_
@@ -0,0 +1,94 @@
+// Capture of the requests nbd devices receive into a compact binary
+// file, for replaying real workloads offline with examples/nbdreplay,
+// see NbdParams::capture. One capture can be shared by every connection
+// of a device, each connection buffers its records and appends them a
+// batch at a time.
+//
+// The file is an NbdCaptureHeader followed by NbdCaptureRecords, both
+// in host byte order. Records of a connection are in arrival order,
+// those of different connections are not ordered among each other.
+#ifndef _NBD_CAPTURE_H_
+#define _NBD_CAPTURE_H_
+
+#include "nbd_server.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define NBD_CAPTURE_MAGIC	0x3154504143444e42ULL  // "NBDCAPT1"
+#define NBD_CAPTURE_VERSION	1
+
+// NbdCaptureHeader::flags.
+#define NBD_CAPTURE_HASHED	(1 << 0)  // Writes have payload hashes.
+
+// NbdCaptureRecord::flags.
+#define NBD_CAPTURE_FUA		(1 << 0)
+#define NBD_CAPTURE_NO_HOLE	(1 << 1)
+
+struct NbdCaptureHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t flags;
+  uint32_t block_size;
+  uint32_t rsvd;
+  uint64_t num_blocks;
+};
+
+struct NbdCaptureRecord {
+  uint64_t time_ns;  // Arrival of the header, since the capture started.
+  uint64_t offset;
+  // NbdCapture::Hash() of the payload of a write, 0 if not hashed.
+  uint64_t hash;
+  uint32_t len;
+  uint16_t conn;  // Connection of the device it came in on.
+  uint8_t type;  // NBD_CMD_*
+  uint8_t flags;  // NBD_CAPTURE_FUA, NBD_CAPTURE_NO_HOLE
+};
+
+class NbdCapture {
+ public:
+  ~NbdCapture();
+
+  // Creates the file at path for the device params describes. With
+  // hash_payload, write payloads received whole are hashed, which reads
+  // each of them once more. Returns 0 on success, errno otherwise.
+  static int New(const string &path, const NbdParams &params,
+                 bool hash_payload, shared_ptr<NbdCapture> *ret_capture);
+  // Reads a capture file. Returns 0 on success, EINVAL if it is not
+  // one, errno otherwise.
+  static int Read(const string &path, NbdCaptureHeader *header,
+                  vector<NbdCaptureRecord> *records);
+
+  // 64-bit hash of the bytes in iov, the same however they are split.
+  static uint64_t Hash(const struct iovec *iov, int iovcnt);
+
+  bool hash_payload() const { return hash_payload_; }
+  // Numbers the connections of a device.
+  uint16_t NewConn() { return next_conn_++; }
+  // Arrival time of a record, from a NbdStatsCounters::Now() timestamp.
+  uint64_t TimeNs(uint64_t ticks) const {
+    return (ticks > start_ticks_) ? (ticks - start_ticks_) * ns_per_tick_ :
+                                    0;
+  }
+  // Appends n records to the file, thread safe.
+  void Write(const NbdCaptureRecord *records, unsigned n);
+  // Records written so far, and the first error writing them, 0 if none.
+  void GetStats(uint64_t *records, int *error);
+
+ private:
+  NbdCapture() {}
+
+  bool hash_payload_ = false;
+  uint64_t start_ticks_ = 0;
+  double ns_per_tick_ = 1.0;
+  atomic<uint16_t> next_conn_{0};
+  // Protects the rest.
+  mutex lock_;
+  int fd_ = -1;
+  uint64_t records_ = 0;
+  int error_ = 0;
+};
+
+#endif  // _NBD_CAPTURE_H_
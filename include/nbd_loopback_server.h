@@ -7,13 +7,56 @@
 #include "nbd_server.h"
 
 // This has to be called before any of the other functions.
-// Returns 0 on success, errno on error.
-int NbdLoopbackInit();
-// if nbd_num < 0, an appropriate num is picked and returned.
+// Devices are configured over the nbd generic netlink interface when the
+// kernel supports it (and use_netlink is set), otherwise the older ioctl
+// interface is used.
+// Returns 0 on success, errno on error. ENOENT means there are no nbd
+// devices, ublk devices can still be started.
+int NbdLoopbackInit(bool use_netlink = true);
+// if nbd_num < 0, an appropriate num is picked and returned. With
+// params.transport set to NBD_TRANSPORT_UBLK, nbd_num is the ublk device
+// id and ret_nbd_dev is /dev/ublkbN. A ublk device only shows up once
+// each of its queues has been polled.
 // Returns 0 on success, errno on error.
 int NbdLoopbackStart(
     const NbdParams &params, int *nbd_num, string *ret_nbd_dev);
 void NbdLoopbackStop(const string &nbd_node);
-void NbdLoopbackPoll();
+// Sums the merge counters (see NbdParams::merge_max_size) of all
+// connections of a device. Returns 0 on success, ENOENT if there is no
+// such device.
+int NbdLoopbackGetMergeStats(const string &nbd_node, NbdMergeStats *stats);
+// Counters of the prefetcher of a device (see NbdParams::prefetch_size),
+// all zero if it has none. Returns 0 on success, ENOENT if there is no
+// such device.
+int NbdLoopbackGetPrefetchStats(const string &nbd_node,
+                                NbdPrefetchStats *stats);
+// Sums the counters and latency histograms (see NbdParams::stats) of all
+// connections of a device. Returns 0 on success, ENOENT if there is no
+// such device.
+int NbdLoopbackGetStats(const string &nbd_node, NbdStats *stats);
+// Polls every device once. Returns true if any work was done.
+bool NbdLoopbackPoll();
+// Polls every device until there is work or timeout_ms passes (-1 waits
+// forever), parking the caller in epoll on the device sockets while
+// there is nothing to do. After any work the caller keeps busy polling
+// for spin_us before it parks again, which keeps latency low under load
+// without burning a core on idle devices.
+// Returns true if any work was done.
+bool NbdLoopbackWait(int timeout_ms, unsigned spin_us = 0);
+
+// Poll groups split the connections of all devices between poll
+// threads. Each connection belongs to one group (NbdParams::poll_group),
+// and a thread polling its own group takes no global lock. Group 0 is
+// created by NbdLoopbackInit().
+// Returns 0 and the new group in *group_id on success, errno on error.
+int NbdLoopbackCreatePollGroup(int *group_id);
+// Polls every connection of group_id once. If there was nothing to do
+// and steal is set, helps out the next group which had work on its
+// last poll. Returns true if any work was done.
+bool NbdLoopbackPollGroup(int group_id, bool steal = true);
+// Same as NbdLoopbackWait() for a single group. Parked threads only
+// wake up for their own group.
+bool NbdLoopbackWaitGroup(int group_id, int timeout_ms,
+                          unsigned spin_us = 0, bool steal = true);
 
 #endif  // _NBD_LOOPBACK_SERVER_H_
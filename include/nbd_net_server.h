@@ -0,0 +1,122 @@
+// Serves devices to nbd clients over the network (nbd-client, qemu,
+// libnbd, ...) instead of to the local nbd driver. Clients connect over
+// TCP or a Unix socket and go through the fixed newstyle handshake, after
+// which every connection runs the same NbdServer data path as a loopback
+// device, with the callbacks of the export it picked.
+#ifndef _NBD_NET_SERVER_H_
+#define _NBD_NET_SERVER_H_
+
+#include "nbd_server.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+// IANA assigned nbd port.
+#define NBD_NET_DEFAULT_PORT	10809
+
+struct NbdNetParams {
+  // Where to listen. A path (anything with a '/') is a Unix socket,
+  // otherwise a host name or address to listen on port. Empty listens
+  // on every address.
+  string address;
+  // 0 picks a free port, see NbdNetServer::port().
+  uint16_t port = NBD_NET_DEFAULT_PORT;
+  // Clients which take longer than this for the handshake are dropped.
+  unsigned handshake_timeout_ms = 10000;
+};
+
+class NbdNetServer {
+ public:
+  ~NbdNetServer();
+
+  // Factory method. Starts listening right away, clients get to
+  // transmission once there is an export they ask for.
+  // Returns 0 on success, errno on error.
+  static int New(const NbdNetParams &params,
+                 unique_ptr<NbdNetServer> *ret_server);
+
+  // Adds an export, callbacks and tuning as for NbdLoopbackStart() with
+  // the nbd transport. num_connections is how many clients may have it
+  // open at once, above one NBD_FLAG_CAN_MULTI_CONN is advertised, so the
+  // backend has to be consistent across connections. Clients which did
+  // not name an export get the one named "".
+  // Returns 0 on success, EEXIST if the name is taken, EINVAL if params
+  // are invalid.
+  int AddExport(const string &name, const NbdParams &params,
+                const string &description = "");
+
+  // Polls every connection once, and drops the ones which are done.
+  // Thread safe. Returns true if any work was done.
+  bool Poll();
+  // Same, but if there was nothing to do sleeps until there is or
+  // timeout_ms passes (-1 waits forever).
+  bool Wait(int timeout_ms);
+
+  // The port listened on, 0 for a Unix socket.
+  uint16_t port() { return port_; }
+  // Connections in transmission.
+  unsigned num_connections();
+
+ private:
+  struct Export {
+    string name;
+    string description;
+    NbdParams params;
+    // Connections to it, under lock_.
+    unsigned conns = 0;
+  };
+
+  struct Conn {
+    unique_ptr<NbdServer> server;
+    Export *exp = nullptr;
+    // Held by whichever thread is polling the server.
+    atomic<bool> busy;
+    bool removed = false;
+  };
+
+  NbdNetServer(const NbdNetParams &params);
+  int Listen();
+  int ListenTcp(int family);
+  void AcceptThread();
+  // Runs the handshake with the client on fd and hands the connection
+  // to the pollers. Closes fd on failure.
+  void Handshake(int fd);
+  // Option haggling. Returns the export picked, with a connection
+  // reserved, or nullptr if the client went away or broke the protocol.
+  Export *Negotiate(int fd, bool *structured);
+  // Finds an export and reserves a connection to it. Returns nullptr
+  // and the NBD_REP_ERR_* to reply with if that fails.
+  Export *Reserve(const string &name, uint32_t *err);
+  // Replies to NBD_OPT_INFO and NBD_OPT_GO. Returns the export for GO,
+  // with a connection reserved.
+  Export *ReplyInfo(int fd, uint32_t opt, const string &data, bool *ok);
+  uint16_t ExportFlags(const Export *exp);
+  shared_ptr<vector<shared_ptr<Conn>>> Conns();
+  void RemoveConn(Conn *conn);
+
+  NbdNetParams params_;
+  int listen_fd_ = -1;
+  uint16_t port_ = 0;
+  unique_ptr<thread> accept_thread_;
+  // Wakes up Wait() when a connection is added or has replies to send.
+  int wakeup_fd_ = -1;
+  atomic<int> sleepers_;
+  atomic<unsigned> poll_count_;
+  atomic<bool> stop_;
+
+  // Protects everything below. Like poll groups, the data path only
+  // takes it to grab the current connection list, which is copied on
+  // every change.
+  mutex lock_;
+  map<string, unique_ptr<Export>> exports_;
+  shared_ptr<vector<shared_ptr<Conn>>> conns_;
+  // Sockets in the handshake, shut down to get rid of them on exit.
+  set<int> handshake_fds_;
+  unsigned handshakes_ = 0;
+};
+
+#endif  // _NBD_NET_SERVER_H_
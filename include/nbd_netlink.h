@@ -0,0 +1,47 @@
+// Minimal generic netlink client for the kernel nbd family. This lets
+// the loopback server configure devices without a thread parked in
+// ioctl(NBD_DO_IT).
+#ifndef _NBD_NETLINK_H_
+#define _NBD_NETLINK_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+class NbdNetlink {
+ public:
+  ~NbdNetlink();
+
+  // Factory method. Fails (with errno) if the kernel does not expose
+  // the nbd generic netlink family, callers should then fall back to
+  // the ioctl interface.
+  static int New(unique_ptr<NbdNetlink> *ret_nl);
+
+  // Attaches socks to an nbd device and starts it. If *index < 0, the
+  // kernel picks (or creates) a free device and *index is set to it.
+  // dead_conn_timeout is in seconds, 0 leaves the kernel default.
+  // Returns 0 on success, errno on error.
+  int Connect(int *index, uint64_t size_bytes, uint64_t block_size,
+              uint64_t server_flags, uint64_t dead_conn_timeout,
+              const vector<int> &socks);
+  // Returns 0 on success, errno on error.
+  int Disconnect(int index);
+
+ private:
+  NbdNetlink() {}
+  // Sends the message in buf and waits for the kernel's ack. If index
+  // is not null, it is set from an NBD_ATTR_INDEX in the reply.
+  int Transact(void *buf, uint32_t len, int *index);
+
+  // Serializes requests on the socket, replies are matched by seq_.
+  mutex lock_;
+  int fd_ = -1;
+  uint16_t family_id_ = 0;
+  uint32_t seq_ = 0;
+};
+
+#endif  // _NBD_NETLINK_H_
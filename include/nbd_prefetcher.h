@@ -0,0 +1,128 @@
+// Readahead for nbd devices. Watches the reads a device receives for
+// sequential and strided streams, reads ahead of each one into buffers
+// of its own and serves later reads from there, see
+// NbdParams::prefetch_size. One prefetcher is shared by all connections
+// of a device, every call is thread safe.
+#ifndef _NBD_PREFETCHER_H_
+#define _NBD_PREFETCHER_H_
+
+#include "nbd_server.h"
+
+#include <map>
+
+using namespace std;
+
+// Results of NbdPrefetcher::Read().
+#define NBD_PREFETCH_MISS	0  // Goes to the backend.
+#define NBD_PREFETCH_HIT	1  // Data is copied in, complete the read.
+#define NBD_PREFETCH_WAIT	2  // Handed out by Done() of a prefetch.
+
+// Data prefetched, or being prefetched, for len bytes at offset.
+struct NbdPrefetch {
+  uint64_t offset;
+  uint32_t len;
+  void *data;
+  uint32_t used = 0;  // Bytes served from it.
+  bool ready = false;  // The data is in.
+  bool dropped = false;  // Dropped while in flight, Done() frees it.
+  // Stream slot it was read for, and the generation of that slot.
+  unsigned stream;
+  uint32_t stream_gen;
+  // Reads waiting for the data.
+  vector<NbdCmd *> waiters;
+  // In NbdPrefetcher::lru_ once ready.
+  ListLink lru_link;
+};
+
+class NbdPrefetcher {
+ public:
+  ~NbdPrefetcher();
+
+  // Factory method, sized by params.prefetch_size and
+  // params.prefetch_max_window. Buffers come from alloc_data_mem().
+  // Returns 0 on success, EINVAL if readahead is off in params.
+  static int New(const NbdParams &params,
+                 shared_ptr<NbdPrefetcher> *ret_prefetcher);
+
+  // Looks up a received read and feeds it to stream detection. Returns
+  // one of NBD_PREFETCH_*. Prefetches the read calls for are appended to
+  // *issue, the caller reads len bytes at offset into data for each and
+  // calls Done() with the result.
+  int Read(NbdCmd *cmd, vector<NbdPrefetch *> *issue);
+  // Of a prefetch which completed, error is its result. Moves the reads
+  // waiting for it to *waiters, with the data copied in. If it failed
+  // they are left as they were, to be read from the backend instead.
+  void Done(NbdPrefetch *pf, unsigned error, vector<NbdCmd *> *waiters);
+  // Drops prefetched data overlapping len bytes at offset. Called as a
+  // write, trim or write zeroes completes: a prefetch which raced with
+  // it may hold either version, one issued after it has the new one.
+  void Invalidate(uint64_t offset, uint64_t len);
+
+  void GetStats(NbdPrefetchStats *stats);
+
+ private:
+  // Stream detection state. A read starting where a stream ended
+  // continues it sequentially, one as long as the last read and a
+  // stride after it continues it as a strided stream.
+  struct Stream {
+    uint64_t last = 0;  // Offset of the last read.
+    uint64_t end = 0;  // Where the last read ended.
+    uint64_t stride = 0;  // 0 for a sequential stream.
+    uint32_t len = 0;  // Of the last read.
+    uint32_t hits = 0;  // Reads in a row which matched.
+    // Sequential: prefetched up to here. Strided: the next read to
+    // prefetch.
+    uint64_t ahead = 0;
+    uint32_t window = 0;  // Bytes to keep prefetched.
+    uint32_t gen = 0;  // Bumped whenever the slot is reused.
+    uint64_t tick = 0;  // Last use, 0 = free.
+  };
+
+  NbdPrefetcher(const NbdParams &params);
+  // Serves cmd from prefetches which are in or wait for the one being
+  // read. Returns NBD_PREFETCH_*.
+  int Lookup(NbdCmd *cmd);
+  void Detect(uint64_t offset, uint32_t len, vector<NbdPrefetch *> *issue);
+  // Sets up a prefetch for s unless the range is prefetched already.
+  // Returns false if there is no room for it.
+  bool Issue(Stream *s, uint64_t offset, uint32_t len,
+             vector<NbdPrefetch *> *issue);
+  // Drops ready prefetches no stream needs anymore, least recently used
+  // first, until len more bytes fit. Returns false if they do not.
+  bool MakeRoom(uint32_t len);
+  bool Evictable(NbdPrefetch *pf);
+  // Takes pf out of the map and frees it, or leaves that to Done() if
+  // it is in flight.
+  void Drop(NbdPrefetch *pf);
+  void Free(NbdPrefetch *pf);
+  // Accounts len bytes of pf served, frees it once all of it was.
+  void Used(NbdPrefetch *pf, uint32_t len);
+  // Copies len bytes from off into pf to cmd_off into the data of cmd.
+  void CopyOut(NbdPrefetch *pf, uint32_t off, NbdCmd *cmd,
+               uint32_t cmd_off, uint32_t len);
+  // The stream pf was read for, null if the slot was reused since.
+  Stream *StreamOf(NbdPrefetch *pf);
+
+  uint64_t size_;
+  uint32_t max_window_;
+  uint32_t max_io_size_;
+  uint64_t dev_size_;
+  function<void*(unsigned)> alloc_data_mem_;
+  function<void(void*)> free_data_mem_;
+
+  // Protects everything below.
+  mutex lock_;
+  // Prefetches by offset, they never overlap.
+  map<uint64_t, NbdPrefetch *> prefetches_;
+  // Lets Invalidate() skip the lock while there is nothing to drop.
+  atomic<uint32_t> num_prefetches_;
+  // Ready prefetches, least recently used first.
+  List<NbdPrefetch> lru_;
+  // Bytes of all prefetches, including dropped ones in flight.
+  uint64_t bytes_ = 0;
+  vector<Stream> streams_;
+  uint64_t tick_ = 0;
+  NbdPrefetchStats stats_;
+};
+
+#endif  // _NBD_PREFETCHER_H_
@@ -2,10 +2,14 @@
 #define _NBD_SERVER_H_
 
 #include "list.h"
+#include "mpsc_queue.h"
 #include "cache_allocator.h"
+#include "nbd_stats.h"
 #include <sys/ioctl.h>
 #include <linux/ioctl.h>
 #include <linux/nbd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <stdint.h>
 
@@ -13,9 +17,39 @@
 #include <memory>
 #include <atomic>
 #include <mutex>
+#include <deque>
+#include <vector>
 
 class NbdCmd;
 class NbdServer;
+class NbdUring;
+class NbdPrefetcher;
+class NbdCapture;
+struct NbdCaptureRecord;
+struct NbdPrefetch;
+class UblkQueue;
+
+// Kernel drivers a device can be exposed through.
+#define NBD_TRANSPORT_NBD	0  // nbd, requests come over a socket.
+#define NBD_TRANSPORT_UBLK	1  // ublk, requests come over io_uring.
+
+// Newer than some of the uapi headers around.
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+#define NBD_CMD_WRITE_ZEROES	6
+#define NBD_FLAG_SEND_WRITE_ZEROES	(1 << 6)
+#define NBD_CMD_FLAG_NO_HOLE	(1 << 17)
+#endif
+
+// Max number of iovecs NbdParams::alloc_data_iov may return.
+#define NBD_MAX_DATA_IOV	256
+
+// Room for the reply header in front of read data, a simple reply or up
+// to two hole chunks and a data chunk header.
+#define NBD_MAX_REPLY_HDR	92
+
+// I/O engines driving the NbdServer socket.
+#define NBD_IO_ENGINE_SOCKET	0  // Non-blocking read()/write().
+#define NBD_IO_ENGINE_URING	1  // io_uring, see nbd_uring.h.
 
 class NbdParams {
  public:
@@ -24,17 +58,178 @@ class NbdParams {
   uint32_t rsvd;
   uint64_t num_blocks;
 
+  // One of NBD_TRANSPORT_*.
+  uint32_t transport = NBD_TRANSPORT_NBD;
+  // Number of sockets attached to the device. Each connection gets its
+  // own NbdServer, the kernel maps its hardware queues onto them, and
+  // each one can be polled by a different thread. With ublk this is the
+  // number of hardware queues.
+  uint32_t num_connections = 1;
+  // Max requests in flight per ublk queue. The nbd driver has its own,
+  // there it only sizes the cmd slab (see cmd_slab).
+  uint32_t queue_depth = 128;
+  // Preallocate queue_depth cmds per server in one contiguous, cache line
+  // aligned array instead of allocating each one from the heap. Cmds
+  // beyond that still come from the heap.
+  bool cmd_slab = false;
+  // Largest read or write the device takes, in bytes. The kernel is told
+  // to split bigger requests (max_sectors_kb with nbd, max_sectors with
+  // ublk), anything larger that still shows up fails with EINVAL.
+  uint32_t max_io_size = 1024 * 1024;
+  // Seconds the kernel waits for a dead connection to be replaced before
+  // failing I/O. Only used with netlink configuration, 0 = kernel default.
+  uint32_t dead_conn_timeout = 0;
+  // Poll group the connections are assigned to, see
+  // NbdLoopbackCreatePollGroup(). -1 puts each connection in the group
+  // with the fewest connections.
+  int poll_group = -1;
+  // Size of the per-connection receive buffer. If non-zero, the server
+  // reads as much of the socket as fits in one readv() and parses every
+  // complete request in it. 0 reads each header and payload separately.
+  uint32_t rcv_buf_size = 0;
+  // Max number of replies gathered into one writev(). 0 sends the reply
+  // header and read data of one cmd at a time with write().
+  uint32_t send_batch_size = 0;
+  // One of NBD_IO_ENGINE_*. With the io_uring engine a multishot receive
+  // stays armed into provided buffers of rcv_buf_size bytes (64K if not
+  // set) and up to send_batch_size replies go out as one linked chain of
+  // sends. Completions are reaped inside DataPoll().
+  uint32_t io_engine = NBD_IO_ENGINE_SOCKET;
+  // Ring for the io_uring engine. Several servers may share one ring as
+  // long as it is created with enough entries, any poller then reaps
+  // completions on behalf of all of them. If null, each server creates
+  // its own.
+  shared_ptr<NbdUring> uring;
+  // Read payloads of at least this many bytes are sent with MSG_ZEROCOPY
+  // (IORING_OP_SEND_ZC with the io_uring engine), so the socket refers
+  // to data_buf instead of copying it. free_data_mem() is then deferred
+  // until the kernel reports the pages released. 0 disables it. Sockets
+  // without SO_ZEROCOPY support (e.g. AF_UNIX) always copy.
+  uint32_t zerocopy_threshold = 0;
+
   // Argument for the callback functions.
   void *arg;
 
   // Memory allocation callbacks (sync.)
   function<void*(unsigned)> alloc_data_mem;
   function<void(void*)> free_data_mem;
+  // Optional, nbd transport only. If set, it is asked first for the data
+  // buffer of every read and write: it gets the cmd with req.type,
+  // io_offset and io_size set and fills up to max_iov (NBD_MAX_DATA_IOV)
+  // iovecs covering io_size bytes, which may point straight into the
+  // backend's own storage. Write payloads are then read from the socket
+  // into them and read data is sent from them, data_buf stays null and
+  // data_iov / data_iovcnt describe the buffer instead. Returns the
+  // number of iovecs, 0 to fall back to alloc_data_mem() for this cmd,
+  // or -1 on failure. free_data_iov() is called once the server is done
+  // with them (after the reply is sent). Such cmds are not merged, and
+  // stream_chunk_size is ignored. Sync, like alloc_data_mem.
+  function<int(void *, NbdCmd *, struct iovec *iov, unsigned max_iov)>
+      alloc_data_iov;
+  function<void(void *, NbdCmd *)> free_data_iov;
+  // Optional, called from ConfigPoll() about once a second, e.g. to let
+  // a BufferPool (buffer_pool.h) give idle memory back.
+  function<void(void *, time_t)> housekeeping;
 
   // Note: all callbacks, except disconnect, are async.
   // disconnect is optional and if defined, is sync.
   function<void(void *, NbdCmd*)>
       read, write, trim, flush, disconnect;
+  // Optional. If set, the device takes NBD_CMD_WRITE_ZEROES (ublk
+  // UBLK_IO_OP_WRITE_ZEROES): io_size bytes at io_offset are to read
+  // back as zeroes, there is no data_buf. If cmd->no_hole is set the
+  // blocks have to stay allocated, otherwise the backend may deallocate
+  // them. With submit_batch they come in the batch instead.
+  function<void(void *, NbdCmd*)> write_zeroes;
+  // Optional. If set, it replaces read, write, trim and flush: every cmd
+  // received in one poll pass is handed over in a single call, so the
+  // backend can submit them with one doorbell or syscall. Dispatch is on
+  // cmd->req.type (NBD_CMD_*). The array is only valid during the call.
+  function<void(void *, NbdCmd **cmds, unsigned n)> submit_batch;
+
+  // Merging of contiguous requests. If merge_max_size is set, reads (and
+  // writes without FUA) received back to back, each starting where the
+  // previous one ended, are handed to the backend as one cmd of up to
+  // merge_max_size bytes with a buffer of its own. Write data is copied
+  // in before, read data out after the backend call, and the result goes
+  // to each of the original cmds. At most merge_window received cmds are
+  // held back before they are passed on (max 64).
+  uint32_t merge_max_size = 0;
+  uint32_t merge_window = 32;
+
+  // Streaming of large requests, nbd transport only. If set, the payload
+  // of a write bigger than stream_chunk_size is received into buffers of
+  // that size, and each one goes to the backend as a write of its own as
+  // soon as it is complete, instead of all of it landing in one buffer
+  // before the backend hears of it. The reply follows the last chunk.
+  // Reads are likewise handed to the backend as chunk sized reads into
+  // one buffer, and with the socket engine the reply starts once the
+  // first chunk is filled and the data follows chunk by chunk. A chunk
+  // failing after that can no longer be reported and drops the
+  // connection.
+  uint32_t stream_chunk_size = 0;
+
+  // Zero detection, nbd transport only, needs write_zeroes. If set,
+  // write payloads are scanned a block at a time (SSE2/AVX2 where
+  // available), and runs of all-zero blocks of at least this many bytes,
+  // or an all-zero payload of any size, go to the backend as write
+  // zeroes with no_hole set instead of as data. The rest of the payload
+  // goes as writes of its own, the reply follows the last of them. With
+  // stream_chunk_size, each chunk is checked as a whole instead.
+  uint32_t zero_detect_size = 0;
+
+  // Sends read replies as NBD structured replies: zero blocks at the
+  // start and end of the data go as holes, the rest as one data chunk.
+  // Only for peers which negotiated NBD_OPT_STRUCTURED_REPLY, NbdNetServer
+  // sets it for those.
+  bool structured_replies = false;
+
+  // Readahead, nbd transport only. If set, received reads are watched for
+  // sequential and strided streams, and the data ahead of each stream is
+  // read from the backend into buffers of up to this many bytes in all.
+  // Reads it covers are served from there without a backend call, or
+  // wait for the prefetch already reading their data. Writes, trims and
+  // write zeroes drop the prefetched data they overlap as they complete.
+  uint32_t prefetch_size = 0;
+  // Max bytes read ahead of a stream. A stream starts with a small
+  // window, which doubles whenever its prefetched data gets used up and
+  // halves whenever some of it is dropped unused.
+  uint32_t prefetch_max_window = 4 * 1024 * 1024;
+  // Readahead state, shared by every connection of a device.
+  // NbdLoopbackStart() (and NbdNetServer per export) create it if null
+  // and prefetch_size is set, a server started on its own gets its own.
+  shared_ptr<NbdPrefetcher> prefetcher;
+
+  // Per-opcode counts and bytes, the number of cmds in flight and
+  // latency histograms of the receive, backend and send phases of every
+  // cmd, see nbd_stats.h and NbdServer::GetStats(). Costs a few clock
+  // reads per cmd. nbd transport only.
+  bool stats = false;
+
+  // Records every request received (type, flags, offset, length, arrival
+  // time and optionally a hash of the write payload) to a file, see
+  // nbd_capture.h. May be shared by the connections of a device. nbd
+  // transport only.
+  shared_ptr<NbdCapture> capture;
+};
+
+// Counters of the merging stage, see NbdParams::merge_max_size.
+struct NbdMergeStats {
+  uint64_t cmds = 0;  // Reads and writes which went through the stage.
+  uint64_t merged_cmds = 0;  // Of those, how many were merged.
+  uint64_t merges = 0;  // Merged cmds sent to the backend instead.
+  uint64_t merged_bytes = 0;
+};
+
+// Counters of the readahead, see NbdParams::prefetch_size.
+struct NbdPrefetchStats {
+  uint64_t prefetches = 0;  // Backend reads issued ahead of streams.
+  uint64_t prefetched_bytes = 0;
+  uint64_t hits = 0;  // Reads served without a backend call.
+  uint64_t hit_bytes = 0;
+  uint64_t waits = 0;  // Of the hits, those which waited for a prefetch.
+  uint64_t wasted_bytes = 0;  // Prefetched and dropped unused.
+  uint64_t invalidations = 0;  // Prefetches dropped by writes.
 };
 
 // NbdCmd States.
@@ -53,35 +248,101 @@ class NbdCmd {
     cur_io_ptr = (void *)&req;
     io_size_remaining = sizeof(req);
     data_buf = nullptr;
+    data_iov = nullptr;
+    data_iovcnt = 0;
+    data_iov_idx = 0;
     ret_error = 0;
+    zc = 0;
+    stream = 0;
+    internal = 0;
+    merge_next = nullptr;
+    stream_parent = nullptr;
+    stream_next = nullptr;
+    prefetch = nullptr;
+    // Owners set whichever of these the cmd belongs to.
+    server = nullptr;
+    ublk_queue = nullptr;
   }
-  // Client is not suppose to use link.
-  ListLink link;
-  struct nbd_request req;
-  struct nbd_reply reply;
-
+  // Backend part, written by the backend and its completion thread. It
+  // has its own cache line so that it does not share one with the state
+  // the poll threads write.
   // I/O context.
-  void *data_buf;
+  alignas(64) void *data_buf;
   uint64_t io_offset;  // byte offset into the device.
-  void *cur_io_ptr;
-  unsigned io_size_remaining;
+  uint32_t io_size;
+  // Instead of data_buf, see NbdParams::alloc_data_iov.
+  struct iovec *data_iov;
+  uint32_t data_iovcnt;
   // Set by implementation to indicate error. 0=no error
   unsigned ret_error;
-
-  // callback context
-  NbdServer *server;
-  void (*completion_cb)(NbdCmd *cmd);
-
-  uint8_t cur_state;
   uint8_t fua:1;  // FUA bit - Forced unit access.
-  uint32_t io_size;
-
+  uint8_t no_hole:1;  // Of write zeroes, do not deallocate.
+  void (*completion_cb)(NbdCmd *cmd);
   // From NbdParams
   void *arg;
   // For client to state any per-cmd state.
   void *client_private;
+
+  // Internal part, client is not suppose to use anything below (req is
+  // fine to read).
+  alignas(64) ListLink link;
+  MpscLink send_link;
+  struct nbd_request req;
+  // req.type as received. req.type may be rewritten since (see
+  // NbdServer::MakeWriteZeroes()), stats, traces and captures go by this.
+  uint16_t rcv_type;
+  // Reply header, followed on the wire by reply_data_len bytes of read
+  // data from reply_data_off into the data buffer.
+  char reply[NBD_MAX_REPLY_HDR];
+  uint8_t reply_len;
+  uint32_t reply_data_off;
+  uint32_t reply_data_len;
+  void *cur_io_ptr;
+  unsigned io_size_remaining;
+  uint8_t cur_state;
+  uint8_t zc:1;  // Part of a zerocopy send.
+  uint8_t stream:1;  // Split into chunks, see stream_chunk_size.
+  // Made up by the server: a chunk, a merged cmd or a prefetch. Its
+  // req.handle is left over from an earlier cmd.
+  uint8_t internal:1;
+  uint32_t zc_id;  // See NbdServer::zc_cmds_.
+  // Of a merged cmd, its first original cmd, of those the next one.
+  NbdCmd *merge_next;
+  // Of a chunk, the cmd it is part of. Of a streamed read, its first
+  // chunk not sent yet, of that chunk the next one.
+  NbdCmd *stream_parent;
+  NbdCmd *stream_next;
+  // Of a streamed cmd, its chunks not completed yet (plus one while a
+  // write is still being received). Of a read chunk, 0 once completed.
+  atomic<uint32_t> stream_left;
+  // Of a streamed write, the first error of its chunks.
+  atomic<unsigned> stream_error;
+  // Of a prefetch, what it reads for the prefetcher.
+  NbdPrefetch *prefetch;
+  // Of a streamed read, bytes of data_buf made ready for sending.
+  uint32_t stream_ready;
+  // Of data_iov, the entry cur_io_ptr is in.
+  uint32_t data_iov_idx;
+  // With NbdParams::stats, when the header was received, the cmd was
+  // handed on and the backend completed it, in NbdStatsCounters ticks.
+  uint64_t rcv_ticks;
+  uint64_t submit_ticks;
+  uint64_t done_ticks;
+  // Backing of data_iov, allocated on first use and kept with the cmd.
+  struct IovStore {
+    struct iovec iov[NBD_MAX_DATA_IOV];
+    struct msghdr msg;  // For io_uring sends.
+  };
+  unique_ptr<IovStore> iov_store;
+  NbdServer *server;
+  UblkQueue *ublk_queue;  // Instead of server for ublk devices.
 };
 
+// Same as calling completion_cb() of each cmd, but cmds of the same
+// server (or ublk queue) next to each other in the array are handed back
+// to it in one go, with a single wakeup of its pollers.
+void NbdCompleteCmds(NbdCmd **cmds, unsigned n);
+
 class NbdServer {
  public:
   ~NbdServer();
@@ -92,8 +353,9 @@ class NbdServer {
                  unique_ptr<NbdServer> *ret_server);
 
   // Polling routines return false if something has gone wrong.
-  // Caller should call CheckShutdown() in that case.
-  bool DataPoll();
+  // Caller should call CheckShutdown() in that case. If did_work is not
+  // null, it is set to whether the poll moved any bytes or completions.
+  bool DataPoll(bool *did_work = nullptr);
   bool ConfigPoll(time_t t=time(nullptr));
 
   // Returns true, if the server has shutdown. Also returns the
@@ -105,38 +367,278 @@ class NbdServer {
   // this class by a polling thread.
   bool IsDeleteReady() { return shutdown_ && !rcv_running_ &&
                                 !send_running_ && !config_running_ &&
-                                (pending_backend_cmds_.size() == 0);
+                                (pending_backend_cmds_ == 0);
                        }
 
   // Common completion calback from client.
   void CompletionCb(NbdCmd *cmd);
+  // Completes n cmds of this server, see NbdCompleteCmds().
+  void CompletionCb(NbdCmd **cmds, unsigned n);
+  // Completion of a merged cmd, fans out to the original ones.
+  void MergedCompletionCb(NbdCmd *merged);
+  // Completion of a chunk of a streamed cmd.
+  void StreamCompletionCb(NbdCmd *chunk);
+  // Completion of a prefetch, completes the reads waiting for it.
+  void PrefetchCompletionCb(NbdCmd *cmd);
+
+  void GetMergeStats(NbdMergeStats *stats);
+  // Of the prefetcher this server uses, all zero if it has none.
+  void GetPrefetchStats(NbdPrefetchStats *stats);
+  // All zero unless NbdParams::stats is set. Cheap enough to be called
+  // every second.
+  void GetStats(NbdStats *stats);
+
+  // For callers which park in epoll between polls. Returns false if
+  // DataPoll() has work to do right away. Otherwise sets *fd and *events
+  // to what to wait for, *events is 0 once the server has shut down.
+  bool PrepareWait(int *fd, uint32_t *events);
+  // Makes CompletionCb() write to the eventfd efd whenever *sleepers is
+  // non-zero, so that parked pollers pick up new replies. Has to be set
+  // before the server is polled.
+  void SetWakeup(int efd, const atomic<int> *sleepers) {
+    wakeup_fd_ = efd;
+    wakeup_sleepers_ = sleepers;
+  }
 
  private:
   NbdServer(const NbdParams &params);
-  void PollRecv();
-  void PollSend();
+  // Backing allocator of cmd_cache_, from the slab if there is one.
+  NbdCmd *AllocCmd(void *arg);
+  void FreeCmd(NbdCmd *cmd);
+  // Allocates rcv_cmd_ if needed. Returns false if out of memory.
+  bool AllocRcvCmd();
+  // Gets the data buffer of cmd, an iovec list if alloc_data_iov hands
+  // one out, and points cur_io_ptr at its start. Returns false on
+  // failure.
+  bool AllocData(NbdCmd *cmd);
+  void FreeData(NbdCmd *cmd);
+  // Fills iov with what is left of the data segment cmd is in and the
+  // segments after it. Returns the number of iovecs.
+  int DataIov(NbdCmd *cmd, struct iovec *iov);
+  // Moves cur_io_ptr on to the next segment of data_iov. Returns false
+  // if there is none.
+  bool NextDataIov(NbdCmd *cmd);
+  // Decodes the header in rcv_cmd_ and either submits the cmd or sets it
+  // up to receive the write payload.
+  void RcvdReqHeader();
+  // Fails rcv_cmd_ with error without passing it to the backend. The
+  // reply of a write goes out once its payload has been read and dropped.
+  void RejectRcvdCmd(unsigned error);
+  // Points rcv_cmd_ at discard_buf_ for the next part of a rejected
+  // payload. Returns false if nothing is left.
+  bool DiscardPayload();
+  // Adds the record of a received cmd to capture_buf_, with the hash of
+  // its payload if hash is set, and writes the buffer out once full.
+  void CaptureCmd(NbdCmd *cmd, bool hash);
+  // Accounts len bytes received into rcv_cmd_->cur_io_ptr.
+  void RcvdBytes(unsigned len);
+  // Feeds a chunk of the byte stream into the receive state machine.
+  // Returns the number of bytes consumed.
+  size_t ConsumeRcvBytes(const char *buf, size_t len);
+  // PollRecv*(), PollSend*() and UringPoll() return true if they made
+  // progress.
+  bool PollRecv();
+  bool PollRecvBuffered();
+  // Accounts len bytes of cmd written to the socket. Returns true when
+  // the cmd is completely sent.
+  bool SentBytes(NbdCmd *cmd, unsigned len);
+  // Frees the data buffers and cmds in cmds.
+  void FreeSentCmds(List<NbdCmd> *cmds);
+  // sendmsg() which uses MSG_ZEROCOPY if *zc is set. *zc is cleared if the
+  // data was not sent zerocopy after all.
+  ssize_t SendIov(struct iovec *iov, int iovcnt, bool *zc);
+  bool ZcWanted(NbdCmd *cmd);
+  // Parks a sent cmd until its zerocopy sends are acked. Returns false
+  // if cmd was copied and can be freed right away.
+  bool ZcHold(NbdCmd *cmd);
+  // Processes zerocopy acks on the error queue and frees the cmds they
+  // release. Returns true if there were any.
+  bool ZcReap();
+  bool PollSend();
+  bool PollSendBatched();
+  // io_uring engine.
+  int UringInit();
+  bool UringPoll();
+  void UringArmRecv();
+  // Gives buffers back to the kernel for the multishot receive.
+  void UringProvideBufs(uint16_t bid, unsigned count);
+  void UringSubmitSends();
+  void UringRecvDone(struct io_uring_cqe *cqe);
+  void UringSendDone(NbdCmd *cmd, bool data, struct io_uring_cqe *cqe);
+  // Cancels everything outstanding on the ring and waits for it.
+  void UringDrain();
+  static void UringDispatch(struct io_uring_cqe *cqe);
   void PostRcvdCmd();
+  // Passes rcv_batch_ on to the backend, merged if enabled.
+  void SubmitRcvBatch();
+  // Hands a received cmd to the backend, through rcv_batch_ if batching
+  // or merging.
+  void SubmitCmd(NbdCmd *cmd);
+  // Calls the backend callback for cmd->req.type.
+  void DispatchCmd(NbdCmd *cmd);
+  // Replaces runs of contiguous cmds in rcv_batch_ by merged cmds.
+  void MergeRcvBatch();
+  // Streaming, see NbdParams::stream_chunk_size. A chunk is a cmd of its
+  // own covering len bytes at offset of parent.
+  NbdCmd *AllocChunk(NbdCmd *parent, uint64_t offset, uint32_t len);
+  // Sets rcv_cmd_ up to receive the next len bytes of its write payload,
+  // at device offset, into rcv_chunk_.
+  bool StartWriteChunk(uint64_t offset, uint32_t len);
+  // Submits the filled rcv_chunk_. Returns true if it was the last one.
+  bool RcvdWriteChunk();
+  // Splits a read into chunks and submits them, or the read as a whole
+  // if that fails.
+  void SubmitReadChunks(NbdCmd *cmd);
+  // Submits the zero blocks of a received write as write zeroes, and
+  // the rest as writes. Returns false if cmd is to go as it is.
+  bool SubmitZeroSplit(NbdCmd *cmd);
+  // Turns a write whose data is all zero into a write zeroes.
+  void MakeWriteZeroes(NbdCmd *cmd);
+  // Looks a received read up in the prefetcher and submits the
+  // prefetches it asks for. Returns false if the read is to go to the
+  // backend.
+  bool PrefetchRead(NbdCmd *cmd);
+  void SubmitPrefetch(NbdPrefetch *pf);
+  // Completes the reads which waited for a prefetch, or if it failed
+  // hands each back to its own server to read from the backend.
+  static void PrefetchWaitersDone(unsigned error,
+                                  vector<NbdCmd *> *waiters);
+  // Queues a read for the receive side to submit, from any thread.
+  void RetryRead(NbdCmd *cmd);
+  // Submits the queued reads, fails them once shutting down. Serialized
+  // like rcv_cmd_.
+  void SubmitRetryReads();
+  // Of a streamed read with nothing left to send, makes the chunks
+  // completed since ready to send. Returns true once the cmd is sent.
+  bool StreamRefill(NbdCmd *cmd);
+  // Frees the chunks still chained to a streamed read.
+  void FreeStreamChunks(NbdCmd *cmd);
+  // Builds the reply header of a completed cmd and sets it up to be sent.
+  void PrepareReply(NbdCmd *cmd);
+  void PrepareStructuredReply(NbdCmd *cmd);
   void MarkShutdown(const string &reason);
   // These atomics allow multiple poll threads to call Poll
   // at the same time.
   atomic<bool> rcv_running_;
   atomic<bool> send_running_;
   atomic<bool> config_running_;
-  // rcv_cmd_ is only accessed by PollRecv() which is serialized by
-  // rcv_running_ hence no locking is needed for it. But the cache needs
-  // a lock between itself and its housekeeping function. So we only use
-  // it for cache related calls in rcv path.
+  // Protects shutdown_ and shutdown_reason_.
   mutex lock_;
-  CacheAllocator<NbdCmd> cmd_cache_;
+  // Backing for cmd_cache_ with NbdParams::cmd_slab, has to outlive it.
+  // Indexes of the free cmds are on slab_free_, under slab_lock_.
+  unique_ptr<NbdCmd[]> cmd_slab_;
+  uint32_t cmd_slab_size_ = 0;
+  vector<uint32_t> slab_free_;
+  mutex slab_lock_;
+  // Cmds are allocated on the receive side and freed on the send side.
+  // Each side is serialized (by rcv_running_ / send_running_, or by the
+  // ring lock with io_uring) and has its own magazines, so neither takes
+  // a lock except to swap magazines with the depot.
+  MagazineAllocator<NbdCmd> cmd_cache_;
+  MagazineAllocator<NbdCmd>::Cache rcv_mags_;
+  MagazineAllocator<NbdCmd>::Cache send_mags_;
+  // rcv_cmd_ is only accessed by PollRecv() which is serialized by
+  // rcv_running_ hence no locking is needed for it.
   NbdCmd *rcv_cmd_ = nullptr;
+  // Chunk receiving the write payload of rcv_cmd_ when streaming.
+  NbdCmd *rcv_chunk_ = nullptr;
+  // Scratch for the payload of a rejected write, and what is left of it.
+  unique_ptr<char[]> discard_buf_;
+  uint32_t rcv_discard_left_ = 0;
+  uint32_t max_io_size_ = 0;
+  uint32_t stream_chunk_size_ = 0;
+  uint32_t zero_detect_size_ = 0;  // 0 = off, else in whole blocks.
+  // Zero and data runs of the write being split, serialized like
+  // rcv_cmd_.
+  vector<pair<uint32_t, uint32_t>> zero_runs_;
+  // From params_, null if readahead is off.
+  NbdPrefetcher *prefetcher_ = nullptr;
+  // Null unless NbdParams::stats is set.
+  unique_ptr<NbdStatsCounters> stats_;
+  // From params_, null unless capturing. Records are buffered in
+  // capture_buf_ by the receive side.
+  NbdCapture *capture_ = nullptr;
+  uint16_t capture_conn_ = 0;
+  unique_ptr<NbdCaptureRecord[]> capture_buf_;
+  unsigned capture_len_ = 0;
+  // Prefetches to submit for the read received, serialized like
+  // rcv_cmd_.
+  vector<NbdPrefetch *> prefetch_issue_;
+  // Cmds received in this pass, for NbdParams::submit_batch and merging.
+  // Serialized like rcv_cmd_.
+  vector<NbdCmd *> rcv_batch_;
+  vector<NbdCmd *> merge_batch_;
+  uint32_t merge_max_size_ = 0;
+  uint32_t merge_window_ = 0;
+  // Merged cmds, write chunks and prefetches given back by their
+  // completion callbacks, reused by the receive side.
+  MpscQueue<NbdCmd> merge_free_;
+  // Reads whose prefetch failed, see RetryRead().
+  MpscQueue<NbdCmd> retry_reads_;
+  // Updated by the receive side only.
+  atomic<uint64_t> merge_cmds_;
+  atomic<uint64_t> merge_merged_cmds_;
+  atomic<uint64_t> merge_merges_;
+  atomic<uint64_t> merge_bytes_;
+  // readv() vector for write payloads going into data_iov, plus one
+  // entry for rcv_buf_.
+  unique_ptr<struct iovec[]> rcv_iov_;
+  // Receive buffer, only used if NbdParams::rcv_buf_size is set. Bytes
+  // between head and tail are yet to be parsed. Also serialized by
+  // rcv_running_.
+  unique_ptr<char[]> rcv_buf_;
+  uint32_t rcv_buf_size_ = 0;
+  uint32_t rcv_buf_head_ = 0;
+  uint32_t rcv_buf_tail_ = 0;
   NbdCmd *send_cmd_ = nullptr;
-  List<NbdCmd> send_cmds_;
-  List<NbdCmd> pending_backend_cmds_;
+  // Completed cmds waiting to be sent. Pushed by CompletionCb() from any
+  // thread without locking, popped by the send poller (the ring owner
+  // with the io_uring engine).
+  MpscQueue<NbdCmd> send_cmds_;
+  // Cmds being sent by PollSendBatched(), in wire order. Serialized by
+  // send_running_.
+  List<NbdCmd> send_batch_;
+  uint32_t send_batch_size_ = 0;
+  unique_ptr<struct iovec[]> send_iov_;
+  uint32_t send_iov_size_ = 0;
+  // writev() vector of PollSend() for read data in data_iov.
+  unique_ptr<struct iovec[]> send_data_iov_;
+  // MSG_ZEROCOPY state, serialized by send_running_. Each successful
+  // zerocopy send uses the next id and the kernel acks ranges of ids on
+  // the error queue. Sent cmds which were part of a zerocopy send wait in
+  // zc_cmds_ until every id below their zc_id is acked.
+  uint32_t zc_threshold_ = 0;  // 0 = zerocopy is off.
+  uint32_t zc_next_id_ = 0;
+  uint32_t zc_done_id_ = 0;  // All ids below this are acked.
+  deque<bool> zc_acked_;  // Acks of the ids from zc_done_id_ on.
+  List<NbdCmd> zc_cmds_;
+  // Set when the socket was full with replies left to send.
+  atomic<bool> send_blocked_;
+  // Set by read chunk completions, a streamed reply may be able to go on.
+  atomic<bool> stream_kick_;
+  // io_uring engine state, all of it protected by uring_->lock(). Sends
+  // are issued as one linked chain at a time so replies stay in order.
+  shared_ptr<NbdUring> uring_;
+  uint16_t uring_bgid_ = 0;
+  unique_ptr<char[]> uring_bufs_;
+  uint32_t uring_buf_size_ = 0;
+  // Receive buffers consumed and waiting to be provided again.
+  vector<uint16_t> uring_free_bids_;
+  unsigned uring_sends_ = 0;  // Send SQEs awaiting completion.
+  unsigned uring_notifs_ = 0;  // Zerocopy sends awaiting notification.
+  bool uring_recv_armed_ = false;
+  bool uring_cancel_sent_ = false;
+  bool uring_cancel_done_ = false;
+  // Cmds handed to the backend and not completed yet.
+  atomic<uint32_t> pending_backend_cmds_;
   int fd_ = -1;
   NbdParams params_;
   bool shutdown_ = false;
   string shutdown_reason_;
   time_t last_config_run_ = 0;
+  // See SetWakeup().
+  int wakeup_fd_ = -1;
+  const atomic<int> *wakeup_sleepers_ = nullptr;
 };
 
 #endif  // _NBD_SERVER_H_
@@ -0,0 +1,170 @@
+// Per-server counters and latency histograms, see NbdParams::stats.
+// Counters are updated by the threads polling a server without locks or
+// atomic read-modify-writes: the receive side is only ever run by one
+// thread at a time, so is the send side, and each keeps its counters in
+// a cache line of its own. Snapshots can be taken at any time.
+#ifndef _NBD_STATS_H_
+#define _NBD_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+// Per-opcode counters, indexed by NBD_CMD_*. Unknown opcodes count in the
+// last slot.
+#define NBD_STATS_OPS	8
+
+// Latency histograms are log-bucketed like HDR histograms: 8 linear
+// sub-buckets per power of two (12.5% resolution), up to 2^40 ns. Longer
+// latencies count in the last bucket.
+#define NBD_HIST_SUB_BITS	3
+#define NBD_HIST_MAX_BITS	40
+#define NBD_HIST_BUCKETS \
+    ((NBD_HIST_MAX_BITS - NBD_HIST_SUB_BITS + 1) << NBD_HIST_SUB_BITS)
+
+// Phases of a cmd.
+#define NBD_PHASE_RECV		0  // Header received until handed on.
+#define NBD_PHASE_BACKEND	1  // Handed on until the backend completed it.
+#define NBD_PHASE_SEND		2  // Completed until done with the reply.
+#define NBD_PHASE_TOTAL		3  // Header received until done with reply.
+#define NBD_NUM_PHASES		4
+
+struct NbdHistogram {
+  uint64_t counts[NBD_HIST_BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t sum_ns = 0;
+  uint64_t max_ns = 0;
+
+  // Bucket of a value, and the lowest value of a bucket.
+  static unsigned Bucket(uint64_t value) {
+    if (value < (1ULL << NBD_HIST_SUB_BITS))
+      return value;
+    unsigned msb = 63 - __builtin_clzll(value);
+    if (msb >= NBD_HIST_MAX_BITS)
+      return NBD_HIST_BUCKETS - 1;
+    unsigned shift = msb - NBD_HIST_SUB_BITS;
+    return ((shift + 1) << NBD_HIST_SUB_BITS) +
+           ((value >> shift) & ((1U << NBD_HIST_SUB_BITS) - 1));
+  }
+  static uint64_t BucketStart(unsigned bucket);
+
+  // Latency in ns which pct percent of the samples do not exceed, to the
+  // resolution of the buckets.
+  uint64_t Percentile(double pct) const;
+  uint64_t Mean() const { return count ? sum_ns / count : 0; }
+  void Add(const NbdHistogram &other);
+};
+
+struct NbdOpStats {
+  uint64_t ops = 0;  // Received.
+  uint64_t bytes = 0;  // Of reads and writes, and the range of the rest.
+  uint64_t errors = 0;  // Replied to with an error.
+};
+
+struct NbdStats {
+  NbdOpStats ops[NBD_STATS_OPS];
+  // Cmds received whose reply is not out yet, and the most there were.
+  uint64_t inflight = 0;
+  uint64_t max_inflight = 0;
+  // By NBD_PHASE_*.
+  NbdHistogram latency[NBD_NUM_PHASES];
+
+  // Adds the counters of other, e.g. another connection of a device.
+  // max_inflight adds up too, as an upper bound.
+  void Add(const NbdStats &other);
+};
+
+// The counters of one server.
+class NbdStatsCounters {
+ public:
+  NbdStatsCounters();
+
+  // Timestamp in clock ticks. The TSC where there is one, which has to
+  // be invariant (any x86 CPU of the last decade), ns otherwise.
+  static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+  }
+  // Ns per tick, measured against CLOCK_MONOTONIC from the first
+  // StartClock() on. The first call after that may wait until 10ms have
+  // passed.
+  static void StartClock();
+  static double NsPerTick();
+
+  // Receive side. A cmd was received, and handed on after rcv_ticks.
+  void Received(uint32_t type, uint32_t len) {
+    unsigned op = (type < NBD_STATS_OPS) ? type : NBD_STATS_OPS - 1;
+    Inc(&rcvd_ops_[op], 1);
+    Inc(&rcvd_bytes_[op], len);
+    uint64_t inflight = Inflight();
+    if (inflight > max_inflight_.load(memory_order_relaxed))
+      max_inflight_.store(inflight, memory_order_relaxed);
+  }
+  void Handed(uint64_t rcv_ticks) { recv_.Record(rcv_ticks); }
+
+  // Send side. Done with the reply of a cmd which was received at
+  // rcv_ticks, handed on at submit_ticks and completed at done_ticks.
+  void Replied(uint32_t type, unsigned error, uint64_t rcv_ticks,
+               uint64_t submit_ticks, uint64_t done_ticks) {
+    unsigned op = (type < NBD_STATS_OPS) ? type : NBD_STATS_OPS - 1;
+    uint64_t now = Now();
+    Inc(&replied_ops_[op], 1);
+    if (error != 0)
+      Inc(&errors_[op], 1);
+    backend_.Record(done_ticks - submit_ticks);
+    send_.Record(now - done_ticks);
+    total_.Record(now - rcv_ticks);
+  }
+
+  void Snapshot(NbdStats *stats);
+
+ private:
+  // Single writer, so a plain load and store does.
+  static void Inc(atomic<uint64_t> *c, uint64_t n) {
+    c->store(c->load(memory_order_relaxed) + n, memory_order_relaxed);
+  }
+  uint64_t Inflight();
+
+  // In clock ticks, converted by Snapshot().
+  struct Hist {
+    void Record(uint64_t ticks) {
+      // Clocks of different CPUs may be a little apart.
+      if ((int64_t)ticks < 0)
+        ticks = 0;
+      Inc(&counts[NbdHistogram::Bucket(ticks)], 1);
+      Inc(&sum, ticks);
+      if (ticks > max.load(memory_order_relaxed))
+        max.store(ticks, memory_order_relaxed);
+    }
+    void Snapshot(double ns_per_tick, NbdHistogram *hist);
+    atomic<uint64_t> counts[NBD_HIST_BUCKETS];
+    atomic<uint64_t> sum;
+    atomic<uint64_t> max;
+  };
+
+  // Receive side.
+  alignas(64) atomic<uint64_t> rcvd_ops_[NBD_STATS_OPS];
+  atomic<uint64_t> rcvd_bytes_[NBD_STATS_OPS];
+  atomic<uint64_t> max_inflight_;
+  Hist recv_;
+  // Send side.
+  alignas(64) atomic<uint64_t> replied_ops_[NBD_STATS_OPS];
+  atomic<uint64_t> errors_[NBD_STATS_OPS];
+  Hist backend_;
+  Hist send_;
+  Hist total_;
+};
+
+#endif  // _NBD_STATS_H_
@@ -0,0 +1,50 @@
+// Tracing of the state transitions of nbd cmds, to see where a slow cmd
+// spent its time: receiving, at the backend, or waiting for the sender.
+// Off by default. Every thread records into a ring buffer of its own,
+// without locks, NbdTraceDump() writes the rings out as Chrome trace
+// JSON (chrome://tracing, ui.perfetto.dev). With tracing off, a
+// transition costs one load and a not taken branch.
+#ifndef _NBD_TRACE_H_
+#define _NBD_TRACE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+class NbdCmd;
+
+// Events, in the order a cmd goes through them. The first ones are the
+// NBDCMD_STATE_* a cmd enters, the reply is split into the time it is
+// queued for the sender and the time it is being sent.
+#define NBD_TRACE_RCV_REQ		0  // Header received.
+#define NBD_TRACE_RCV_WRITE_DATA	1
+#define NBD_TRACE_CMD_SUBMITTED		2  // Handed on to the backend.
+#define NBD_TRACE_SEND_REPLY		3  // Completed, queued for sending.
+#define NBD_TRACE_SEND_START		4  // Picked up by the sender.
+#define NBD_TRACE_SEND_READ_DATA	5
+#define NBD_TRACE_DONE			6  // Done with the reply.
+#define NBD_TRACE_NUM_EVENTS		7
+
+// Starts tracing into rings of ring_events events per thread (rounded up
+// to a power of two, 40 bytes each), dropping whatever was traced
+// before. Returns 0 on success, EINVAL if ring_events is 0.
+int NbdTraceStart(unsigned ring_events);
+void NbdTraceStop();
+// Writes the events in the rings to path, each state of a cmd as a slice
+// of its own. A cmd whose slice does not end was still in that state.
+// Can be called while tracing, events overwritten during the dump are
+// left out. Returns 0 on success, errno otherwise.
+int NbdTraceDump(const string &path);
+
+extern atomic<bool> g_nbd_trace_on;
+void NbdTraceRecord(const NbdCmd *cmd, uint8_t event);
+
+static inline void NbdTrace(const NbdCmd *cmd, uint8_t event) {
+  if (__builtin_expect(g_nbd_trace_on.load(memory_order_relaxed), 0))
+    NbdTraceRecord(cmd, event);
+}
+
+#endif  // _NBD_TRACE_H_
@@ -0,0 +1,103 @@
+// Thin wrapper around a raw io_uring instance (no liburing dependency).
+// Only the pieces used by the library are covered: SQE/CQE ring access
+// and submission.
+#ifndef _NBD_URING_H_
+#define _NBD_URING_H_
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+using namespace std;
+
+class NbdUring {
+ public:
+  ~NbdUring();
+
+  // Factory method. entries is the SQ size, the CQ gets 4x that since
+  // multishot receives post many completions per SQE. setup_flags are
+  // IORING_SETUP_* flags. Returns 0 on success, errno on error.
+  static int New(unsigned entries, unsigned setup_flags,
+                 shared_ptr<NbdUring> *ret_ring);
+
+  // The ring is not thread safe. Everybody touching it (including
+  // reaping completions) has to hold this lock.
+  mutex &lock() { return lock_; }
+  // Becomes readable when completions are available.
+  int fd() { return fd_; }
+
+  // Returns nullptr if the SQ is full. The returned SQE is zeroed.
+  struct io_uring_sqe *GetSqe();
+  unsigned SqSpace();
+  // SQEs handed out by GetSqe() which no Submit() got in yet.
+  unsigned SqPending() { return sq_local_tail_ - sq_submitted_; }
+  // Submits the SQEs handed out by GetSqe(). Any the kernel does not
+  // take are submitted by the next call. Returns 0 or errno.
+  int Submit();
+  // Blocks until at least one completion is available. Returns 0 or
+  // errno.
+  int Wait();
+  // Calls fn(cqe) for every available completion, without making a
+  // syscall unless the kernel has overflowed completions pending.
+  // Returns the number of completions reaped.
+  template <class F>
+  unsigned Reap(F fn);
+
+  // Returns a buffer group id not used by anybody else on this ring,
+  // for IORING_OP_PROVIDE_BUFFERS.
+  uint16_t AllocBufGroup();
+
+ private:
+  NbdUring() {}
+  // Returns the number of SQEs submitted, or -errno.
+  int Enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+
+  mutex lock_;
+  int fd_ = -1;
+  struct io_uring_params params_;
+  // Mappings of the rings.
+  void *sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void *cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  char *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned sqe_shift_ = 0;  // log2 of SQE size.
+  // SQ ring fields.
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_flags_;
+  unsigned *sq_array_;
+  unsigned sq_local_tail_ = 0;
+  unsigned sq_submitted_ = 0;
+  // CQ ring fields.
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  struct io_uring_cqe *cqes_;
+  uint16_t next_bgid_ = 0;
+};
+
+template <class F>
+unsigned NbdUring::Reap(F fn) {
+  unsigned count = 0;
+  if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+    Enter(0, 0, IORING_ENTER_GETEVENTS);
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    fn(&cqes_[head & *cq_mask_]);
+    head++;
+    count++;
+    // Release each slot right away, fn() may submit more work.
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  }
+  return count;
+}
+
+#endif  // _NBD_URING_H_
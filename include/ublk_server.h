@@ -0,0 +1,115 @@
+// Serves a ublk device (drivers/block/ublk_drv.c) through the same
+// NbdParams callbacks as the nbd transport. The kernel hands out requests
+// as io_uring command completions, one ring per hardware queue, and
+// copies data to and from a fixed buffer per request tag. There is no
+// socket and no request framing in between.
+#ifndef _UBLK_SERVER_H_
+#define _UBLK_SERVER_H_
+
+#include "nbd_server.h"
+#include <linux/ublk_cmd.h>
+
+#include <thread>
+
+class UblkServer;
+
+// One hardware queue of a ublk device. The kernel binds a queue to the
+// thread which fetched its first requests, so only the first thread to
+// poll a queue ever does work on it, polls from others are no-ops.
+class UblkQueue {
+ public:
+  ~UblkQueue();
+
+  // Same contract as the NbdServer functions of the same name.
+  bool DataPoll(bool *did_work = nullptr);
+  bool PrepareWait(int *fd, uint32_t *events);
+  void SetWakeup(int efd, const atomic<int> *sleepers) {
+    wakeup_fd_ = efd;
+    wakeup_sleepers_ = sleepers;
+  }
+  bool IsDeleteReady() { return shutdown_ && (pending_backend_cmds_ == 0); }
+
+  // Common completion calback from client.
+  void CompletionCb(NbdCmd *cmd);
+  void CompletionCb(NbdCmd **cmds, unsigned n);
+
+ private:
+  friend class UblkServer;
+  UblkQueue(UblkServer *dev, unsigned q_id);
+  int Init();
+  // Issues a FETCH (first time) or COMMIT_AND_FETCH for tag. Returns
+  // false if the SQ is full.
+  bool QueueIoCmd(unsigned tag, uint32_t op, int32_t result);
+  void RcvdReq(unsigned tag);
+
+  UblkServer *dev_;
+  unsigned q_id_;
+  shared_ptr<NbdUring> ring_;
+  // Request descriptors, shared with the kernel and indexed by tag.
+  struct ublksrv_io_desc *descs_ = nullptr;
+  size_t descs_size_ = 0;
+  // One cmd and data buffer per tag.
+  unique_ptr<NbdCmd[]> cmds_;
+  // Completed cmds, pushed by CompletionCb() from any thread.
+  MpscQueue<NbdCmd> done_cmds_;
+  // Completed cmds waiting for an SQE.
+  List<NbdCmd> commit_cmds_;
+  // Requests fetched in this poll, for NbdParams::submit_batch.
+  vector<NbdCmd *> rcv_batch_;
+  atomic<uint32_t> pending_backend_cmds_;
+  // The thread which owns the queue, see above.
+  atomic<thread::id> owner_;
+  bool fetched_ = false;
+  bool shutdown_ = false;
+  int wakeup_fd_ = -1;
+  const atomic<int> *wakeup_sleepers_ = nullptr;
+};
+
+class UblkServer {
+ public:
+  ~UblkServer();
+
+  // Factory method. Adds a ublk device with params.num_connections queues
+  // of params.queue_depth requests each. If dev_id < 0 the kernel picks
+  // the id. The block device is only created once every queue has been
+  // polled. Returns 0 on success, errno in case of error.
+  static int New(const NbdParams &params, int dev_id,
+                 unique_ptr<UblkServer> *ret_server);
+
+  int dev_id() { return dev_id_; }
+  unsigned num_queues() { return queues_.size(); }
+  UblkQueue *queue(unsigned q_id) { return queues_[q_id].get(); }
+
+  // Removes the block device. The queues have to keep being polled until
+  // this returns, so that requests in flight can complete. Returns 0 on
+  // success, errno on error.
+  int Stop();
+
+ private:
+  friend class UblkQueue;
+  UblkServer(const NbdParams &params);
+  int Init(int dev_id);
+  // Sends a command on /dev/ublk-control and, if wait is set, waits for
+  // its result. Returns 0 or errno.
+  int CtrlCmd(uint32_t op, uint64_t addr, uint16_t len, uint64_t data,
+              bool wait);
+  // Reaps control completions, returns the result of op if it is among
+  // them, 1 otherwise.
+  int CtrlReap(uint32_t op);
+
+  NbdParams params_;
+  uint32_t max_io_size_;
+  int ctrl_fd_ = -1;
+  shared_ptr<NbdUring> ctrl_ring_;
+  // ioctl encoded opcodes, if the kernel takes them.
+  bool ioctl_encode_ = true;
+  int dev_id_ = -1;
+  int cdev_fd_ = -1;
+  bool added_ = false;
+  bool start_sent_ = false;  // START_DEV has not completed yet.
+  bool started_ = false;
+  bool stopped_ = false;
+  vector<unique_ptr<UblkQueue>> queues_;
+};
+
+#endif  // _UBLK_SERVER_H_
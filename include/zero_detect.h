@@ -0,0 +1,13 @@
+// Checks whether a buffer is all zero. Uses AVX2 or SSE2 where the CPU
+// has them, picked once at startup, and plain 64 bit loads otherwise.
+#ifndef _ZERO_DETECT_H_
+#define _ZERO_DETECT_H_
+
+#include <stddef.h>
+
+// Returns true if all len bytes at buf are zero. Exits at the first
+// non-zero 128 byte block, so data which is not zero costs next to
+// nothing to check.
+bool IsZeroBuf(const void *buf, size_t len);
+
+#endif  // _ZERO_DETECT_H_
@@ -0,0 +1,956 @@
+#include "block_cache.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+// A cmd the cache sends to the backend: a fill of a read miss, a write,
+// trim or write zeroes passed on, a write back or a flush.
+struct BlockCache::Io : public NbdCmd {
+  BlockCache *cache;
+  // The client cmd it is done for, null for write backs.
+  NbdCmd *orig;
+  uint8_t kind;
+  // Pages it covers.
+  uint64_t first;
+  uint64_t end;
+  // A read missing several runs of pages gets a fill for each. The first
+  // one counts them down and keeps their first error.
+  Io *leader;
+  atomic<uint32_t> fills_left;
+  atomic<unsigned> fill_error;
+};
+
+BlockCache::BlockCache(const BlockCacheParams &params,
+                       const NbdParams &backend) :
+    params_(params), backend_(backend) {
+  block_size_ = backend.block_size;
+  num_blocks_ = backend.num_blocks;
+  run_pages_ = max(1U, params.destage_io_size / block_size_);
+  num_pages_ = params.size / block_size_;
+  num_shards_ = max<uint64_t>(1, min<uint64_t>(params.num_shards, num_pages_));
+  uint64_t threshold = params.dirty_threshold ? params.dirty_threshold :
+                       params.size / 4;
+  dirty_threshold_ = threshold / block_size_;
+  now_ = time(nullptr);
+  write_seq_ = 0;
+  dirty_pages_ = 0;
+  cached_pages_ = 0;
+  read_hits_ = 0;
+  read_misses_ = 0;
+  destaged_bytes_ = 0;
+  destages_ = 0;
+  destage_errors_ = 0;
+  write_stalls_ = 0;
+  pending_ios_ = 0;
+  stalled_ = false;
+}
+
+BlockCache::Shard::Shard() :
+    t1(offsetof(Page, lru_link)), t2(offsetof(Page, lru_link)),
+    b1(offsetof(Ghost, link)), b2(offsetof(Ghost, link)) {
+}
+
+BlockCache::~BlockCache() {
+  // Nothing is received anymore, write back what is left. Write backs
+  // which fail drop their pages, so this ends.
+  unique_lock<mutex> l(lock_);
+  closing_ = true;
+  l.unlock();
+  uint64_t dirty = UINT64_MAX;
+  while (params_.write_back && (dirty_pages_ > 0) && (dirty_pages_ < dirty)) {
+    dirty = dirty_pages_;
+    Kick();
+    while (pending_ios_ > 0)
+      usleep(1000);
+  }
+  while (pending_ios_ > 0)
+    usleep(1000);
+  for (Io *io : free_ios_)
+    delete io;
+  if (mem_ != nullptr)
+    munmap(mem_, mem_size_);
+}
+
+// static
+int BlockCache::New(const BlockCacheParams &params, const NbdParams &backend,
+                    shared_ptr<BlockCache> *ret_cache) {
+  if ((backend.block_size == 0) || (params.size < backend.block_size) ||
+      (params.num_shards == 0) || (params.destage_depth == 0) ||
+      (params.policy > BLOCK_CACHE_ARC) ||
+      (!backend.submit_batch && (!backend.read || !backend.write))) {
+    return EINVAL;
+  }
+  shared_ptr<BlockCache> cache(new BlockCache(params, backend));
+  int st = cache->Init();
+  if (st != 0) {
+    return st;
+  }
+  *ret_cache = move(cache);
+  return 0;
+}
+
+int BlockCache::Init() {
+  mem_size_ = num_pages_ * block_size_;
+  void *p = mmap(nullptr, mem_size_, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    mem_ = nullptr;
+    return errno;
+  }
+  mem_ = p;
+  shards_.reset(new Shard[num_shards_]);
+  pages_.reset(new Page[num_pages_]);
+  ghosts_.reset(new Ghost[num_pages_]);
+  for (uint64_t i = 0; i < num_pages_; i++) {
+    Shard *s = &shards_[i % num_shards_];
+    pages_[i].data = (char *)mem_ + i * block_size_;
+    s->free_pages.push_back(&pages_[i]);
+    s->free_ghosts.push_back(&ghosts_[i]);
+    s->capacity++;
+  }
+  for (unsigned i = 0; i < num_shards_; i++)
+    shards_[i].pages.reserve(shards_[i].capacity);
+  return 0;
+}
+
+void BlockCache::SetCallbacks(NbdParams *params) {
+  shared_ptr<BlockCache> cache = shared_from_this();
+  params->read = [cache](void *, NbdCmd *cmd) { cache->Read(cmd); };
+  params->write = [cache](void *, NbdCmd *cmd) { cache->Write(cmd); };
+  params->flush = [cache](void *, NbdCmd *cmd) { cache->Flush(cmd); };
+  params->trim = [cache](void *, NbdCmd *cmd) { cache->Discard(cmd); };
+  if (params->write_zeroes) {
+    params->write_zeroes = [cache](void *, NbdCmd *cmd) {
+      cache->Discard(cmd);
+    };
+  }
+  params->housekeeping = [cache](void *, time_t t) {
+    cache->HouseKeeping(t);
+  };
+  params->submit_batch = nullptr;
+  params->alloc_data_iov = nullptr;
+  params->free_data_iov = nullptr;
+}
+
+bool BlockCache::PageRange(NbdCmd *cmd, uint64_t *first, uint64_t *end) {
+  if ((cmd->io_size == 0) || (cmd->io_offset % block_size_) ||
+      (cmd->io_size % block_size_)) {
+    return false;
+  }
+  *first = cmd->io_offset / block_size_;
+  *end = *first + cmd->io_size / block_size_;
+  return (*end <= num_blocks_);
+}
+
+void BlockCache::Touch(Shard *s, Page *page) {
+  if (params_.policy == BLOCK_CACHE_LRU) {
+    s->t1.Remove(page);
+    s->t1.PushBack(page);
+    return;
+  }
+  // Used again, so it is frequently used.
+  if (page->list == kT1) {
+    s->t1.Remove(page);
+  } else {
+    s->t2.Remove(page);
+  }
+  s->t2.PushBack(page);
+  page->list = kT2;
+}
+
+BlockCache::Page *BlockCache::Insert(Shard *s, uint64_t index) {
+  bool in_b2 = false;
+  uint8_t list = kT1;
+  auto git = s->ghosts.find(index);
+  if (git != s->ghosts.end()) {
+    // ARC adapts the target size of t1 towards the ghost list which had
+    // the hit, and the page counts as frequently used.
+    Ghost *g = git->second;
+    if (g->list == kT1) {
+      uint64_t delta = max<uint64_t>(s->b2.size() / s->b1.size(), 1);
+      s->target_t1 = min(s->capacity, s->target_t1 + delta);
+    } else {
+      uint64_t delta = max<uint64_t>(s->b1.size() / s->b2.size(), 1);
+      s->target_t1 -= min(s->target_t1, delta);
+      in_b2 = true;
+    }
+    list = kT2;
+    DropGhost(s, g);
+  }
+  Page *page;
+  if (!s->free_pages.empty()) {
+    page = s->free_pages.back();
+    s->free_pages.pop_back();
+  } else {
+    page = Evict(s, in_b2);
+    if (page == nullptr)
+      return nullptr;
+  }
+  page->index = index;
+  page->state = kClean;
+  page->destaging = false;
+  page->redirtied = false;
+  page->fill = nullptr;
+  page->list = list;
+  if (list == kT1) {
+    s->t1.PushBack(page);
+  } else {
+    s->t2.PushBack(page);
+  }
+  s->pages[index] = page;
+  cached_pages_++;
+  return page;
+}
+
+BlockCache::Page *BlockCache::Evict(Shard *s, bool in_b2) {
+  // ARC's replace: from t1 while it is above its target, else from t2.
+  uint64_t t1 = s->t1.size();
+  bool from_t1 = (t1 > 0) && ((t1 > s->target_t1) ||
+                              (in_b2 && (t1 == s->target_t1)) ||
+                              (s->t2.size() == 0));
+  Page *page = Victim(from_t1 ? &s->t1 : &s->t2);
+  if (page == nullptr)
+    page = Victim(from_t1 ? &s->t2 : &s->t1);
+  if (page == nullptr)
+    return nullptr;
+  uint64_t index = page->index;
+  uint8_t list = page->list;
+  Remove(s, page);
+  s->free_pages.pop_back();
+  if (params_.policy == BLOCK_CACHE_ARC)
+    AddGhost(s, index, list);
+  return page;
+}
+
+BlockCache::Page *BlockCache::Victim(List<Page> *list) {
+  // Pinned pages go to the back, so that the next scan does not walk
+  // over them again.
+  for (uint32_t n = list->size(); n > 0; n--) {
+    Page *page = list->First();
+    if (page->state == kClean)
+      return page;
+    list->Remove(page);
+    list->PushBack(page);
+  }
+  return nullptr;
+}
+
+void BlockCache::Remove(Shard *s, Page *page) {
+  if (page->list == kT1) {
+    s->t1.Remove(page);
+  } else {
+    s->t2.Remove(page);
+  }
+  page->list = kNone;
+  if (page->state == kDirty) {
+    s->dirty.erase(make_pair(page->dirty_seq, page->index));
+    dirty_pages_--;
+  }
+  s->pages.erase(page->index);
+  s->free_pages.push_back(page);
+  cached_pages_--;
+}
+
+void BlockCache::AddGhost(Shard *s, uint64_t index, uint8_t list) {
+  // Each ghost list is kept to the size of the cache.
+  if ((list == kT1) && (s->t1.size() + s->b1.size() >= s->capacity) &&
+      (s->b1.size() > 0)) {
+    DropGhost(s, s->b1.First());
+  }
+  if (s->free_ghosts.empty()) {
+    DropGhost(s, (s->b2.size() > 0) ? s->b2.First() : s->b1.First());
+  }
+  Ghost *g = s->free_ghosts.back();
+  s->free_ghosts.pop_back();
+  g->index = index;
+  g->list = list;
+  if (list == kT1) {
+    s->b1.PushBack(g);
+  } else {
+    s->b2.PushBack(g);
+  }
+  s->ghosts[index] = g;
+}
+
+void BlockCache::DropGhost(Shard *s, Ghost *ghost) {
+  if (ghost->list == kT1) {
+    s->b1.Remove(ghost);
+  } else {
+    s->b2.Remove(ghost);
+  }
+  s->ghosts.erase(ghost->index);
+  s->free_ghosts.push_back(ghost);
+}
+
+void BlockCache::MarkDirty(Shard *s, Page *page, uint64_t seq, time_t t) {
+  page->state = kDirty;
+  page->fill = nullptr;
+  page->dirty_seq = seq;
+  page->dirty_time = t;
+  s->dirty.emplace(seq, page->index);
+  dirty_pages_++;
+}
+
+void BlockCache::MarkClean(Shard *s, Page *page) {
+  page->state = kClean;
+  dirty_pages_--;
+}
+
+void BlockCache::Read(NbdCmd *cmd) {
+  uint64_t first, end;
+  if (!PageRange(cmd, &first, &end) || (cmd->data_buf == nullptr)) {
+    cmd->ret_error = EINVAL;
+    cmd->completion_cb(cmd);
+    return;
+  }
+  // Hits are copied out, each run of missing pages gets a fill reading
+  // straight into the read's buffer. Missing pages get a placeholder the
+  // fill makes a clean page of.
+  vector<NbdCmd *> ios;
+  Io *fill = nullptr;
+  Shard *cur = nullptr;
+  unique_lock<mutex> l;
+  for (uint64_t i = first; i < end; i++) {
+    Shard *s = ShardOf(i);
+    if (s != cur) {
+      if (l.owns_lock())
+        l.unlock();
+      l = unique_lock<mutex>(s->lock);
+      cur = s;
+    }
+    char *buf = (char *)cmd->data_buf + (i - first) * block_size_;
+    auto it = s->pages.find(i);
+    Page *page = (it != s->pages.end()) ? it->second : nullptr;
+    if ((page != nullptr) && (page->state != kFilling)) {
+      memcpy(buf, page->data, block_size_);
+      Touch(s, page);
+      s->page_hits++;
+      fill = nullptr;
+      continue;
+    }
+    s->page_misses++;
+    if (fill == nullptr) {
+      fill = AllocIo(cmd, kIoFill, NBD_CMD_READ, i, i + 1, buf);
+      ios.push_back(fill);
+    } else {
+      fill->end++;
+      fill->io_size += block_size_;
+    }
+    // Another read's fill is out for it, leave that one be.
+    if (page == nullptr) {
+      page = Insert(s, i);
+      if (page != nullptr) {
+        page->state = kFilling;
+        page->fill = fill;
+      }
+    }
+  }
+  if (l.owns_lock())
+    l.unlock();
+  if (ios.empty()) {
+    read_hits_++;
+    cmd->ret_error = 0;
+    cmd->completion_cb(cmd);
+    return;
+  }
+  read_misses_++;
+  Io *leader = static_cast<Io *>(ios[0]);
+  leader->fills_left = ios.size();
+  for (NbdCmd *io : ios)
+    static_cast<Io *>(io)->leader = leader;
+  Submit(&ios);
+}
+
+void BlockCache::FillDone(Io *io) {
+  NbdCmd *cmd = io->orig;
+  unsigned error = io->ret_error;
+  Shard *cur = nullptr;
+  unique_lock<mutex> l;
+  for (uint64_t i = io->first; i < io->end; i++) {
+    Shard *s = ShardOf(i);
+    if (s != cur) {
+      if (l.owns_lock())
+        l.unlock();
+      l = unique_lock<mutex>(s->lock);
+      cur = s;
+    }
+    auto it = s->pages.find(i);
+    if (it == s->pages.end())
+      continue;
+    Page *page = it->second;
+    char *buf = (char *)io->data_buf + (i - io->first) * block_size_;
+    if ((page->state == kFilling) && (page->fill == io)) {
+      if (error != 0) {
+        Remove(s, page);
+        continue;
+      }
+      memcpy(page->data, buf, block_size_);
+      page->state = kClean;
+      page->fill = nullptr;
+    } else if ((page->state != kFilling) && (error == 0)) {
+      // Written since the fill went out, the cache has the newer data.
+      memcpy(buf, page->data, block_size_);
+    }
+  }
+  if (l.owns_lock())
+    l.unlock();
+
+  Io *leader = io->leader;
+  if (error != 0) {
+    unsigned expected = 0;
+    leader->fill_error.compare_exchange_strong(expected, error);
+  }
+  bool last = (leader->fills_left.fetch_sub(1) == 1);
+  if (last) {
+    cmd->ret_error = leader->fill_error;
+    if (leader != io)
+      FreeIo(leader);
+  }
+  // Placeholders turned into pages which can be evicted.
+  if (stalled_)
+    Kick();
+  if ((leader != io) || last)
+    FreeIo(io);
+  if (last)
+    cmd->completion_cb(cmd);
+}
+
+void BlockCache::Write(NbdCmd *cmd) {
+  uint64_t first, end;
+  if (!PageRange(cmd, &first, &end) || (cmd->data_buf == nullptr)) {
+    cmd->ret_error = EINVAL;
+    cmd->completion_cb(cmd);
+    return;
+  }
+  if (!params_.write_back) {
+    // Pages filled by reads racing with the write are dropped again as
+    // it completes.
+    DropRange(first, end, false);
+    vector<NbdCmd *> ios;
+    ios.push_back(AllocIo(cmd, kIoWrite, NBD_CMD_WRITE, first, end,
+                          cmd->data_buf));
+    ios[0]->fua = cmd->fua;
+    Submit(&ios);
+    return;
+  }
+  uint64_t next = first;
+  if (stalled_ || !Absorb(cmd, &next)) {
+    unique_lock<mutex> l(lock_);
+    write_stalls_++;
+    stalled_cmds_.push_back({cmd, next});
+    stalled_ = true;
+    l.unlock();
+    Kick();
+    return;
+  }
+  if (cmd->fua) {
+    unique_lock<mutex> l(lock_);
+    flushes_.push_back({cmd, write_seq_});
+    l.unlock();
+    Kick();
+    return;
+  }
+  cmd->ret_error = 0;
+  cmd->completion_cb(cmd);
+  if (dirty_pages_ > dirty_threshold_)
+    Kick();
+}
+
+bool BlockCache::Absorb(NbdCmd *cmd, uint64_t *next) {
+  uint64_t first = cmd->io_offset / block_size_;
+  uint64_t end = first + cmd->io_size / block_size_;
+  uint64_t seq = ++write_seq_;
+  time_t t = now_;
+  Shard *cur = nullptr;
+  unique_lock<mutex> l;
+  for (uint64_t i = *next; i < end; i++) {
+    Shard *s = ShardOf(i);
+    if (s != cur) {
+      if (l.owns_lock())
+        l.unlock();
+      l = unique_lock<mutex>(s->lock);
+      cur = s;
+    }
+    auto it = s->pages.find(i);
+    Page *page;
+    if (it != s->pages.end()) {
+      page = it->second;
+      Touch(s, page);
+    } else {
+      page = Insert(s, i);
+      if (page == nullptr) {
+        *next = i;
+        return false;
+      }
+    }
+    memcpy(page->data, (char *)cmd->data_buf + (i - first) * block_size_,
+           block_size_);
+    if (page->state != kDirty) {
+      MarkDirty(s, page, seq, t);
+    } else if (page->destaging && !page->redirtied) {
+      // The write back has the old data, it goes out again after it.
+      page->redirtied = true;
+      page->redirty_seq = seq;
+    }
+  }
+  *next = end;
+  return true;
+}
+
+void BlockCache::Flush(NbdCmd *cmd) {
+  if (!params_.write_back) {
+    vector<NbdCmd *> ios;
+    cmd->ret_error = 0;
+    ios.push_back(AllocIo(cmd, kIoFlush, NBD_CMD_FLUSH, 0, 0, nullptr));
+    Submit(&ios);
+    return;
+  }
+  unique_lock<mutex> l(lock_);
+  flushes_.push_back({cmd, write_seq_});
+  l.unlock();
+  Kick();
+}
+
+void BlockCache::Discard(NbdCmd *cmd) {
+  uint64_t first, end;
+  if (!PageRange(cmd, &first, &end)) {
+    cmd->ret_error = EINVAL;
+    cmd->completion_cb(cmd);
+    return;
+  }
+  vector<NbdCmd *> ios;
+  if (!params_.write_back) {
+    DropRange(first, end, false);
+    ios.push_back(AllocIo(cmd, kIoDiscard, cmd->req.type, first, end,
+                          nullptr));
+    Submit(&ios);
+    return;
+  }
+  unique_lock<mutex> l(lock_);
+  // Behind stalled writes, which may overlap it.
+  if (stalled_ || !StartDiscard(cmd, &ios)) {
+    stalled_cmds_.push_back({cmd, first});
+    stalled_ = true;
+    l.unlock();
+    Kick();
+    return;
+  }
+  l.unlock();
+  Submit(&ios);
+}
+
+bool BlockCache::Overlaps(const vector<pair<uint64_t, uint64_t>> &ranges,
+                          uint64_t first, uint64_t end) {
+  for (auto &r : ranges) {
+    if ((r.first < end) && (first < r.second))
+      return true;
+  }
+  return false;
+}
+
+bool BlockCache::StartDiscard(NbdCmd *cmd, vector<NbdCmd *> *ios) {
+  uint64_t first = cmd->io_offset / block_size_;
+  uint64_t end = first + cmd->io_size / block_size_;
+  if (Overlaps(destage_runs_, first, end))
+    return false;
+  // Dirty data of the range is gone with it, and nothing of the range is
+  // written back until the backend has it.
+  discards_.emplace_back(first, end);
+  DropRange(first, end, false);
+  ios->push_back(AllocIo(cmd, kIoDiscard, cmd->req.type, first, end,
+                         nullptr));
+  return true;
+}
+
+void BlockCache::DiscardDone(Io *io) {
+  NbdCmd *cmd = io->orig;
+  cmd->ret_error = io->ret_error;
+  // Reads which raced with it may have filled either version.
+  DropRange(io->first, io->end, params_.write_back);
+  if (params_.write_back) {
+    unique_lock<mutex> l(lock_);
+    auto it = find(discards_.begin(), discards_.end(),
+                   make_pair(io->first, io->end));
+    discards_.erase(it);
+    l.unlock();
+    Kick();
+  }
+  FreeIo(io);
+  cmd->completion_cb(cmd);
+}
+
+void BlockCache::DropRange(uint64_t first, uint64_t end, bool clean_only) {
+  auto drop = [this, clean_only](Shard *s, Page *page) {
+    if (page->destaging || (clean_only && (page->state == kDirty)))
+      return;
+    Remove(s, page);
+  };
+  if (end - first > num_pages_) {
+    // Cheaper to go over what is cached, e.g. for a trim of the device.
+    for (unsigned i = 0; i < num_shards_; i++) {
+      Shard *s = &shards_[i];
+      unique_lock<mutex> l(s->lock);
+      for (auto it = s->pages.begin(); it != s->pages.end();) {
+        Page *page = (it++)->second;
+        if ((page->index >= first) && (page->index < end))
+          drop(s, page);
+      }
+    }
+    return;
+  }
+  Shard *cur = nullptr;
+  unique_lock<mutex> l;
+  for (uint64_t i = first; i < end; i++) {
+    Shard *s = ShardOf(i);
+    if (s != cur) {
+      if (l.owns_lock())
+        l.unlock();
+      l = unique_lock<mutex>(s->lock);
+      cur = s;
+    }
+    auto it = s->pages.find(i);
+    if (it != s->pages.end())
+      drop(s, it->second);
+  }
+}
+
+void BlockCache::HouseKeeping(time_t cur_time) {
+  now_ = cur_time;
+  if (params_.write_back) {
+    unique_lock<mutex> l(lock_);
+    expire_before_ = cur_time - params_.dirty_expire_secs;
+    l.unlock();
+    Kick();
+  }
+  if (backend_.housekeeping)
+    backend_.housekeeping(backend_.arg, cur_time);
+}
+
+void BlockCache::Kick() {
+  unique_lock<mutex> kl(kick_lock_);
+  if (kicking_) {
+    kick_again_ = true;
+    return;
+  }
+  kicking_ = true;
+  kl.unlock();
+  vector<NbdCmd *> ios;
+  vector<NbdCmd *> done;
+  for (;;) {
+    unique_lock<mutex> l(lock_);
+    RunStalled(&ios, &done);
+    RunDestage(&ios);
+    RunFlushes(&ios, &done);
+    l.unlock();
+    // Backends may complete right away, which kicks again.
+    Submit(&ios);
+    for (NbdCmd *cmd : done)
+      cmd->completion_cb(cmd);
+    ios.clear();
+    done.clear();
+    kl.lock();
+    if (!kick_again_) {
+      kicking_ = false;
+      return;
+    }
+    kick_again_ = false;
+    kl.unlock();
+  }
+}
+
+void BlockCache::RunStalled(vector<NbdCmd *> *ios, vector<NbdCmd *> *done) {
+  while (!stalled_cmds_.empty()) {
+    Stalled &st = stalled_cmds_.front();
+    NbdCmd *cmd = st.cmd;
+    if (cmd->req.type == NBD_CMD_WRITE) {
+      if (!Absorb(cmd, &st.next))
+        break;
+      if (cmd->fua) {
+        flushes_.push_back({cmd, write_seq_});
+      } else {
+        cmd->ret_error = 0;
+        done->push_back(cmd);
+      }
+    } else if (!StartDiscard(cmd, ios)) {
+      break;
+    }
+    stalled_cmds_.pop_front();
+  }
+  stalled_ = !stalled_cmds_.empty();
+}
+
+void BlockCache::RunDestage(vector<NbdCmd *> *ios) {
+  if (!params_.write_back)
+    return;
+  // Writes waiting for room or a flush write back whatever it takes,
+  // otherwise only what is above the threshold or has expired.
+  bool all = closing_ || (!stalled_cmds_.empty() &&
+                          (stalled_cmds_.front().cmd->req.type ==
+                           NBD_CMD_WRITE));
+  uint64_t flush_seq = 0;
+  for (auto &f : flushes_)
+    flush_seq = max(flush_seq, f.seq);
+  // Pages written back are clean before destaging_pages_ drops.
+  auto over_threshold = [this]() {
+    return dirty_pages_ > destaging_pages_ + dirty_threshold_;
+  };
+
+  auto writable = [this](Shard *s, uint64_t index) -> Page * {
+    auto it = s->pages.find(index);
+    if ((it == s->pages.end()) || (it->second->state != kDirty) ||
+        it->second->destaging || Overlaps(discards_, index, index + 1))
+      return nullptr;
+    return it->second;
+  };
+  for (unsigned n = 0; (n < num_shards_) &&
+                       (destages_out_ < params_.destage_depth); n++) {
+    Shard *s = &shards_[destage_shard_];
+    destage_shard_ = (destage_shard_ + 1) % num_shards_;
+    unique_lock<mutex> sl(s->lock);
+    auto it = s->dirty.begin();
+    while ((it != s->dirty.end()) &&
+           (destages_out_ < params_.destage_depth)) {
+      uint64_t index = it->second;
+      Page *page = s->pages[index];
+      if (!all && (it->first > flush_seq) &&
+          (page->dirty_time > expire_before_) && !over_threshold()) {
+        break;  // Everything after it is newer.
+      }
+      if (Overlaps(discards_, index, index + 1)) {
+        it++;
+        continue;
+      }
+      // The run of dirty pages around it, within its destage_io_size
+      // chunk.
+      uint64_t chunk = index / run_pages_ * run_pages_;
+      uint64_t chunk_end = min(chunk + run_pages_, num_blocks_);
+      uint64_t lo = index;
+      while ((lo > chunk) && writable(s, lo - 1))
+        lo--;
+      uint64_t hi = index + 1;
+      while ((hi < chunk_end) && writable(s, hi))
+        hi++;
+      void *buf = backend_.alloc_data_mem((hi - lo) * block_size_);
+      if (buf == nullptr)
+        return;  // Tried again on the next kick.
+      for (uint64_t i = lo; i < hi; i++) {
+        Page *p = s->pages[i];
+        memcpy((char *)buf + (i - lo) * block_size_, p->data, block_size_);
+        s->dirty.erase(make_pair(p->dirty_seq, i));
+        s->destaging.insert(p->dirty_seq);
+        p->destaging = true;
+      }
+      destaging_pages_ += hi - lo;
+      destage_runs_.emplace_back(lo, hi);
+      destages_out_++;
+      ios->push_back(AllocIo(nullptr, kIoDestage, NBD_CMD_WRITE, lo, hi,
+                             buf));
+      it = s->dirty.begin();
+    }
+  }
+}
+
+void BlockCache::DestageDone(Io *io) {
+  unsigned error = io->ret_error;
+  Shard *s = ShardOf(io->first);
+  unique_lock<mutex> sl(s->lock);
+  for (uint64_t i = io->first; i < io->end; i++) {
+    Page *page = s->pages[i];
+    s->destaging.erase(s->destaging.find(page->dirty_seq));
+    page->destaging = false;
+    if (page->redirtied) {
+      page->redirtied = false;
+      page->dirty_seq = page->redirty_seq;
+      s->dirty.emplace(page->dirty_seq, i);
+    } else if (error != 0) {
+      // The backend may have any version now, reads go there.
+      Remove(s, page);
+    } else {
+      MarkClean(s, page);
+    }
+  }
+  sl.unlock();
+
+  unique_lock<mutex> l(lock_);
+  auto it = find(destage_runs_.begin(), destage_runs_.end(),
+                 make_pair(io->first, io->end));
+  destage_runs_.erase(it);
+  destages_out_--;
+  destaging_pages_ -= io->end - io->first;
+  if (error != 0) {
+    destage_error_ = error;
+    destage_errors_++;
+  } else {
+    destaged_bytes_ += io->io_size;
+    destages_++;
+  }
+  l.unlock();
+  backend_.free_data_mem(io->data_buf);
+  Kick();
+  FreeIo(io);
+}
+
+void BlockCache::RunFlushes(vector<NbdCmd *> *ios, vector<NbdCmd *> *done) {
+  if (flushes_.empty())
+    return;
+  uint64_t oldest = OldestDirty();
+  size_t j = 0;
+  for (size_t i = 0; i < flushes_.size(); i++) {
+    FlushWaiter &f = flushes_[i];
+    if (f.seq >= oldest) {
+      flushes_[j++] = f;
+      continue;
+    }
+    // Everything before it is on the backend, flush that.
+    f.cmd->ret_error = destage_error_;
+    if (backend_.flush || backend_.submit_batch) {
+      ios->push_back(AllocIo(f.cmd, kIoFlush, NBD_CMD_FLUSH, 0, 0, nullptr));
+    } else {
+      done->push_back(f.cmd);
+    }
+  }
+  if (j < flushes_.size())
+    destage_error_ = 0;
+  flushes_.resize(j);
+}
+
+uint64_t BlockCache::OldestDirty() {
+  uint64_t oldest = UINT64_MAX;
+  for (unsigned i = 0; i < num_shards_; i++) {
+    Shard *s = &shards_[i];
+    unique_lock<mutex> l(s->lock);
+    if (!s->dirty.empty())
+      oldest = min(oldest, s->dirty.begin()->first);
+    if (!s->destaging.empty())
+      oldest = min(oldest, *s->destaging.begin());
+  }
+  return oldest;
+}
+
+BlockCache::Io *BlockCache::AllocIo(NbdCmd *orig, uint8_t kind,
+                                    uint32_t type, uint64_t first,
+                                    uint64_t end, void *data) {
+  pending_ios_++;
+  Io *io = nullptr;
+  unique_lock<mutex> l(io_lock_);
+  if (!free_ios_.empty()) {
+    io = free_ios_.back();
+    free_ios_.pop_back();
+  }
+  l.unlock();
+  if (io == nullptr) {
+    io = new Io();
+  } else {
+    io->Reset();
+  }
+  io->cache = this;
+  io->orig = orig;
+  io->kind = kind;
+  io->first = first;
+  io->end = end;
+  io->leader = io;
+  io->fills_left = 1;
+  io->fill_error = 0;
+  io->req.type = type;
+  io->io_offset = first * block_size_;
+  io->io_size = (end - first) * block_size_;
+  io->data_buf = data;
+  io->fua = 0;
+  io->no_hole = (orig != nullptr) ? orig->no_hole : 0;
+  io->completion_cb = IoDone;
+  io->arg = backend_.arg;
+  io->client_private = nullptr;
+  // Completes on its own in NbdCompleteCmds().
+  io->server = nullptr;
+  io->ublk_queue = nullptr;
+  return io;
+}
+
+void BlockCache::FreeIo(Io *io) {
+  unique_lock<mutex> l(io_lock_);
+  free_ios_.push_back(io);
+  l.unlock();
+  // Last, the destructor may go ahead after this.
+  pending_ios_--;
+}
+
+void BlockCache::Submit(vector<NbdCmd *> *cmds) {
+  if (cmds->empty())
+    return;
+  if (backend_.submit_batch) {
+    backend_.submit_batch(backend_.arg, cmds->data(), cmds->size());
+    return;
+  }
+  for (NbdCmd *cmd : *cmds) {
+    switch (cmd->req.type) {
+      case NBD_CMD_READ:
+        backend_.read(backend_.arg, cmd);
+        break;
+      case NBD_CMD_WRITE:
+        backend_.write(backend_.arg, cmd);
+        break;
+      case NBD_CMD_FLUSH:
+        backend_.flush(backend_.arg, cmd);
+        break;
+      case NBD_CMD_TRIM:
+        backend_.trim(backend_.arg, cmd);
+        break;
+      case NBD_CMD_WRITE_ZEROES:
+        backend_.write_zeroes(backend_.arg, cmd);
+        break;
+    }  // switch (cmd->req.type)
+  }
+}
+
+// static
+void BlockCache::IoDone(NbdCmd *cmd) {
+  Io *io = static_cast<Io *>(cmd);
+  BlockCache *cache = io->cache;
+  NbdCmd *orig = io->orig;
+  switch (io->kind) {
+    case kIoFill:
+      cache->FillDone(io);
+      return;
+    case kIoDestage:
+      cache->DestageDone(io);
+      return;
+    case kIoDiscard:
+      cache->DiscardDone(io);
+      return;
+    case kIoWrite:
+      cache->DropRange(io->first, io->end, false);
+      orig->ret_error = io->ret_error;
+      break;
+    case kIoFlush:
+      // A write back failed before it was issued.
+      if (orig->ret_error == 0)
+        orig->ret_error = io->ret_error;
+      break;
+  }  // switch (io->kind)
+  cache->FreeIo(io);
+  orig->completion_cb(orig);
+}
+
+void BlockCache::GetStats(BlockCacheStats *stats) {
+  stats->page_hits = 0;
+  stats->page_misses = 0;
+  for (unsigned i = 0; i < num_shards_; i++) {
+    unique_lock<mutex> l(shards_[i].lock);
+    stats->page_hits += shards_[i].page_hits;
+    stats->page_misses += shards_[i].page_misses;
+  }
+  uint64_t pages = stats->page_hits + stats->page_misses;
+  stats->hit_ratio = pages ? (double)stats->page_hits / pages : 0;
+  stats->read_hits = read_hits_;
+  stats->read_misses = read_misses_;
+  stats->cached_bytes = cached_pages_ * block_size_;
+  stats->dirty_bytes = dirty_pages_ * block_size_;
+  stats->destaged_bytes = destaged_bytes_;
+  stats->destages = destages_;
+  stats->destage_errors = destage_errors_;
+  stats->write_stalls = write_stalls_;
+}
@@ -0,0 +1,317 @@
+#include "buffer_pool.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <thread>
+#include <algorithm>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
+
+namespace {
+
+// Upper bound on the number of per-thread caches.
+constexpr unsigned kMaxCaches = 64;
+
+unsigned RoundUpShift(uint32_t size) {
+  unsigned shift = 0;
+  while ((1ULL << shift) < size)
+    shift++;
+  return shift;
+}
+
+// Threads get a cache slot round robin the first time they use any pool.
+atomic<unsigned> g_next_slot(0);
+thread_local int t_slot = -1;
+
+}  // anonymous namespace
+
+BufferPool::BufferPool(const BufferPoolParams &params) : params_(params) {
+  last_time_ = 0;
+}
+
+BufferPool::~BufferPool() {
+  if (mapping_ != nullptr)
+    munmap(mapping_, mapping_size_);
+}
+
+// static
+int BufferPool::New(const BufferPoolParams &params,
+                    shared_ptr<BufferPool> *ret_pool) {
+  if ((params.min_size == 0) || (params.min_size > params.max_size) ||
+      (params.max_size > (1U << 31))) {
+    return EINVAL;
+  }
+  shared_ptr<BufferPool> pool(new BufferPool(params));
+  int st = pool->Init();
+  if (st != 0) {
+    return st;
+  }
+  *ret_pool = move(pool);
+  return 0;
+}
+
+int BufferPool::Init() {
+  min_shift_ = RoundUpShift(params_.min_size);
+  unsigned max_shift = RoundUpShift(params_.max_size);
+  num_classes_ = max_shift - min_shift_ + 1;
+  if (num_classes_ > BUFFER_POOL_MAX_CLASSES) {
+    return EINVAL;
+  }
+  slab_size_ = max((size_t)BUFFER_POOL_SLAB_SIZE, (size_t)1 << max_shift);
+  num_slabs_ = params_.max_bytes / slab_size_;
+  if (num_slabs_ == 0) {
+    return EINVAL;
+  }
+  // Nothing is backed until a slab is carved, reserve extra room to
+  // align the slabs.
+  mapping_size_ = num_slabs_ * slab_size_ + slab_size_;
+  void *p = mmap(nullptr, mapping_size_, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    return errno;
+  }
+  mapping_ = p;
+  base_ = (char *)(((uintptr_t)p + slab_size_ - 1) & ~(slab_size_ - 1));
+  slab_class_.assign(num_slabs_, -1);
+  slab_free_.assign(num_slabs_, 0);
+  slab_hugetlb_.assign(num_slabs_, false);
+
+  for (unsigned c = 0; c < num_classes_; c++) {
+    SizeClass &sc = classes_[c];
+    sc.size = 1U << (min_shift_ + c);
+    sc.per_slab = slab_size_ / sc.size;
+    sc.cache_max = max(1U, params_.cache_bytes / sc.size);
+    sc.batch = max(1U, min(params_.batch_size, sc.cache_max / 2));
+  }
+  num_caches_ = min(kMaxCaches, max(1U, thread::hardware_concurrency()));
+  caches_.reset(new Cache[num_caches_]);
+  return 0;
+}
+
+unsigned BufferPool::ClassOf(uint32_t size) {
+  unsigned shift = RoundUpShift(size);
+  return (shift > min_shift_) ? (shift - min_shift_) : 0;
+}
+
+BufferPool::Cache *BufferPool::ThreadCache() {
+  if (t_slot < 0)
+    t_slot = g_next_slot++ % kMaxCaches;
+  return &caches_[t_slot % num_caches_];
+}
+
+void *BufferPool::Alloc(uint32_t size) {
+  if ((size == 0) || (size > params_.max_size))
+    return nullptr;
+  unsigned c = ClassOf(size);
+  Cache *cache = ThreadCache();
+  unique_lock<mutex> l(cache->lock);
+  vector<void *> &bufs = cache->bufs[c];
+  cache->used[c] = true;
+  if (bufs.empty()) {
+    unique_lock<mutex> pl(lock_);
+    Get(c, classes_[c].batch, &bufs);
+    if (bufs.empty()) {
+      classes_[c].failures++;
+      return nullptr;
+    }
+  }
+  void *buf = bufs.back();
+  bufs.pop_back();
+  cache->allocs[c]++;
+  return buf;
+}
+
+void BufferPool::Free(void *buf) {
+  size_t slab = SlabOf(buf);
+  assert(((char *)buf >= base_) && (slab < num_slabs_));
+  // Set before any buffer of the slab was handed out.
+  unsigned c = slab_class_[slab];
+  Cache *cache = ThreadCache();
+  unique_lock<mutex> l(cache->lock);
+  vector<void *> &bufs = cache->bufs[c];
+  bufs.push_back(buf);
+  cache->frees[c]++;
+  if (bufs.size() > classes_[c].cache_max) {
+    unique_lock<mutex> pl(lock_);
+    Put(c, classes_[c].batch, &bufs);
+  }
+}
+
+void BufferPool::Get(unsigned c, unsigned n, vector<void *> *bufs) {
+  SizeClass &sc = classes_[c];
+  if (sc.free.empty() && !CarveSlab(c))
+    return;
+  for (unsigned i = 0; (i < n) && !sc.free.empty(); i++) {
+    void *buf = sc.free.back();
+    sc.free.pop_back();
+    slab_free_[SlabOf(buf)]--;
+    bufs->push_back(buf);
+  }
+  sc.low_water = min(sc.low_water, sc.free.size());
+}
+
+void BufferPool::Put(unsigned c, unsigned n, vector<void *> *bufs) {
+  SizeClass &sc = classes_[c];
+  n = min(n, (unsigned)bufs->size());
+  for (unsigned i = 0; i < n; i++) {
+    void *buf = bufs->back();
+    bufs->pop_back();
+    slab_free_[SlabOf(buf)]++;
+    sc.free.push_back(buf);
+  }
+}
+
+bool BufferPool::CarveSlab(unsigned c) {
+  size_t slab;
+  if (!unused_slabs_.empty()) {
+    slab = unused_slabs_.back();
+    unused_slabs_.pop_back();
+  } else if (next_slab_ < num_slabs_) {
+    slab = next_slab_++;
+  } else {
+    return false;
+  }
+  char *addr = base_ + slab * slab_size_;
+  void *p = MAP_FAILED;
+  if (params_.hugepages) {
+    p = mmap(addr, slab_size_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB |
+             (21 << MAP_HUGE_SHIFT), -1, 0);
+  }
+  slab_hugetlb_[slab] = (p != MAP_FAILED);
+  if (p == MAP_FAILED) {
+    p = mmap(addr, slab_size_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (p == MAP_FAILED) {
+      unused_slabs_.push_back(slab);
+      return false;
+    }
+    if (params_.hugepages)
+      madvise(addr, slab_size_, MADV_HUGEPAGE);
+  }
+  SizeClass &sc = classes_[c];
+  slab_class_[slab] = c;
+  slab_free_[slab] = sc.per_slab;
+  // Hand out from the start of the slab first.
+  for (uint32_t i = sc.per_slab; i > 0; i--)
+    sc.free.push_back(addr + (size_t)(i - 1) * sc.size);
+  sc.slabs++;
+  slab_bytes_ += slab_size_;
+  if (slab_hugetlb_[slab])
+    hugetlb_bytes_ += slab_size_;
+  return true;
+}
+
+void BufferPool::ReleaseSlab(size_t slab) {
+  // Replacing the mapping drops the pages but keeps the address range.
+  mmap(base_ + slab * slab_size_, slab_size_, PROT_NONE,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  classes_[slab_class_[slab]].slabs--;
+  slab_class_[slab] = -1;
+  slab_free_[slab] = 0;
+  slab_bytes_ -= slab_size_;
+  if (slab_hugetlb_[slab])
+    hugetlb_bytes_ -= slab_size_;
+  slab_hugetlb_[slab] = false;
+  unused_slabs_.push_back(slab);
+}
+
+void BufferPool::HouseKeeping(time_t cur_time) {
+  time_t last = last_time_;
+  if ((cur_time == last) ||
+      !last_time_.compare_exchange_strong(last, cur_time))
+    return;
+  // Caches of threads that stopped allocating a class give it back.
+  for (unsigned i = 0; i < num_caches_; i++) {
+    Cache *cache = &caches_[i];
+    unique_lock<mutex> l(cache->lock, try_to_lock);
+    if (!l.owns_lock())
+      continue;
+    for (unsigned c = 0; c < num_classes_; c++) {
+      if (!cache->used[c] && !cache->bufs[c].empty()) {
+        unique_lock<mutex> pl(lock_);
+        Put(c, cache->bufs[c].size(), &cache->bufs[c]);
+      }
+      cache->used[c] = false;
+    }
+  }
+  unique_lock<mutex> l(lock_);
+  for (unsigned c = 0; c < num_classes_; c++) {
+    SizeClass &sc = classes_[c];
+    size_t excess = sc.low_water;
+    sc.low_water = sc.free.size();
+    if (excess < sc.per_slab)
+      continue;
+    // Give back at most half of what went unused, in whole free slabs.
+    size_t max_slabs = max((size_t)1, (excess >> 1) / sc.per_slab);
+    vector<size_t> slabs;
+    for (void *buf : sc.free) {
+      size_t slab = SlabOf(buf);
+      if (slab_free_[slab] == sc.per_slab) {
+        // Only pick a slab once.
+        slab_free_[slab]++;
+        slabs.push_back(slab);
+        if (slabs.size() == max_slabs)
+          break;
+      }
+    }
+    if (slabs.empty())
+      continue;
+    sc.free.erase(remove_if(sc.free.begin(), sc.free.end(),
+                            [this, &sc](void *buf) {
+                              return slab_free_[SlabOf(buf)] > sc.per_slab;
+                            }),
+                  sc.free.end());
+    for (size_t slab : slabs)
+      ReleaseSlab(slab);
+    sc.low_water = sc.free.size();
+  }
+}
+
+void BufferPool::GetStats(BufferPoolStats *stats) {
+  stats->reserved_bytes = num_slabs_ * slab_size_;
+  stats->classes.resize(num_classes_);
+  for (unsigned c = 0; c < num_classes_; c++) {
+    BufferPoolClassStats &cs = stats->classes[c];
+    cs.size = classes_[c].size;
+    cs.in_use = cs.cached = cs.allocs = 0;
+  }
+  uint64_t frees[BUFFER_POOL_MAX_CLASSES] = {};
+  for (unsigned i = 0; i < num_caches_; i++) {
+    Cache *cache = &caches_[i];
+    unique_lock<mutex> l(cache->lock);
+    for (unsigned c = 0; c < num_classes_; c++) {
+      stats->classes[c].cached += cache->bufs[c].size();
+      stats->classes[c].allocs += cache->allocs[c];
+      frees[c] += cache->frees[c];
+    }
+  }
+  unique_lock<mutex> l(lock_);
+  stats->slab_bytes = slab_bytes_;
+  stats->hugetlb_bytes = hugetlb_bytes_;
+  for (unsigned c = 0; c < num_classes_; c++) {
+    BufferPoolClassStats &cs = stats->classes[c];
+    cs.slabs = classes_[c].slabs;
+    cs.free = classes_[c].free.size();
+    cs.failures = classes_[c].failures;
+    // Failed allocations never got a buffer.
+    uint64_t done = cs.allocs;
+    cs.allocs += cs.failures;
+    // The caches are read one at a time, frees may run ahead.
+    cs.in_use = (done > frees[c]) ? (done - frees[c]) : 0;
+  }
+}
+
+void BufferPool::SetCallbacks(NbdParams *params) {
+  shared_ptr<BufferPool> pool = shared_from_this();
+  params->alloc_data_mem = [pool](unsigned size) {
+    return pool->Alloc(size);
+  };
+  params->free_data_mem = [pool](void *buf) { pool->Free(buf); };
+  params->housekeeping = [pool](void *, time_t t) { pool->HouseKeeping(t); };
+}
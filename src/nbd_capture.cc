@@ -0,0 +1,157 @@
+#include "nbd_capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+constexpr uint64_t kHashMul = 0x9e3779b97f4a7c15ULL;
+
+inline uint64_t HashWord(uint64_t h, uint64_t word) {
+  h = (h ^ word) * kHashMul;
+  return h ^ (h >> 29);
+}
+
+int WriteAll(int fd, const void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, buf, len);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    buf = (const char *)buf + ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+int ReadAll(int fd, void *buf, size_t len, size_t *done) {
+  *done = 0;
+  while (*done < len) {
+    ssize_t ret = read(fd, (char *)buf + *done, len - *done);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (ret == 0)
+      break;
+    *done += ret;
+  }
+  return 0;
+}
+
+}  // anonymous namespace
+
+NbdCapture::~NbdCapture() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+// static
+int NbdCapture::New(const string &path, const NbdParams &params,
+                    bool hash_payload, shared_ptr<NbdCapture> *ret_capture) {
+  shared_ptr<NbdCapture> capture(new NbdCapture());
+  capture->fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+  if (capture->fd_ < 0)
+    return errno;
+  capture->hash_payload_ = hash_payload;
+  NbdCaptureHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = NBD_CAPTURE_MAGIC;
+  header.version = NBD_CAPTURE_VERSION;
+  header.flags = hash_payload ? NBD_CAPTURE_HASHED : 0;
+  header.block_size = params.block_size;
+  header.num_blocks = params.num_blocks;
+  int st = WriteAll(capture->fd_, &header, sizeof(header));
+  if (st != 0)
+    return st;
+  NbdStatsCounters::StartClock();
+  capture->ns_per_tick_ = NbdStatsCounters::NsPerTick();
+  capture->start_ticks_ = NbdStatsCounters::Now();
+  *ret_capture = move(capture);
+  return 0;
+}
+
+// static
+int NbdCapture::Read(const string &path, NbdCaptureHeader *header,
+                     vector<NbdCaptureRecord> *records) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return errno;
+  size_t done;
+  int st = ReadAll(fd, header, sizeof(*header), &done);
+  if ((st == 0) && ((done != sizeof(*header)) ||
+                    (header->magic != NBD_CAPTURE_MAGIC) ||
+                    (header->version != NBD_CAPTURE_VERSION))) {
+    st = EINVAL;
+  }
+  records->clear();
+  NbdCaptureRecord batch[1024];
+  while (st == 0) {
+    st = ReadAll(fd, batch, sizeof(batch), &done);
+    records->insert(records->end(), batch,
+                    batch + done / sizeof(NbdCaptureRecord));
+    if (done < sizeof(batch))
+      break;
+  }
+  close(fd);
+  return st;
+}
+
+// static
+uint64_t NbdCapture::Hash(const struct iovec *iov, int iovcnt) {
+  // Words are taken from the concatenated bytes, a word split between
+  // two iovecs is put together first.
+  uint64_t h = kHashSeed;
+  uint64_t len = 0;
+  uint64_t word = 0;
+  unsigned have = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    const char *p = (const char *)iov[i].iov_base;
+    size_t n = iov[i].iov_len;
+    len += n;
+    while ((have > 0) && (n > 0)) {
+      ((char *)&word)[have++] = *p++;
+      n--;
+      if (have == sizeof(word)) {
+        h = HashWord(h, word);
+        have = 0;
+      }
+    }
+    for (; n >= sizeof(word); p += sizeof(word), n -= sizeof(word)) {
+      memcpy(&word, p, sizeof(word));
+      h = HashWord(h, word);
+    }
+    if (n > 0) {
+      word = 0;
+      memcpy(&word, p, n);
+      have = n;
+    }
+  }
+  if (have > 0)
+    h = HashWord(h, word);
+  h = HashWord(h, len);
+  // 0 means not hashed.
+  return h ? h : 1;
+}
+
+void NbdCapture::Write(const NbdCaptureRecord *records, unsigned n) {
+  unique_lock<mutex> l(lock_);
+  if (error_ != 0)
+    return;
+  error_ = WriteAll(fd_, records, n * sizeof(*records));
+  if (error_ == 0)
+    records_ += n;
+}
+
+void NbdCapture::GetStats(uint64_t *records, int *error) {
+  unique_lock<mutex> l(lock_);
+  *records = records_;
+  *error = error_;
+}
@@ -1,15 +1,24 @@
 #include "nbd_loopback_server.h"
+#include "nbd_netlink.h"
+#include "nbd_prefetcher.h"
+#include "ublk_server.h"
 
 #include <set>
+#include <map>
 #include <list>
+#include <vector>
 #include <thread>
+#include <chrono>
 
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <linux/fs.h>
 
 using namespace std;
@@ -21,28 +30,287 @@ mutex g_nbd_lock;
 uint32_t g_num_nbds = 0;
 set<uint32_t> g_nbds_avail;
 list<unique_ptr<ServerInfo>> g_server_list;
+// Set by NbdLoopbackInit() when the kernel has the nbd netlink family.
+// Devices are then configured over netlink instead of the ioctls.
+unique_ptr<NbdNetlink> g_netlink;
+
+// Upper bound on NbdParams::num_connections.
+constexpr uint32_t kMaxConnections = 64;
+
+// Upper bound on the number of poll groups.
+constexpr uint32_t kMaxPollGroups = 256;
+// Every this many polls of a group, its servers get a ConfigPoll().
+constexpr unsigned kConfigPollInterval = 500;
 
 // Kernel thread state
 #define KTHR_STATE_INIT		0
 #define KTHR_STATE_RUN		1
 #define KTHR_STATE_EXIT		2
+
+class PollGroup;
+
+// One socket of a device and the NbdServer serving it, or one queue of
+// a ublk device. Connections are polled independently, so different
+// threads can drive different connections of the same device.
+class ConnInfo {
+ public:
+  ConnInfo() { busy = false; }
+  ~ConnInfo();
+  // Updates the registration of this connection in its group's epoll
+  // set, events = 0 removes it. Caller should be holding group->lock.
+  void SetWaitEvents(int fd, uint32_t events);
+
+  // Forwarded to whichever of server and ublk_queue is set.
+  bool DataPoll(bool *did_work) {
+    return server ? server->DataPoll(did_work) :
+                    ublk_queue->DataPoll(did_work);
+  }
+  bool PrepareWait(int *fd, uint32_t *events) {
+    return server ? server->PrepareWait(fd, events) :
+                    ublk_queue->PrepareWait(fd, events);
+  }
+  void SetWakeup(int efd, const atomic<int> *sleepers) {
+    if (server)
+      server->SetWakeup(efd, sleepers);
+    else
+      ublk_queue->SetWakeup(efd, sleepers);
+  }
+
+  unique_ptr<NbdServer> server;
+  // Owned by ServerInfo::ublk.
+  UblkQueue *ublk_queue = nullptr;
+  // socks[0] is for kernel and socks[1] is for NbdServer.
+  int socks[2] = { -1, -1 };
+  PollGroup *group = nullptr;
+  // What this connection is registered for in group->epoll_fd, if
+  // anything.
+  int wait_fd = -1;
+  uint32_t wait_events = 0;
+  // Held by whichever thread is polling the server, the group owner or
+  // a thief.
+  atomic<bool> busy;
+};
+
+// A set of connections polled together, typically by one thread. The
+// data path only takes the group's own lock, for a moment, to grab the
+// current list of connections. The list is copied on every change and
+// a connection is only destroyed once no poller holds a list with it.
+class PollGroup {
+ public:
+  ~PollGroup();
+  int Init();
+
+  void Add(ConnInfo *conn);
+  // Returns once no poller can touch conn anymore.
+  void Remove(ConnInfo *conn);
+  shared_ptr<vector<ConnInfo *>> Conns();
+
+  // Polls every connection not already being polled. owner is set if
+  // this is a poll of the group itself rather than a steal from it.
+  bool Poll(bool owner);
+  // Returns false if some connection has work right away. Otherwise the
+  // epoll set is ready to wait on. Caller has raised sleepers.
+  bool PrepareWait();
+  // Resets wakeup_fd after a wakeup.
+  void ClearWakeup();
+
+  // Protects conns, num_conns and the epoll registrations.
+  mutex lock;
+  shared_ptr<vector<ConnInfo *>> conns;
+  unsigned num_conns = 0;
+  // Idle pollers of this group sleep in epoll_fd, which has the fd of
+  // every server plus wakeup_fd. Servers signal wakeup_fd from
+  // CompletionCb() while sleepers is non-zero.
+  int epoll_fd = -1;
+  int wakeup_fd = -1;
+  atomic<int> sleepers;
+  // Number of connections registered per fd in epoll_fd. Servers sharing
+  // an io_uring share its fd.
+  map<int, unsigned> epoll_refs;
+  // Set while the last poll by the owner found work, thieves only go
+  // for groups which are active.
+  atomic<bool> active;
+  atomic<unsigned> poll_count;
+};
+
+// Groups are never destroyed, so pollers can index g_groups without a
+// lock. g_num_groups is only bumped once a group is fully set up.
+PollGroup *g_groups[kMaxPollGroups];
+atomic<unsigned> g_num_groups(0);
+// Has the epoll_fd of every group, for NbdLoopbackWait().
+int g_epoll_fd = -1;
+
+ConnInfo::~ConnInfo() {
+  server.reset();
+  if (socks[0] >= 0) close(socks[0]);
+  if (socks[1] >= 0) close(socks[1]);
+  socks[0] = -1;
+  socks[1] = -1;
+}
+
+void ConnInfo::SetWaitEvents(int fd, uint32_t events) {
+  if ((fd == wait_fd) && (events == wait_events))
+    return;
+  int epoll_fd = group->epoll_fd;
+  map<int, unsigned> &refs = group->epoll_refs;
+  if (wait_events != 0) {
+    if (--refs[wait_fd] == 0) {
+      refs.erase(wait_fd);
+      if ((fd == wait_fd) && (events != 0)) {
+        // Sole user of the fd, just change the events.
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        refs[fd] = 1;
+        wait_events = events;
+        return;
+      }
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, wait_fd, nullptr);
+    }
+  }
+  wait_fd = fd;
+  wait_events = events;
+  if (events == 0)
+    return;
+  // A shared fd keeps the events of its first user, only io_uring fds
+  // are shared and they always wait for EPOLLIN.
+  if (refs[fd]++ == 0) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+PollGroup::~PollGroup() {
+  if (epoll_fd >= 0) close(epoll_fd);
+  if (wakeup_fd >= 0) close(wakeup_fd);
+}
+
+int PollGroup::Init() {
+  conns = make_shared<vector<ConnInfo *>>();
+  sleepers = 0;
+  active = false;
+  poll_count = 0;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    return errno;
+  }
+  wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeup_fd < 0) {
+    return errno;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = wakeup_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) < 0) {
+    return errno;
+  }
+  ev.data.ptr = this;
+  if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, epoll_fd, &ev) < 0) {
+    return errno;
+  }
+  return 0;
+}
+
+void PollGroup::Add(ConnInfo *conn) {
+  conn->group = this;
+  conn->SetWakeup(wakeup_fd, &sleepers);
+  unique_lock<mutex> l(lock);
+  shared_ptr<vector<ConnInfo *>> new_conns(new vector<ConnInfo *>(*conns));
+  new_conns->push_back(conn);
+  conns = move(new_conns);
+  num_conns++;
+}
+
+void PollGroup::Remove(ConnInfo *conn) {
+  unique_lock<mutex> l(lock);
+  shared_ptr<vector<ConnInfo *>> old_conns = conns;
+  shared_ptr<vector<ConnInfo *>> new_conns(new vector<ConnInfo *>());
+  for (ConnInfo *c : *old_conns) {
+    if (c != conn)
+      new_conns->push_back(c);
+  }
+  conns = move(new_conns);
+  num_conns--;
+  l.unlock();
+  // New polls only see the new list, wait for the ones using the old.
+  while (old_conns.use_count() > 1)
+    usleep(1000);
+  atomic_thread_fence(memory_order_acquire);
+  l.lock();
+  conn->SetWaitEvents(-1, 0);
+  conn->group = nullptr;
+}
+
+shared_ptr<vector<ConnInfo *>> PollGroup::Conns() {
+  unique_lock<mutex> l(lock);
+  return conns;
+}
+
+bool PollGroup::Poll(bool owner) {
+  bool config_poll = owner &&
+                     ((++poll_count % kConfigPollInterval) == 0);
+  bool any_work = false;
+  shared_ptr<vector<ConnInfo *>> cur_conns = Conns();
+  for (ConnInfo *conn : *cur_conns) {
+    // A ublk queue stays with the first thread polling it, leave those
+    // to the owner.
+    if (!owner && conn->ublk_queue)
+      continue;
+    bool flg = false;
+    if (!conn->busy.compare_exchange_strong(flg, true))
+      continue;
+    bool did_work = false;
+    conn->DataPoll(&did_work);
+    any_work |= did_work;
+    if (config_poll && conn->server)
+      conn->server->ConfigPoll();
+    conn->busy = false;
+  }
+  if (owner)
+    active = any_work;
+  return any_work;
+}
+
+bool PollGroup::PrepareWait() {
+  shared_ptr<vector<ConnInfo *>> cur_conns = Conns();
+  unique_lock<mutex> l(lock);
+  for (ConnInfo *conn : *cur_conns) {
+    int fd;
+    uint32_t events;
+    if (!conn->PrepareWait(&fd, &events))
+      return false;
+    conn->SetWaitEvents(fd, events);
+  }
+  return true;
+}
+
+void PollGroup::ClearWakeup() {
+  eventfd_t val;
+  eventfd_read(wakeup_fd, &val);
+}
+
 class ServerInfo {
  public:
   ServerInfo();
   ~ServerInfo() { Cleanup(); }
   void Cleanup();
 
-  unique_ptr<NbdServer> server;
+  // Fixed once the device is started. Pollers reach the connections
+  // through their poll groups, never through g_server_list.
+  vector<unique_ptr<ConnInfo>> conns;
+  // Set for NBD_TRANSPORT_UBLK, nbd_num is then the ublk device id.
+  unique_ptr<UblkServer> ublk;
   unique_ptr<thread> kernel_thread;
   int nbd_num = -1;
   int devfd = -1;
-  // socks[0] is for kernel and socks[1] is for NbdServer.
-  int socks[2] = { -1, -1 };
   unsigned kernel_thread_state = KTHR_STATE_INIT;
   unsigned kernel_thread_error = 0;
-  unsigned being_polled:1,  // 1 = polling thread is holding a ref.
-           shutting_down:1,
+  unsigned shutting_down:1,
            in_global_list:1,  // Not sure if this is needed.
+           nl_connected:1,  // Device was started via g_netlink.
            rsvd:1;
   string nbd_node;
 };
@@ -52,8 +320,7 @@ ServerInfo::ServerInfo() {
   devfd = -1;
   kernel_thread_state = KTHR_STATE_INIT;
   kernel_thread_error = 0;
-  socks[0] = socks[1] = -1;
-  being_polled = shutting_down = in_global_list = 0;
+  shutting_down = in_global_list = nl_connected = 0;
 }
 
 // When Cleanup is called, ideally, no nbd callbacks should be
@@ -62,17 +329,28 @@ ServerInfo::ServerInfo() {
 void ServerInfo::Cleanup() {
   unique_lock<mutex> l(g_nbd_lock);
   shutting_down = 1;
-  while (being_polled) {
-    l.unlock();
-    usleep(1000);
-    l.lock();
-  }
   l.unlock();
-  server.reset();
-  if (socks[0] >= 0) close(socks[0]);
-  if (socks[1] >= 0) close(socks[1]);
-  socks[0] = -1;
-  socks[1] = -1;
+  if (ublk) {
+    // The queues have to be polled while the block device goes away.
+    ublk->Stop();
+  }
+  for (auto &conn : conns) {
+    if (conn->group)
+      conn->group->Remove(conn.get());
+  }
+  if (nl_connected) {
+    // Kernel sends a disconnect on every socket and releases the device.
+    g_netlink->Disconnect(nbd_num);
+    nl_connected = 0;
+    nbd_num = -1;
+  }
+  // Tear down all connections together, the kernel thread only exits
+  // once every socket of the device is gone.
+  conns.clear();
+  if (ublk) {
+    ublk.reset();
+    nbd_num = -1;
+  }
   if (kernel_thread.get()) {
     while (kernel_thread_state != KTHR_STATE_EXIT)
       usleep(1000);
@@ -85,7 +363,7 @@ void ServerInfo::Cleanup() {
     close(devfd);
     devfd = -1;
   }
-  if (nbd_num > 0) {
+  if (nbd_num >= 0) {
     l.lock();
     g_nbds_avail.insert(nbd_num);
     nbd_num = -1;
@@ -95,10 +373,31 @@ void ServerInfo::Cleanup() {
 
 }  // anonymouns namespace
 
-int NbdLoopbackInit() {
+int NbdLoopbackInit(bool use_netlink) {
   // Make sure NBD is loaded.
   system("/sbin/modprobe nbd >/dev/null 2>&1");
   g_nbds_avail.clear();
+  g_netlink.reset();
+  if (g_epoll_fd < 0) {
+    g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epoll_fd < 0) {
+      return errno;
+    }
+  }
+  // Group 0 always exists, applications which never create groups get
+  // all their connections in it.
+  if (g_num_groups == 0) {
+    int group_id;
+    int st = NbdLoopbackCreatePollGroup(&group_id);
+    if (st != 0) {
+      return st;
+    }
+  }
+  // With netlink the kernel hands out device indexes, no need to scan.
+  if (use_netlink && (NbdNetlink::New(&g_netlink) == 0)) {
+    return 0;
+  }
+  g_netlink.reset();
   uint32_t ndx = 0;
   string nbd_class_path = "/sys/class/block/nbd";
   while (1) {
@@ -131,15 +430,26 @@ int NbdLoopbackInit() {
 
 namespace {
 
+unsigned ServerFlags(ServerInfo *info, const NbdParams &params) {
+  unsigned flags = NBD_FLAG_SEND_FUA|NBD_FLAG_SEND_TRIM|NBD_FLAG_SEND_FLUSH;
+  if (info->conns.size() > 1)
+    flags |= NBD_FLAG_CAN_MULTI_CONN;
+  if (params.write_zeroes)
+    flags |= NBD_FLAG_SEND_WRITE_ZEROES;
+  return flags;
+}
+
 // Kernel thread does not own ServerInfo
-void NbdKernelThread(ServerInfo *info) {
-  if (ioctl(info->devfd, NBD_SET_SOCK, info->socks[0]) < 0) {
-    info->kernel_thread_error = errno;
-    info->kernel_thread_state = KTHR_STATE_EXIT;
-    return;
+void NbdKernelThread(ServerInfo *info, unsigned flags) {
+  // Every NBD_SET_SOCK adds one more connection to the device.
+  for (auto &conn : info->conns) {
+    if (ioctl(info->devfd, NBD_SET_SOCK, conn->socks[0]) < 0) {
+      info->kernel_thread_error = errno;
+      info->kernel_thread_state = KTHR_STATE_EXIT;
+      return;
+    }
   }
-  if (ioctl(info->devfd, NBD_SET_FLAGS, NBD_FLAG_SEND_FUA|
-            NBD_FLAG_SEND_TRIM|NBD_FLAG_SEND_FLUSH) < 0) {
+  if (ioctl(info->devfd, NBD_SET_FLAGS, flags) < 0) {
     info->kernel_thread_error = errno;
     info->kernel_thread_state = KTHR_STATE_EXIT;
     return;
@@ -152,28 +462,51 @@ void NbdKernelThread(ServerInfo *info) {
   info->kernel_thread_state = KTHR_STATE_EXIT;
 }
 
-}  // anonymous namespace
-
-int NbdLoopbackStart(
-    const NbdParams &params, int *nbd_num, string *ret_nbd_dev) {
-
-  unique_ptr<ServerInfo> info(new ServerInfo());
+// Reads a number from a sysfs attribute, 0 if it cannot.
+uint32_t ReadSysfsU32(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return 0;
+  char str[16] = {0};
+  int ret = read(fd, str, sizeof(str) - 1);
+  close(fd);
+  return (ret > 0) ? strtoul(str, nullptr, 0) : 0;
+}
 
-  if (g_num_nbds == 0) {
-    return ENOENT;
-  }
-  // Validate blocksize.
-  uint32_t bsize = params.block_size;
-  if (((bsize & (bsize - 1)) != 0) || (bsize < 512) || (bsize > 65536)) {
-    return EINVAL;
+// nbd has no attribute for the max request size, it is set through the
+// queue limits in sysfs instead, clamped to what the driver supports.
+// Nothing is written if the limit is already right.
+int SetMaxSectors(int nbd_num, uint32_t max_io_size) {
+  string queue_path = string("/sys/block/nbd") + to_string(nbd_num) +
+                      "/queue/";
+  uint32_t kb = max_io_size / 1024;
+  uint32_t hw_kb = ReadSysfsU32(queue_path + "max_hw_sectors_kb");
+  if ((hw_kb > 0) && (hw_kb < kb))
+    kb = hw_kb;
+  if (ReadSysfsU32(queue_path + "max_sectors_kb") == kb)
+    return 0;
+  int fd = open((queue_path + "max_sectors_kb").c_str(), O_WRONLY);
+  if (fd < 0) {
+    return errno;
   }
+  string kb_str = to_string(kb);
+  int ret = write(fd, kb_str.c_str(), kb_str.size());
+  int st = (ret < 0) ? errno : 0;
+  close(fd);
+  return st;
+}
+
+// Reserves an nbd device from g_nbds_avail and starts it with the
+// ioctl interface, which needs a thread parked in NBD_DO_IT.
+int StartIoctl(ServerInfo *info, const NbdParams &params, int nbd_num) {
   unique_lock<mutex> l(g_nbd_lock);
   if (g_nbds_avail.size() == 0) {
     return ENOENT;
   }
-  info->nbd_num = *nbd_num;
+  info->nbd_num = nbd_num;
   if (info->nbd_num >= 0) {
     if (g_nbds_avail.find(info->nbd_num) == g_nbds_avail.end()) {
+      info->nbd_num = -1;
       return ENOENT;
     }
   } else {
@@ -182,26 +515,22 @@ int NbdLoopbackStart(
   g_nbds_avail.erase(info->nbd_num);
   l.unlock();
 
-  *nbd_num = info->nbd_num;
-  *ret_nbd_dev = string("/dev/nbd") + to_string(info->nbd_num);
-  info->nbd_node = *ret_nbd_dev;
-  info->devfd = open(ret_nbd_dev->c_str(), O_RDWR);
+  info->nbd_node = string("/dev/nbd") + to_string(info->nbd_num);
+  info->devfd = open(info->nbd_node.c_str(), O_RDWR);
   if (info->devfd < 0) {
     return errno;
   }
-  if (socketpair(AF_UNIX, SOCK_STREAM, 0, info->socks) < 0) {
-    return errno;
-  }
   if (ioctl(info->devfd, NBD_CLEAR_SOCK, 0) < 0) {
     return errno;
   }
-  if (ioctl(info->devfd, NBD_SET_BLKSIZE, bsize) < 0) {
+  if (ioctl(info->devfd, NBD_SET_BLKSIZE, params.block_size) < 0) {
     return errno;
   }
   if (ioctl(info->devfd, NBD_SET_SIZE_BLOCKS, params.num_blocks) < 0) {
     return errno;
   }
-  info->kernel_thread.reset(new thread(NbdKernelThread, info.get()));
+  info->kernel_thread.reset(new thread(NbdKernelThread, info,
+                                      ServerFlags(info, params)));
   while (info->kernel_thread_state == KTHR_STATE_INIT) {
     this_thread::yield();
   }
@@ -209,13 +538,141 @@ int NbdLoopbackStart(
     return EIO;
   }
   assert(info->kernel_thread_state == KTHR_STATE_RUN);
-  ioctl(info->devfd, BLKBSZSET, bsize);
-  auto st = NbdServer::New(info->socks[1], params, &info->server);
+  ioctl(info->devfd, BLKBSZSET, params.block_size);
+  return 0;
+}
+
+// Starts the device with a single NBD_CMD_CONNECT. The kernel keeps its
+// own reference to the sockets and needs no thread from us.
+int StartNetlink(ServerInfo *info, const NbdParams &params, int nbd_num) {
+  vector<int> socks;
+  for (auto &conn : info->conns)
+    socks.push_back(conn->socks[0]);
+  int st = g_netlink->Connect(
+      &nbd_num, params.num_blocks * params.block_size, params.block_size,
+      ServerFlags(info, params), params.dead_conn_timeout, socks);
   if (st != 0) {
     return st;
   }
-  info->socks[1] = -1;  // this is now owned by server.
-  l.lock();
+  info->nl_connected = 1;
+  info->nbd_num = nbd_num;
+  info->nbd_node = string("/dev/nbd") + to_string(info->nbd_num);
+  return 0;
+}
+
+// Adds a ublk device with one connection per queue.
+int StartUblk(ServerInfo *info, const NbdParams &params, int nbd_num) {
+  int st = UblkServer::New(params, nbd_num, &info->ublk);
+  if (st != 0) {
+    return st;
+  }
+  for (unsigned q = 0; q < info->ublk->num_queues(); q++) {
+    unique_ptr<ConnInfo> conn(new ConnInfo());
+    conn->ublk_queue = info->ublk->queue(q);
+    info->conns.push_back(move(conn));
+  }
+  info->nbd_num = info->ublk->dev_id();
+  info->nbd_node = string("/dev/ublkb") + to_string(info->nbd_num);
+  return 0;
+}
+
+// Returns the group with the fewest connections.
+PollGroup *LeastLoadedGroup() {
+  PollGroup *best = nullptr;
+  unsigned best_conns = 0;
+  unsigned num_groups = g_num_groups;
+  for (unsigned i = 0; i < num_groups; i++) {
+    unique_lock<mutex> l(g_groups[i]->lock);
+    if ((best == nullptr) || (g_groups[i]->num_conns < best_conns)) {
+      best = g_groups[i];
+      best_conns = best->num_conns;
+    }
+  }
+  return best;
+}
+
+}  // anonymous namespace
+
+int NbdLoopbackStart(
+    const NbdParams &params, int *nbd_num, string *ret_nbd_dev) {
+
+  unique_ptr<ServerInfo> info(new ServerInfo());
+
+  if ((params.transport != NBD_TRANSPORT_NBD) &&
+      (params.transport != NBD_TRANSPORT_UBLK)) {
+    return EINVAL;
+  }
+  if ((params.transport == NBD_TRANSPORT_NBD) && !g_netlink &&
+      (g_num_nbds == 0)) {
+    return ENOENT;
+  }
+  // Validate blocksize.
+  uint32_t bsize = params.block_size;
+  if (((bsize & (bsize - 1)) != 0) || (bsize < 512) || (bsize > 65536)) {
+    return EINVAL;
+  }
+  if ((params.num_connections == 0) ||
+      (params.num_connections > kMaxConnections)) {
+    return EINVAL;
+  }
+  // At least a page, in whole blocks.
+  if ((params.max_io_size < 4096) || (params.max_io_size % bsize != 0)) {
+    return EINVAL;
+  }
+  if ((params.poll_group < -1) || (params.poll_group >= (int)g_num_groups) ||
+      (g_num_groups == 0)) {
+    return EINVAL;
+  }
+  int st;
+  if (params.transport == NBD_TRANSPORT_UBLK) {
+    st = StartUblk(info.get(), params, *nbd_num);
+    if (st != 0) {
+      return st;
+    }
+  } else {
+    for (uint32_t i = 0; i < params.num_connections; i++) {
+      unique_ptr<ConnInfo> conn(new ConnInfo());
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, conn->socks) < 0) {
+        return errno;
+      }
+      info->conns.push_back(move(conn));
+    }
+    st = g_netlink ? StartNetlink(info.get(), params, *nbd_num) :
+                     StartIoctl(info.get(), params, *nbd_num);
+    if (st != 0) {
+      return st;
+    }
+    // Best effort, /sys may be read-only, e.g. in a container. Requests
+    // are then split at the default limit, which works just the same.
+    st = SetMaxSectors(info->nbd_num, params.max_io_size);
+    if (st != 0) {
+      fprintf(stderr, "nbd%d: could not set max_sectors_kb : %s\n",
+              info->nbd_num, strerror(st));
+    }
+    // The connections share one prefetcher, streams get spread over them.
+    NbdParams conn_params = params;
+    if (!conn_params.prefetcher && (params.prefetch_size > 0)) {
+      st = NbdPrefetcher::New(params, &conn_params.prefetcher);
+      if (st != 0) {
+        return st;
+      }
+    }
+    for (auto &conn : info->conns) {
+      st = NbdServer::New(conn->socks[1], conn_params, &conn->server);
+      if (st != 0) {
+        return st;
+      }
+      conn->socks[1] = -1;  // this is now owned by server.
+    }
+  }
+  *nbd_num = info->nbd_num;
+  *ret_nbd_dev = info->nbd_node;
+  for (auto &conn : info->conns) {
+    PollGroup *group = (params.poll_group >= 0) ?
+                       g_groups[params.poll_group] : LeastLoadedGroup();
+    group->Add(conn.get());
+  }
+  unique_lock<mutex> l(g_nbd_lock);
   info->in_global_list = 1;
   g_server_list.push_back(move(info));
 
@@ -228,11 +685,6 @@ void NbdLoopbackStop(const string &nbd_node) {
   for (auto it = g_server_list.begin(); it != g_server_list.end(); it++) {
     if ((*it)->nbd_node == nbd_node) {
       (*it)->shutting_down = 1;
-      while ((*it)->being_polled) {
-        l.unlock();
-        usleep(1000);
-        l.lock();
-      }
       info = it->release();
       g_server_list.erase(it);
       break;
@@ -242,25 +694,175 @@ void NbdLoopbackStop(const string &nbd_node) {
   delete info;  // The destructor takes care of the rest.
 }
 
-void NbdLoopbackPoll() {
-  static int loop_count = 0;
-  bool config_poll = false;
+int NbdLoopbackGetMergeStats(const string &nbd_node, NbdMergeStats *stats) {
+  *stats = NbdMergeStats();
   unique_lock<mutex> l(g_nbd_lock);
-  // g_nbd_lock also protects loop_count.
-  if (++loop_count == 500) {
-    loop_count = 0;
-    config_poll = true;
+  for (auto &info : g_server_list) {
+    if (info->nbd_node != nbd_node)
+      continue;
+    for (auto &conn : info->conns) {
+      if (!conn->server)
+        continue;
+      NbdMergeStats conn_stats;
+      conn->server->GetMergeStats(&conn_stats);
+      stats->cmds += conn_stats.cmds;
+      stats->merged_cmds += conn_stats.merged_cmds;
+      stats->merges += conn_stats.merges;
+      stats->merged_bytes += conn_stats.merged_bytes;
+    }
+    return 0;
   }
-  for (auto it = g_server_list.begin(); it != g_server_list.end(); it++) {
-    ServerInfo *info = it->get();
-    if (info->shutting_down || info->being_polled)
+  return ENOENT;
+}
+
+int NbdLoopbackGetPrefetchStats(const string &nbd_node,
+                                NbdPrefetchStats *stats) {
+  *stats = NbdPrefetchStats();
+  unique_lock<mutex> l(g_nbd_lock);
+  for (auto &info : g_server_list) {
+    if (info->nbd_node != nbd_node)
       continue;
-    info->being_polled = 1;
-    l.unlock();
-    info->server->DataPoll();
-    if (config_poll)
-      info->server->ConfigPoll();
-    l.lock();
-    info->being_polled = 0;
+    // Every connection has the same one.
+    if (!info->conns.empty() && info->conns[0]->server)
+      info->conns[0]->server->GetPrefetchStats(stats);
+    return 0;
+  }
+  return ENOENT;
+}
+
+int NbdLoopbackGetStats(const string &nbd_node, NbdStats *stats) {
+  *stats = NbdStats();
+  unique_lock<mutex> l(g_nbd_lock);
+  for (auto &info : g_server_list) {
+    if (info->nbd_node != nbd_node)
+      continue;
+    for (auto &conn : info->conns) {
+      if (!conn->server)
+        continue;
+      NbdStats conn_stats;
+      conn->server->GetStats(&conn_stats);
+      stats->Add(conn_stats);
+    }
+    return 0;
+  }
+  return ENOENT;
+}
+
+int NbdLoopbackCreatePollGroup(int *group_id) {
+  unique_lock<mutex> l(g_nbd_lock);
+  unsigned id = g_num_groups;
+  if (id == kMaxPollGroups) {
+    return ENOSPC;
+  }
+  unique_ptr<PollGroup> group(new PollGroup());
+  int st = group->Init();
+  if (st != 0) {
+    return st;
+  }
+  g_groups[id] = group.release();
+  g_num_groups = id + 1;
+  *group_id = id;
+  return 0;
+}
+
+namespace {
+
+// Sleeps until one of the servers of groups [first, first + count) has
+// work or timeout_ms passes, unless there is work already.
+void ParkPoller(unsigned first, unsigned count, int timeout_ms) {
+  // Has to be visible before the servers are checked, see
+  // NbdServer::CompletionCb().
+  for (unsigned i = first; i < first + count; i++)
+    g_groups[i]->sleepers++;
+  bool sleep = true;
+  for (unsigned i = first; sleep && (i < first + count); i++)
+    sleep = g_groups[i]->PrepareWait();
+  if (sleep && (count == 1)) {
+    PollGroup *group = g_groups[first];
+    struct epoll_event evs[16];
+    int n = epoll_wait(group->epoll_fd, evs, 16, timeout_ms);
+    for (int i = 0; i < n; i++) {
+      if (evs[i].data.fd == group->wakeup_fd)
+        group->ClearWakeup();
+    }
+  } else if (sleep) {
+    // g_epoll_fd reports which groups have something ready.
+    struct epoll_event evs[16];
+    int n = epoll_wait(g_epoll_fd, evs, 16, timeout_ms);
+    for (int i = 0; i < n; i++)
+      ((PollGroup *)evs[i].data.ptr)->ClearWakeup();
   }
+  for (unsigned i = first; i < first + count; i++)
+    g_groups[i]->sleepers--;
+}
+
+// Runs poll() until it does some work or timeout_ms passes, parking the
+// thread with park(ms) when it is idle for more than spin_us.
+template <class P, class W>
+bool WaitLoop(int timeout_ms, unsigned spin_us, P poll, W park) {
+  // Last time this thread found work, drives the spin budget.
+  static thread_local chrono::steady_clock::time_point last_work;
+  auto now = chrono::steady_clock::now();
+  auto deadline = now + chrono::milliseconds(max(timeout_ms, 0));
+  while (1) {
+    if (poll()) {
+      last_work = chrono::steady_clock::now();
+      return true;
+    }
+    now = chrono::steady_clock::now();
+    if ((timeout_ms >= 0) && (now >= deadline))
+      return false;
+    if (now - last_work < chrono::microseconds(spin_us))
+      continue;
+    int ms = -1;
+    if (timeout_ms >= 0) {
+      // Round up, epoll_wait() only takes milliseconds.
+      ms = (chrono::duration_cast<chrono::microseconds>(deadline - now)
+                .count() + 999) / 1000;
+    }
+    park(ms);
+  }
+}
+
+}  // anonymous namespace
+
+bool NbdLoopbackPoll() {
+  bool any_work = false;
+  unsigned num_groups = g_num_groups;
+  for (unsigned i = 0; i < num_groups; i++)
+    any_work |= g_groups[i]->Poll(true);
+  return any_work;
+}
+
+bool NbdLoopbackWait(int timeout_ms, unsigned spin_us) {
+  return WaitLoop(timeout_ms, spin_us, NbdLoopbackPoll, [](int ms) {
+      ParkPoller(0, g_num_groups, ms);
+    });
+}
+
+bool NbdLoopbackPollGroup(int group_id, bool steal) {
+  unsigned num_groups = g_num_groups;
+  if ((group_id < 0) || (group_id >= (int)num_groups))
+    return false;
+  bool did_work = g_groups[group_id]->Poll(true);
+  if (did_work || !steal)
+    return did_work;
+  // Nothing to do here, help the next group which is busy.
+  for (unsigned i = 1; i < num_groups; i++) {
+    PollGroup *group = g_groups[(group_id + i) % num_groups];
+    if (group->active)
+      return group->Poll(false);
+  }
+  return false;
+}
+
+bool NbdLoopbackWaitGroup(int group_id, int timeout_ms, unsigned spin_us,
+                          bool steal) {
+  if ((group_id < 0) || (group_id >= (int)g_num_groups))
+    return false;
+  return WaitLoop(timeout_ms, spin_us,
+                  [group_id, steal]() {
+                    return NbdLoopbackPollGroup(group_id, steal);
+                  },
+                  [group_id](int ms) { ParkPoller(group_id, 1, ms); });
 }
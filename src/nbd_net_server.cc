@@ -0,0 +1,646 @@
+#include "nbd_net_server.h"
+#include "nbd_prefetcher.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace {
+
+// Handshake magics.
+constexpr uint64_t kNbdMagic = 0x4e42444d41474943ULL;  // "NBDMAGIC"
+constexpr uint64_t kNbdOptMagic = 0x49484156454f5054ULL;  // "IHAVEOPT"
+constexpr uint64_t kNbdRepMagic = 0x3e889045565a9ULL;
+// Handshake flags of the server, and the same bits from the client.
+constexpr uint16_t kFlagFixedNewstyle = 1 << 0;
+constexpr uint16_t kFlagNoZeroes = 1 << 1;
+// Options.
+constexpr uint32_t kOptExportName = 1;
+constexpr uint32_t kOptAbort = 2;
+constexpr uint32_t kOptList = 3;
+constexpr uint32_t kOptInfo = 6;
+constexpr uint32_t kOptGo = 7;
+constexpr uint32_t kOptStructuredReply = 8;
+// Option replies.
+constexpr uint32_t kRepAck = 1;
+constexpr uint32_t kRepServer = 2;
+constexpr uint32_t kRepInfo = 3;
+constexpr uint32_t kRepErrUnsup = (1U << 31) + 1;
+constexpr uint32_t kRepErrPolicy = (1U << 31) + 2;
+constexpr uint32_t kRepErrInvalid = (1U << 31) + 3;
+constexpr uint32_t kRepErrUnknown = (1U << 31) + 6;
+// NBD_REP_INFO types.
+constexpr uint16_t kInfoExport = 0;
+constexpr uint16_t kInfoName = 1;
+constexpr uint16_t kInfoDescription = 2;
+constexpr uint16_t kInfoBlockSize = 3;
+// Longest option we take, export names are at most 4K.
+constexpr uint32_t kMaxOptLen = 16 * 1024;
+// Padding of the NBD_OPT_EXPORT_NAME reply without NO_ZEROES.
+constexpr unsigned kExportNamePad = 124;
+// Connections are housekept every this many polls.
+constexpr unsigned kConfigPollInterval = 500;
+
+void Append16(string *s, uint16_t v) {
+  v = htobe16(v);
+  s->append((const char *)&v, sizeof(v));
+}
+
+void Append32(string *s, uint32_t v) {
+  v = htobe32(v);
+  s->append((const char *)&v, sizeof(v));
+}
+
+void Append64(string *s, uint64_t v) {
+  v = htobe64(v);
+  s->append((const char *)&v, sizeof(v));
+}
+
+uint16_t Get16(const char *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return be16toh(v);
+}
+
+uint32_t Get32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return be32toh(v);
+}
+
+uint64_t Get64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return be64toh(v);
+}
+
+// The handshake is done with blocking I/O under socket timeouts.
+bool ReadFull(int fd, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = recv(fd, buf, len, 0);
+    if ((ret < 0) && (errno == EINTR))
+      continue;
+    if (ret <= 0)
+      return false;
+    buf = (char *)buf + ret;
+    len -= ret;
+  }
+  return true;
+}
+
+bool WriteFull(int fd, const string &s) {
+  const char *buf = s.data();
+  size_t len = s.size();
+  while (len > 0) {
+    ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+    if ((ret < 0) && (errno == EINTR))
+      continue;
+    if (ret <= 0)
+      return false;
+    buf += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+bool SendOptReply(int fd, uint32_t opt, uint32_t type,
+                  const string &data = "") {
+  string reply;
+  Append64(&reply, kNbdRepMagic);
+  Append32(&reply, opt);
+  Append32(&reply, type);
+  Append32(&reply, data.size());
+  reply += data;
+  return WriteFull(fd, reply);
+}
+
+void SetTimeouts(int fd, unsigned ms) {
+  struct timeval tv;
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+}  // anonymous namespace
+
+NbdNetServer::NbdNetServer(const NbdNetParams &params) : params_(params) {
+  sleepers_ = 0;
+  poll_count_ = 0;
+  stop_ = false;
+  conns_ = make_shared<vector<shared_ptr<Conn>>>();
+}
+
+NbdNetServer::~NbdNetServer() {
+  stop_ = true;
+  if (accept_thread_) {
+    // Wakes up the accept thread.
+    shutdown(listen_fd_, SHUT_RDWR);
+    accept_thread_->join();
+  }
+  // Handshakes still going on fail right away.
+  unique_lock<mutex> l(lock_);
+  for (int fd : handshake_fds_)
+    shutdown(fd, SHUT_RDWR);
+  while (handshakes_ > 0) {
+    l.unlock();
+    usleep(1000);
+    l.lock();
+  }
+  // Nobody is supposed to be polling anymore.
+  conns_.reset();
+  l.unlock();
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    if (port_ == 0)
+      unlink(params_.address.c_str());
+  }
+  if (wakeup_fd_ >= 0)
+    close(wakeup_fd_);
+}
+
+// static
+int NbdNetServer::New(const NbdNetParams &params,
+                      unique_ptr<NbdNetServer> *ret_server) {
+  unique_ptr<NbdNetServer> server(new NbdNetServer(params));
+  server->wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (server->wakeup_fd_ < 0) {
+    return errno;
+  }
+  int st = server->Listen();
+  if (st != 0) {
+    return st;
+  }
+  server->accept_thread_.reset(
+      new thread(&NbdNetServer::AcceptThread, server.get()));
+  *ret_server = move(server);
+  return 0;
+}
+
+int NbdNetServer::Listen() {
+  if (params_.address.find('/') != string::npos) {
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (params_.address.size() >= sizeof(addr.sun_path)) {
+      return ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, params_.address.c_str());
+    // A socket left behind by an earlier run.
+    struct stat sb;
+    if ((stat(addr.sun_path, &sb) == 0) && S_ISSOCK(sb.st_mode))
+      unlink(addr.sun_path);
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+      return errno;
+    }
+    if ((bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(listen_fd_, SOMAXCONN) < 0)) {
+      int st = errno;
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return st;
+    }
+    return 0;
+  }
+  // Without an address, IPv6 with v4 mapped addresses takes both, if
+  // the host has IPv6.
+  int st = ListenTcp(params_.address.empty() ? AF_INET6 : AF_UNSPEC);
+  if ((st != 0) && params_.address.empty())
+    st = ListenTcp(AF_INET);
+  if (st != 0) {
+    return st;
+  }
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  getsockname(listen_fd_, (struct sockaddr *)&addr, &len);
+  port_ = (addr.ss_family == AF_INET6) ?
+          ntohs(((struct sockaddr_in6 *)&addr)->sin6_port) :
+          ntohs(((struct sockaddr_in *)&addr)->sin_port);
+  return 0;
+}
+
+int NbdNetServer::ListenTcp(int family) {
+  struct addrinfo hints;
+  bzero(&hints, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo *res = nullptr;
+  string port = to_string(params_.port);
+  const char *host = params_.address.empty() ? nullptr :
+                     params_.address.c_str();
+  if (getaddrinfo(host, port.c_str(), &hints, &res) != 0) {
+    return EADDRNOTAVAIL;
+  }
+  int st = EADDRNOTAVAIL;
+  for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+    if (fd < 0) {
+      st = errno;
+      continue;
+    }
+    int one = 1;
+    int zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (ai->ai_family == AF_INET6)
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    if ((bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) ||
+        (listen(fd, SOMAXCONN) < 0)) {
+      st = errno;
+      close(fd);
+      continue;
+    }
+    listen_fd_ = fd;
+    st = 0;
+    break;
+  }
+  freeaddrinfo(res);
+  return st;
+}
+
+int NbdNetServer::AddExport(const string &name, const NbdParams &params,
+                            const string &description) {
+  // Same limits as a loopback device.
+  uint32_t bsize = params.block_size;
+  if (((bsize & (bsize - 1)) != 0) || (bsize < 512) || (bsize > 65536)) {
+    return EINVAL;
+  }
+  if ((params.transport != NBD_TRANSPORT_NBD) ||
+      (params.num_connections == 0) || (params.num_blocks == 0) ||
+      (params.max_io_size < 4096) || (params.max_io_size % bsize != 0) ||
+      (name.size() > 4096)) {
+    return EINVAL;
+  }
+  unique_ptr<Export> exp(new Export());
+  exp->name = name;
+  exp->description = description;
+  exp->params = params;
+  // Shared by the clients of the export, like the connections of a
+  // loopback device.
+  if (!exp->params.prefetcher && (params.prefetch_size > 0)) {
+    int st = NbdPrefetcher::New(params, &exp->params.prefetcher);
+    if (st != 0) {
+      return st;
+    }
+  }
+  unique_lock<mutex> l(lock_);
+  if (exports_.find(name) != exports_.end()) {
+    return EEXIST;
+  }
+  exports_[name] = move(exp);
+  return 0;
+}
+
+void NbdNetServer::AcceptThread() {
+  while (!stop_) {
+    struct pollfd pfd;
+    pfd.fd = listen_fd_;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 1000) <= 0)
+      continue;
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0)
+      continue;
+    unique_lock<mutex> l(lock_);
+    if (stop_) {
+      close(fd);
+      break;
+    }
+    handshake_fds_.insert(fd);
+    handshakes_++;
+    l.unlock();
+    // One thread per handshake, so that a slow client holds up no one.
+    thread(&NbdNetServer::Handshake, this, fd).detach();
+  }
+}
+
+void NbdNetServer::Handshake(int fd) {
+  SetTimeouts(fd, params_.handshake_timeout_ms);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  bool structured = false;
+  Export *exp = Negotiate(fd, &structured);
+  unique_lock<mutex> l(lock_);
+  handshake_fds_.erase(fd);
+  if ((exp == nullptr) || stop_) {
+    if (exp)
+      exp->conns--;
+    handshakes_--;
+    close(fd);
+    return;
+  }
+  l.unlock();
+  SetTimeouts(fd, 0);
+  NbdParams params = exp->params;
+  params.structured_replies = structured;
+  shared_ptr<Conn> conn(new Conn());
+  conn->exp = exp;
+  conn->busy = false;
+  // The server owns fd from here on, even if New() fails.
+  int st = NbdServer::New(fd, params, &conn->server);
+  l.lock();
+  if (st != 0) {
+    exp->conns--;
+  } else {
+    conn->server->SetWakeup(wakeup_fd_, &sleepers_);
+    shared_ptr<vector<shared_ptr<Conn>>> new_conns(
+        new vector<shared_ptr<Conn>>(*conns_));
+    new_conns->push_back(move(conn));
+    conns_ = move(new_conns);
+  }
+  // Nothing may touch this once handshakes_ drops to 0, the destructor
+  // closes wakeup_fd_ right after.
+  eventfd_write(wakeup_fd_, 1);
+  handshakes_--;
+}
+
+NbdNetServer::Export *NbdNetServer::Negotiate(int fd, bool *structured) {
+  string hello;
+  Append64(&hello, kNbdMagic);
+  Append64(&hello, kNbdOptMagic);
+  Append16(&hello, kFlagFixedNewstyle | kFlagNoZeroes);
+  if (!WriteFull(fd, hello)) {
+    return nullptr;
+  }
+  char buf[16];
+  if (!ReadFull(fd, buf, 4)) {
+    return nullptr;
+  }
+  uint32_t client_flags = Get32(buf);
+  if (client_flags & ~(uint32_t)(kFlagFixedNewstyle | kFlagNoZeroes)) {
+    return nullptr;
+  }
+  while (1) {
+    if (!ReadFull(fd, buf, 16)) {
+      return nullptr;
+    }
+    uint32_t opt = Get32(buf + 8);
+    uint32_t len = Get32(buf + 12);
+    if ((Get64(buf) != kNbdOptMagic) || (len > kMaxOptLen)) {
+      return nullptr;
+    }
+    string data(len, '\0');
+    if ((len > 0) && !ReadFull(fd, &data[0], len)) {
+      return nullptr;
+    }
+    bool ok = true;
+    switch (opt) {
+      case kOptExportName: {
+        // No way to tell the client what went wrong, just hang up.
+        uint32_t err;
+        Export *exp = Reserve(data, &err);
+        if (exp == nullptr) {
+          return nullptr;
+        }
+        string reply;
+        Append64(&reply, exp->params.num_blocks * exp->params.block_size);
+        Append16(&reply, ExportFlags(exp));
+        if (!(client_flags & kFlagNoZeroes))
+          reply.append(kExportNamePad, '\0');
+        if (!WriteFull(fd, reply)) {
+          unique_lock<mutex> l(lock_);
+          exp->conns--;
+          return nullptr;
+        }
+        return exp;
+      }
+      case kOptAbort:
+        SendOptReply(fd, opt, kRepAck);
+        return nullptr;
+      case kOptList: {
+        if (len > 0) {
+          ok = SendOptReply(fd, opt, kRepErrInvalid);
+          break;
+        }
+        vector<string> names;
+        unique_lock<mutex> l(lock_);
+        for (auto &it : exports_)
+          names.push_back(it.first);
+        l.unlock();
+        for (auto &name : names) {
+          string rep;
+          Append32(&rep, name.size());
+          rep += name;
+          if (!(ok = SendOptReply(fd, opt, kRepServer, rep)))
+            break;
+        }
+        ok = ok && SendOptReply(fd, opt, kRepAck);
+        break;
+      }
+      case kOptInfo:
+      case kOptGo: {
+        Export *exp = ReplyInfo(fd, opt, data, &ok);
+        if (exp) {
+          return exp;
+        }
+        break;
+      }
+      case kOptStructuredReply:
+        if (len > 0) {
+          ok = SendOptReply(fd, opt, kRepErrInvalid);
+        } else {
+          *structured = true;
+          ok = SendOptReply(fd, opt, kRepAck);
+        }
+        break;
+      default:
+        // STARTTLS, block status and the like.
+        ok = SendOptReply(fd, opt, kRepErrUnsup);
+    }  // switch (opt)
+    if (!ok) {
+      return nullptr;
+    }
+  }
+}
+
+NbdNetServer::Export *NbdNetServer::Reserve(const string &name,
+                                            uint32_t *err) {
+  unique_lock<mutex> l(lock_);
+  auto it = exports_.find(name);
+  if (it == exports_.end()) {
+    *err = kRepErrUnknown;
+    return nullptr;
+  }
+  Export *exp = it->second.get();
+  if (exp->conns >= exp->params.num_connections) {
+    *err = kRepErrPolicy;
+    return nullptr;
+  }
+  exp->conns++;
+  return exp;
+}
+
+NbdNetServer::Export *NbdNetServer::ReplyInfo(int fd, uint32_t opt,
+                                              const string &data,
+                                              bool *ok) {
+  // Name length, name, number of info requests, the requests.
+  const char *p = data.data();
+  uint32_t name_len = (data.size() >= 6) ? Get32(p) : 0;
+  if ((data.size() < 6) || (name_len > data.size() - 6) ||
+      (data.size() != 6 + name_len + 2 * Get16(p + 4 + name_len))) {
+    *ok = SendOptReply(fd, opt, kRepErrInvalid);
+    return nullptr;
+  }
+  string name(p + 4, name_len);
+  bool want_name = false;
+  bool want_description = false;
+  for (const char *req = p + 6 + name_len; req < p + data.size(); req += 2) {
+    uint16_t type = Get16(req);
+    want_name |= (type == kInfoName);
+    want_description |= (type == kInfoDescription);
+  }
+  Export *exp;
+  uint32_t err = 0;
+  if (opt == kOptGo) {
+    exp = Reserve(name, &err);
+  } else {
+    unique_lock<mutex> l(lock_);
+    auto it = exports_.find(name);
+    exp = (it != exports_.end()) ? it->second.get() : nullptr;
+    err = kRepErrUnknown;
+  }
+  if (exp == nullptr) {
+    string msg = (err == kRepErrPolicy) ? "Too many connections" :
+                                          "No such export";
+    *ok = SendOptReply(fd, opt, err, msg);
+    return nullptr;
+  }
+  // Exports are never removed and their params never change.
+  const NbdParams &params = exp->params;
+  string rep;
+  Append16(&rep, kInfoExport);
+  Append64(&rep, params.num_blocks * params.block_size);
+  Append16(&rep, ExportFlags(exp));
+  *ok = SendOptReply(fd, opt, kRepInfo, rep);
+  if (*ok && want_name) {
+    rep.clear();
+    Append16(&rep, kInfoName);
+    rep += exp->name;
+    *ok = SendOptReply(fd, opt, kRepInfo, rep);
+  }
+  if (*ok && want_description && !exp->description.empty()) {
+    rep.clear();
+    Append16(&rep, kInfoDescription);
+    rep += exp->description;
+    *ok = SendOptReply(fd, opt, kRepInfo, rep);
+  }
+  if (*ok) {
+    // Always sent, clients may not go below the block size.
+    rep.clear();
+    Append16(&rep, kInfoBlockSize);
+    Append32(&rep, params.block_size);
+    Append32(&rep, max<uint32_t>(params.block_size, 4096));
+    Append32(&rep, params.max_io_size);
+    *ok = SendOptReply(fd, opt, kRepInfo, rep);
+  }
+  *ok = *ok && SendOptReply(fd, opt, kRepAck);
+  if (opt != kOptGo) {
+    return nullptr;
+  }
+  if (!*ok) {
+    unique_lock<mutex> l(lock_);
+    exp->conns--;
+    return nullptr;
+  }
+  return exp;
+}
+
+uint16_t NbdNetServer::ExportFlags(const Export *exp) {
+  uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+                   NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM;
+  if (exp->params.write_zeroes)
+    flags |= NBD_FLAG_SEND_WRITE_ZEROES;
+  if (exp->params.num_connections > 1)
+    flags |= NBD_FLAG_CAN_MULTI_CONN;
+  return flags;
+}
+
+shared_ptr<vector<shared_ptr<NbdNetServer::Conn>>> NbdNetServer::Conns() {
+  unique_lock<mutex> l(lock_);
+  return conns_;
+}
+
+void NbdNetServer::RemoveConn(Conn *conn) {
+  unique_lock<mutex> l(lock_);
+  if (conn->removed)
+    return;
+  conn->removed = true;
+  conn->exp->conns--;
+  shared_ptr<vector<shared_ptr<Conn>>> new_conns(
+      new vector<shared_ptr<Conn>>());
+  for (auto &c : *conns_) {
+    if (c.get() != conn)
+      new_conns->push_back(c);
+  }
+  // The last poller holding the old list destroys conn.
+  conns_ = move(new_conns);
+}
+
+unsigned NbdNetServer::num_connections() {
+  return Conns()->size();
+}
+
+bool NbdNetServer::Poll() {
+  bool config_poll = ((++poll_count_ % kConfigPollInterval) == 0);
+  bool any_work = false;
+  shared_ptr<vector<shared_ptr<Conn>>> cur_conns = Conns();
+  for (auto &conn : *cur_conns) {
+    bool flg = false;
+    if (!conn->busy.compare_exchange_strong(flg, true))
+      continue;
+    bool did_work = false;
+    bool ok = conn->server->DataPoll(&did_work);
+    if (ok && config_poll)
+      ok = conn->server->ConfigPoll();
+    // The client is gone, drop the connection once the backend is done
+    // with it.
+    if (!ok && conn->server->IsDeleteReady())
+      RemoveConn(conn.get());
+    any_work |= did_work;
+    conn->busy = false;
+  }
+  return any_work;
+}
+
+bool NbdNetServer::Wait(int timeout_ms) {
+  if (Poll())
+    return true;
+  // Has to be visible before the servers are checked, see
+  // NbdServer::CompletionCb().
+  sleepers_++;
+  vector<struct pollfd> pfds;
+  pfds.push_back({wakeup_fd_, POLLIN, 0});
+  bool sleep = true;
+  shared_ptr<vector<shared_ptr<Conn>>> cur_conns = Conns();
+  for (auto &conn : *cur_conns) {
+    int fd;
+    uint32_t events;
+    if (!conn->server->PrepareWait(&fd, &events)) {
+      sleep = false;
+      break;
+    }
+    // A connection which has shut down waits for its backend cmds,
+    // which wake us up as they complete. EPOLLIN and EPOLLOUT are the
+    // same bits as for poll().
+    if (events != 0)
+      pfds.push_back({fd, (short)events, 0});
+  }
+  if (sleep && (poll(pfds.data(), pfds.size(), timeout_ms) > 0) &&
+      (pfds[0].revents != 0)) {
+    eventfd_t val;
+    eventfd_read(wakeup_fd_, &val);
+  }
+  sleepers_--;
+  return Poll();
+}
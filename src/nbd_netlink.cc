@@ -0,0 +1,217 @@
+#include "nbd_netlink.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/nbd-netlink.h>
+
+namespace {
+
+constexpr uint32_t kNlBufSize = 8192;
+
+// Builder for a single generic netlink request. Attributes are appended
+// in place, nests are closed by patching the length of the opening
+// attribute.
+class NlMsg {
+ public:
+  NlMsg(uint16_t type, uint8_t cmd, uint8_t version) {
+    bzero(buf_, sizeof(buf_));
+    nlh()->nlmsg_type = type;
+    nlh()->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    len_ = NLMSG_LENGTH(GENL_HDRLEN);
+    struct genlmsghdr *genl = (struct genlmsghdr *)NLMSG_DATA(nlh());
+    genl->cmd = cmd;
+    genl->version = version;
+  }
+
+  struct nlmsghdr *nlh() { return (struct nlmsghdr *)buf_; }
+  void *data() { return buf_; }
+  uint32_t len() { return len_; }
+  bool failed() { return failed_; }
+
+  struct nlattr *Put(uint16_t type, const void *data, uint16_t data_len) {
+    uint32_t alen = NLA_HDRLEN + data_len;
+    if (NLMSG_ALIGN(len_) + NLA_ALIGN(alen) > sizeof(buf_)) {
+      failed_ = true;
+      return nullptr;
+    }
+    struct nlattr *nla = (struct nlattr *)(buf_ + NLMSG_ALIGN(len_));
+    nla->nla_type = type;
+    nla->nla_len = alen;
+    if (data_len)
+      memcpy((char *)nla + NLA_HDRLEN, data, data_len);
+    len_ = NLMSG_ALIGN(len_) + NLA_ALIGN(alen);
+    nlh()->nlmsg_len = len_;
+    return nla;
+  }
+  void PutU32(uint16_t type, uint32_t v) { Put(type, &v, sizeof(v)); }
+  void PutU64(uint16_t type, uint64_t v) { Put(type, &v, sizeof(v)); }
+
+  struct nlattr *StartNest(uint16_t type) {
+    return Put(type | NLA_F_NESTED, nullptr, 0);
+  }
+  void EndNest(struct nlattr *nest) {
+    if (nest)
+      nest->nla_len = (buf_ + len_) - (char *)nest;
+  }
+
+ private:
+  char buf_[kNlBufSize];
+  uint32_t len_;
+  bool failed_ = false;
+};
+
+// Calls fn(attr) for every top level attribute of a generic netlink
+// message.
+template <class F>
+void ForEachAttr(struct nlmsghdr *nlh, F fn) {
+  char *pos = (char *)NLMSG_DATA(nlh) + GENL_HDRLEN;
+  char *end = (char *)nlh + nlh->nlmsg_len;
+  while (pos + NLA_HDRLEN <= end) {
+    struct nlattr *nla = (struct nlattr *)pos;
+    if ((nla->nla_len < NLA_HDRLEN) || (pos + nla->nla_len > end))
+      break;
+    fn(nla);
+    pos += NLA_ALIGN(nla->nla_len);
+  }
+}
+
+void *AttrData(struct nlattr *nla) {
+  return (char *)nla + NLA_HDRLEN;
+}
+
+}  // anonymous namespace
+
+NbdNetlink::~NbdNetlink() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+// static
+int NbdNetlink::New(unique_ptr<NbdNetlink> *ret_nl) {
+  unique_ptr<NbdNetlink> nl(new NbdNetlink());
+
+  nl->fd_ = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+  if (nl->fd_ < 0) {
+    return errno;
+  }
+  struct sockaddr_nl addr;
+  bzero(&addr, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (bind(nl->fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    return errno;
+  }
+
+  // Resolve the nbd family id.
+  NlMsg msg(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1);
+  msg.Put(CTRL_ATTR_FAMILY_NAME, NBD_GENL_FAMILY_NAME,
+          strlen(NBD_GENL_FAMILY_NAME) + 1);
+  msg.nlh()->nlmsg_seq = ++nl->seq_;
+  if (send(nl->fd_, msg.data(), msg.len(), 0) < 0) {
+    return errno;
+  }
+  char buf[kNlBufSize];
+  while (nl->family_id_ == 0) {
+    ssize_t ret = recv(nl->fd_, buf, sizeof(buf), 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    int len = ret;
+    for (struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_seq != nl->seq_)
+        continue;
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nlh);
+        // An ack without a preceding family reply is also a failure.
+        return (err->error < 0) ? -err->error : ENOENT;
+      }
+      if (nlh->nlmsg_type != GENL_ID_CTRL)
+        continue;
+      ForEachAttr(nlh, [&nl](struct nlattr *nla) {
+          if ((nla->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+            nl->family_id_ = *(uint16_t *)AttrData(nla);
+        });
+    }
+  }
+  // The trailing ack of this request is skipped by Transact() since its
+  // sequence number does not match.
+  *ret_nl = move(nl);
+  return 0;
+}
+
+int NbdNetlink::Transact(void *data, uint32_t len, int *index) {
+  struct nlmsghdr *req = (struct nlmsghdr *)data;
+  req->nlmsg_seq = ++seq_;
+  if (send(fd_, data, len, 0) < 0) {
+    return errno;
+  }
+  char buf[kNlBufSize];
+  while (1) {
+    ssize_t ret = recv(fd_, buf, sizeof(buf), 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    int rlen = ret;
+    for (struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, rlen);
+         nlh = NLMSG_NEXT(nlh, rlen)) {
+      if (nlh->nlmsg_seq != seq_)
+        continue;
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        // The ack terminates every request.
+        struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nlh);
+        return -err->error;
+      }
+      if ((nlh->nlmsg_type != family_id_) || (index == nullptr))
+        continue;
+      ForEachAttr(nlh, [index](struct nlattr *nla) {
+          if ((nla->nla_type & NLA_TYPE_MASK) == NBD_ATTR_INDEX)
+            *index = *(uint32_t *)AttrData(nla);
+        });
+    }
+  }
+}
+
+int NbdNetlink::Connect(int *index, uint64_t size_bytes, uint64_t block_size,
+                        uint64_t server_flags, uint64_t dead_conn_timeout,
+                        const vector<int> &socks) {
+  unique_ptr<NlMsg> msg(new NlMsg(family_id_, NBD_CMD_CONNECT,
+                                  NBD_GENL_VERSION));
+  // Without NBD_ATTR_INDEX the kernel picks the device.
+  if (*index >= 0)
+    msg->PutU32(NBD_ATTR_INDEX, *index);
+  msg->PutU64(NBD_ATTR_SIZE_BYTES, size_bytes);
+  msg->PutU64(NBD_ATTR_BLOCK_SIZE_BYTES, block_size);
+  msg->PutU64(NBD_ATTR_SERVER_FLAGS, server_flags);
+  if (dead_conn_timeout)
+    msg->PutU64(NBD_ATTR_DEAD_CONN_TIMEOUT, dead_conn_timeout);
+  struct nlattr *sock_list = msg->StartNest(NBD_ATTR_SOCKETS);
+  for (int sock : socks) {
+    struct nlattr *item = msg->StartNest(NBD_SOCK_ITEM);
+    msg->PutU32(NBD_SOCK_FD, sock);
+    msg->EndNest(item);
+  }
+  msg->EndNest(sock_list);
+  if (msg->failed()) {
+    return E2BIG;
+  }
+  unique_lock<mutex> l(lock_);
+  return Transact(msg->data(), msg->len(), index);
+}
+
+int NbdNetlink::Disconnect(int index) {
+  unique_ptr<NlMsg> msg(new NlMsg(family_id_, NBD_CMD_DISCONNECT,
+                                  NBD_GENL_VERSION));
+  msg->PutU32(NBD_ATTR_INDEX, index);
+  unique_lock<mutex> l(lock_);
+  return Transact(msg->data(), msg->len(), nullptr);
+}
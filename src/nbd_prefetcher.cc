@@ -0,0 +1,339 @@
+#include "nbd_prefetcher.h"
+
+#include <errno.h>
+#include <string.h>
+
+// Streams followed at once, the least recently used one is replaced.
+static constexpr unsigned kMaxStreams = 16;
+// Reads in a row which have to match a stream before it is prefetched.
+static constexpr uint32_t kMinHits = 2;
+// Smallest window a stream starts with.
+static constexpr uint32_t kMinWindow = 64 * 1024;
+// Max reads prefetched ahead of a strided stream.
+static constexpr uint32_t kMaxStrideAhead = 16;
+// Reads of the device after which a stream which got none counts as
+// gone.
+static constexpr uint64_t kStaleTicks = 1024;
+
+NbdPrefetcher::NbdPrefetcher(const NbdParams &params) :
+    lru_(offsetof(NbdPrefetch, lru_link)) {
+  size_ = params.prefetch_size;
+  max_window_ = min(params.prefetch_max_window, params.prefetch_size);
+  max_io_size_ = params.max_io_size;
+  dev_size_ = params.num_blocks * params.block_size;
+  alloc_data_mem_ = params.alloc_data_mem;
+  free_data_mem_ = params.free_data_mem;
+  num_prefetches_ = 0;
+  streams_.resize(kMaxStreams);
+}
+
+NbdPrefetcher::~NbdPrefetcher() {
+  // Servers wait for their prefetches, none is in flight anymore.
+  for (auto &it : prefetches_)
+    Free(it.second);
+}
+
+// static
+int NbdPrefetcher::New(const NbdParams &params,
+                       shared_ptr<NbdPrefetcher> *ret_prefetcher) {
+  if ((params.prefetch_size == 0) || (params.prefetch_max_window == 0) ||
+      (params.block_size == 0) || (params.max_io_size == 0)) {
+    return EINVAL;
+  }
+  ret_prefetcher->reset(new NbdPrefetcher(params));
+  return 0;
+}
+
+int NbdPrefetcher::Read(NbdCmd *cmd, vector<NbdPrefetch *> *issue) {
+  unique_lock<mutex> l(lock_);
+  int st = Lookup(cmd);
+  Detect(cmd->io_offset, cmd->io_size, issue);
+  return st;
+}
+
+int NbdPrefetcher::Lookup(NbdCmd *cmd) {
+  uint64_t off = cmd->io_offset;
+  uint64_t end = off + cmd->io_size;
+  auto it = prefetches_.upper_bound(off);
+  if (it == prefetches_.begin())
+    return NBD_PREFETCH_MISS;
+  it--;
+  NbdPrefetch *first = it->second;
+  uint64_t pos = first->offset + first->len;
+  if (pos <= off)
+    return NBD_PREFETCH_MISS;
+  if (!first->ready) {
+    if (pos < end)
+      return NBD_PREFETCH_MISS;
+    first->waiters.push_back(cmd);
+    stats_.hits++;
+    stats_.hit_bytes += cmd->io_size;
+    stats_.waits++;
+    return NBD_PREFETCH_WAIT;
+  }
+  // Served from a row of ready prefetches, or not at all.
+  auto next = it;
+  for (next++; pos < end; next++) {
+    if ((next == prefetches_.end()) || (next->first != pos) ||
+        !next->second->ready)
+      return NBD_PREFETCH_MISS;
+    pos += next->second->len;
+  }
+  for (pos = off; pos < end;) {
+    NbdPrefetch *pf = (it++)->second;
+    uint32_t n = min(end, pf->offset + pf->len) - pos;
+    CopyOut(pf, pos - pf->offset, cmd, pos - off, n);
+    Used(pf, n);
+    pos += n;
+  }
+  stats_.hits++;
+  stats_.hit_bytes += cmd->io_size;
+  return NBD_PREFETCH_HIT;
+}
+
+void NbdPrefetcher::Detect(uint64_t offset, uint32_t len,
+                           vector<NbdPrefetch *> *issue) {
+  tick_++;
+  Stream *s = nullptr;
+  for (auto &t : streams_) {
+    if (t.tick == 0)
+      continue;
+    if (offset == t.end) {
+      if (t.stride != 0) {
+        // Became sequential.
+        t.stride = 0;
+        t.hits = 0;
+        t.ahead = 0;
+      }
+      s = &t;
+      break;
+    }
+    if ((t.stride != 0) && (offset == t.last + t.stride) && (len == t.len)) {
+      s = &t;
+      break;
+    }
+  }
+  if (s == nullptr) {
+    // A second read of the same size a little after a new stream makes
+    // it a strided one.
+    for (auto &t : streams_) {
+      if ((t.tick != 0) && (t.hits == 0) && (t.stride == 0) &&
+          (len == t.len) && (offset > t.end) &&
+          (offset - t.last <= max_window_)) {
+        s = &t;
+        s->stride = offset - t.last;
+        break;
+      }
+    }
+  }
+  if (s == nullptr) {
+    s = &streams_[0];
+    for (auto &t : streams_) {
+      if (t.tick < s->tick)
+        s = &t;
+    }
+    uint32_t gen = s->gen + 1;
+    *s = Stream();
+    s->gen = gen;
+    s->window = min(max_window_, max(kMinWindow, 4 * len));
+  } else {
+    s->hits++;
+  }
+  s->last = offset;
+  s->end = offset + len;
+  s->len = len;
+  s->tick = tick_;
+  if (s->hits < kMinHits)
+    return;
+
+  if (s->stride == 0) {
+    uint64_t pos = offset + len;
+    s->ahead = max(s->ahead, pos);
+    if (s->ahead - pos >= s->window / 2)
+      return;  // Still far enough ahead.
+    // In multiples of the read size, so that reads of the same size do
+    // not straddle two prefetches.
+    uint64_t to = min(dev_size_,
+                      pos + (uint64_t)max(s->window / len, 1U) * len);
+    uint32_t piece = max(len, min(max_io_size_, s->window) / len * len);
+    while (s->ahead < to) {
+      uint32_t n = min<uint64_t>(piece, to - s->ahead);
+      if (!Issue(s, s->ahead, n, issue))
+        break;
+      s->ahead += n;
+    }
+    return;
+  }
+  uint64_t next = offset + s->stride;
+  s->ahead = max(s->ahead, next);
+  uint32_t want = min(max(s->window / len, 1U), kMaxStrideAhead);
+  if ((s->ahead - next) / s->stride >= (want + 1) / 2)
+    return;
+  uint64_t to = next + s->stride * want;
+  while ((s->ahead < to) && (s->ahead + len <= dev_size_)) {
+    if (!Issue(s, s->ahead, len, issue))
+      break;
+    s->ahead += s->stride;
+  }
+}
+
+bool NbdPrefetcher::Issue(Stream *s, uint64_t offset, uint32_t len,
+                          vector<NbdPrefetch *> *issue) {
+  // Another stream may have got there first.
+  auto it = prefetches_.lower_bound(offset);
+  if ((it != prefetches_.end()) && (it->first < offset + len))
+    return true;
+  if ((it != prefetches_.begin()) &&
+      (prev(it)->first + prev(it)->second->len > offset))
+    return true;
+  if (!MakeRoom(len))
+    return false;
+  void *data = alloc_data_mem_(len);
+  if (data == nullptr)
+    return false;
+  NbdPrefetch *pf = new NbdPrefetch();
+  pf->offset = offset;
+  pf->len = len;
+  pf->data = data;
+  pf->stream = s - &streams_[0];
+  pf->stream_gen = s->gen;
+  prefetches_.emplace(offset, pf);
+  num_prefetches_++;
+  bytes_ += len;
+  stats_.prefetches++;
+  stats_.prefetched_bytes += len;
+  issue->push_back(pf);
+  return true;
+}
+
+bool NbdPrefetcher::MakeRoom(uint32_t len) {
+  NbdPrefetch *pf = lru_.First();
+  while ((bytes_ + len > size_) && (pf != nullptr)) {
+    NbdPrefetch *next = lru_.Next(pf);
+    if (Evictable(pf))
+      Drop(pf);
+    pf = next;
+  }
+  return (bytes_ + len <= size_);
+}
+
+bool NbdPrefetcher::Evictable(NbdPrefetch *pf) {
+  // What a live stream has yet to get to stays, dropping it would only
+  // make the stream read it again.
+  Stream *s = StreamOf(pf);
+  return (s == nullptr) || (tick_ - s->tick > kStaleTicks) ||
+         (pf->offset + pf->len <= s->end);
+}
+
+void NbdPrefetcher::Drop(NbdPrefetch *pf) {
+  prefetches_.erase(pf->offset);
+  num_prefetches_--;
+  lru_.Remove(pf);
+  if (pf->used < pf->len) {
+    stats_.wasted_bytes += pf->len - pf->used;
+    Stream *s = StreamOf(pf);
+    if (s != nullptr)
+      s->window = max(s->window / 2, s->len);
+  }
+  if (pf->ready) {
+    Free(pf);
+  } else {
+    pf->dropped = true;
+  }
+}
+
+void NbdPrefetcher::Free(NbdPrefetch *pf) {
+  free_data_mem_(pf->data);
+  bytes_ -= pf->len;
+  delete pf;
+}
+
+void NbdPrefetcher::Used(NbdPrefetch *pf, uint32_t len) {
+  pf->used = min(pf->len, pf->used + len);
+  if (pf->used < pf->len) {
+    // Most recently used.
+    if (lru_.Remove(pf))
+      lru_.PushBack(pf);
+    return;
+  }
+  // Every byte was read, the stream can use a bigger window.
+  Stream *s = StreamOf(pf);
+  if (s != nullptr)
+    s->window = min<uint64_t>((uint64_t)s->window * 2, max_window_);
+  Drop(pf);
+}
+
+void NbdPrefetcher::Done(NbdPrefetch *pf, unsigned error,
+                         vector<NbdCmd *> *waiters) {
+  unique_lock<mutex> l(lock_);
+  waiters->swap(pf->waiters);
+  if (error == 0) {
+    for (NbdCmd *cmd : *waiters)
+      CopyOut(pf, cmd->io_offset - pf->offset, cmd, 0, cmd->io_size);
+  }
+  pf->ready = true;
+  if (pf->dropped) {
+    Free(pf);
+    return;
+  }
+  if (error != 0) {
+    // Nothing to serve, and not worth shrinking the window over.
+    pf->used = pf->len;
+    Drop(pf);
+    return;
+  }
+  lru_.PushBack(pf);
+  for (NbdCmd *cmd : *waiters) {
+    bool last = (pf->used + cmd->io_size >= pf->len);
+    Used(pf, cmd->io_size);
+    if (last)
+      break;  // Freed.
+  }
+}
+
+void NbdPrefetcher::Invalidate(uint64_t offset, uint64_t len) {
+  // A prefetch issued after this check reads what was written.
+  if ((len == 0) || (num_prefetches_ == 0))
+    return;
+  unique_lock<mutex> l(lock_);
+  auto it = prefetches_.lower_bound(offset);
+  if ((it != prefetches_.begin()) &&
+      (prev(it)->first + prev(it)->second->len > offset))
+    it--;
+  while ((it != prefetches_.end()) && (it->first < offset + len)) {
+    NbdPrefetch *pf = (it++)->second;
+    stats_.invalidations++;
+    Drop(pf);
+  }
+}
+
+void NbdPrefetcher::CopyOut(NbdPrefetch *pf, uint32_t off, NbdCmd *cmd,
+                            uint32_t cmd_off, uint32_t len) {
+  const char *src = (const char *)pf->data + off;
+  if (cmd->data_iovcnt == 0) {
+    memcpy((char *)cmd->data_buf + cmd_off, src, len);
+    return;
+  }
+  for (uint32_t i = 0; (i < cmd->data_iovcnt) && (len > 0); i++) {
+    struct iovec &iov = cmd->data_iov[i];
+    if (cmd_off >= iov.iov_len) {
+      cmd_off -= iov.iov_len;
+      continue;
+    }
+    uint32_t n = min<uint64_t>(len, iov.iov_len - cmd_off);
+    memcpy((char *)iov.iov_base + cmd_off, src, n);
+    src += n;
+    len -= n;
+    cmd_off = 0;
+  }
+}
+
+NbdPrefetcher::Stream *NbdPrefetcher::StreamOf(NbdPrefetch *pf) {
+  Stream *s = &streams_[pf->stream];
+  return (s->gen == pf->stream_gen) ? s : nullptr;
+}
+
+void NbdPrefetcher::GetStats(NbdPrefetchStats *stats) {
+  unique_lock<mutex> l(lock_);
+  *stats = stats_;
+}
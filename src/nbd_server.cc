@@ -1,20 +1,62 @@
 #include "nbd_server.h"
+#include "nbd_uring.h"
+#include "nbd_prefetcher.h"
+#include "nbd_capture.h"
+#include "nbd_trace.h"
+#include "ublk_server.h"
+#include "zero_detect.h"
 #include <fcntl.h>
 #include <stddef.h>
 #include <endian.h>
 #include <unistd.h>
 #include <strings.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <thread>
 #include <chrono>
 
 namespace {
 
-static constexpr uint32_t kMaxNbdIOSize = 1024 * 1024;
+// Upper bound on NbdParams::merge_window.
+static constexpr uint32_t kMaxMergeWindow = 64;
+// Set in NbdCmd::stream_left of a streamed read whose first chunk failed.
+static constexpr uint32_t kStreamFailed = 1U << 31;
+// Capture records a server buffers before writing them out, 32KB.
+static constexpr unsigned kCaptureBatch = 1024;
+// Payload of a rejected write is read into this much scratch at a time.
+static constexpr uint32_t kDiscardBufSize = 64 * 1024;
 static uint32_t kNbdReqMagic = be32toh(NBD_REQUEST_MAGIC);
 static uint32_t kNbdReplyMagic = be32toh(NBD_REPLY_MAGIC);
 
+// Structured replies.
+static constexpr uint32_t kNbdStructuredReplyMagic = 0x668e33ef;
+static constexpr uint16_t kNbdReplyFlagDone = 1 << 0;
+static constexpr uint16_t kNbdReplyTypeNone = 0;
+static constexpr uint16_t kNbdReplyTypeOffsetData = 1;
+static constexpr uint16_t kNbdReplyTypeOffsetHole = 2;
+static constexpr uint16_t kNbdReplyTypeError = (1 << 15) + 1;
+
+// io_uring engine defaults.
+static constexpr unsigned kUringEntries = 256;
+static constexpr unsigned kUringRecvBufs = 16;  // Power of 2.
+static constexpr uint32_t kUringRecvBufSize = 64 * 1024;
+static constexpr uint32_t kUringSendBatch = 32;
+// Low bits of the SQE user_data say what the pointer in it is.
+static constexpr uint64_t kUringTagMask = 7;
+static constexpr uint64_t kUringTagRecv = 1;       // NbdServer
+static constexpr uint64_t kUringTagSendReply = 2;  // NbdCmd
+static constexpr uint64_t kUringTagSendData = 3;   // NbdCmd
+static constexpr uint64_t kUringTagCancel = 4;     // NbdServer
+static constexpr uint64_t kUringTagBufs = 5;       // NbdServer
+
 int fd_set_nonblock(int fd) {
   int flags = fcntl(fd, F_GETFL, 0);
   if (flags == -1)
@@ -27,29 +69,85 @@ static void NbdCompletionCb(NbdCmd *cmd) {
   cmd->server->CompletionCb(cmd);
 }
 
-static NbdCmd *alloc_nbd_cmd_(void *arg) {
-  NbdCmd *cmd = new NbdCmd();
-  if (cmd) {
-    cmd->arg = arg;
-    cmd->completion_cb = NbdCompletionCb;
-    cmd->reply.magic = kNbdReplyMagic;
-  }
-  return cmd;
+// Returns true if a read payload follows the reply header.
+static bool HasReadData(NbdCmd *cmd) {
+  return cmd->reply_data_len != 0;
 }
 
-static void free_nbd_cmd_(void *arg, NbdCmd *cmd) {
-  delete cmd;
+// Big endian stores into a reply header, return the end of the field.
+static char *Put16(char *p, uint16_t v) {
+  v = htobe16(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static char *Put32(char *p, uint32_t v) {
+  v = htobe32(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static char *Put64(char *p, uint64_t v) {
+  v = htobe64(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+// Structured reply chunk header, len bytes of payload follow.
+static char *PutChunkHdr(char *p, NbdCmd *cmd, uint16_t flags,
+                         uint16_t type, uint32_t len) {
+  p = Put32(p, kNbdStructuredReplyMagic);
+  p = Put16(p, flags);
+  p = Put16(p, type);
+  memcpy(p, cmd->req.handle, 8);
+  return Put32(p + 8, len);
+}
+
+static void NbdMergedCompletionCb(NbdCmd *cmd) {
+  cmd->server->MergedCompletionCb(cmd);
+}
+
+static void NbdStreamCompletionCb(NbdCmd *cmd) {
+  cmd->server->StreamCompletionCb(cmd);
+}
+
+static void NbdPrefetchCompletionCb(NbdCmd *cmd) {
+  cmd->server->PrefetchCompletionCb(cmd);
+}
+
+// Cmds the server made up itself complete through callbacks of their own.
+static bool OwnCompletion(NbdCmd *cmd) {
+  // Cmds of neither a server nor a ublk queue belong to a layer between
+  // the servers and the backend, e.g. the BlockCache.
+  return (cmd->merge_next != nullptr) || (cmd->stream_parent != nullptr) ||
+         (cmd->prefetch != nullptr) ||
+         ((cmd->server == nullptr) && (cmd->ublk_queue == nullptr));
+}
+
+static void init_nbd_cmd_(void *arg, NbdCmd *cmd) {
+  cmd->arg = arg;
+  cmd->completion_cb = NbdCompletionCb;
 }
 }  // anonymous namespace
 
 NbdServer::NbdServer(const NbdParams &params) :
-    cmd_cache_(alloc_nbd_cmd_, params.arg, free_nbd_cmd_, nullptr,
-               offsetof(NbdCmd, link)),
-    send_cmds_(offsetof(NbdCmd, link)),
-    pending_backend_cmds_(offsetof(NbdCmd, link)) {
+    cmd_cache_([this](void *arg) { return AllocCmd(arg); }, params.arg,
+               [this](void *, NbdCmd *cmd) { FreeCmd(cmd); }, nullptr),
+    merge_free_(offsetof(NbdCmd, send_link)),
+    retry_reads_(offsetof(NbdCmd, send_link)),
+    send_cmds_(offsetof(NbdCmd, send_link)),
+    send_batch_(offsetof(NbdCmd, link)),
+    zc_cmds_(offsetof(NbdCmd, link)) {
+  pending_backend_cmds_ = 0;
   rcv_running_ = false;
   send_running_ = false;
   config_running_ = false;
+  send_blocked_ = false;
+  stream_kick_ = false;
+  merge_cmds_ = 0;
+  merge_merged_cmds_ = 0;
+  merge_merges_ = 0;
+  merge_bytes_ = 0;
   rcv_cmd_ = nullptr;
   send_cmd_ = nullptr;
   shutdown_ = false;
@@ -66,50 +164,314 @@ NbdServer::~NbdServer() {
   // calls) and that completely eliminates this window.
   do {
     this_thread::sleep_for(chrono::milliseconds(1));
+    // Reads handed back by a failed prefetch have nobody to submit them
+    // anymore.
+    bool flg = false;
+    if (!retry_reads_.Empty() &&
+        rcv_running_.compare_exchange_strong(flg, true)) {
+      unique_lock<mutex> l;
+      if (uring_)
+        l = unique_lock<mutex>(uring_->lock());
+      SubmitRetryReads();
+      rcv_running_ = false;
+    }
   } while (rcv_running_ || send_running_ || config_running_ ||
-           (pending_backend_cmds_.size() > 0));
+           (pending_backend_cmds_ > 0));
+  if (uring_)
+    UringDrain();
   if (fd_ >= 0) {
     close(fd_);
     fd_ = -1;
   }
-  unique_lock<mutex> l(lock_);
+  if (capture_len_ > 0)
+    capture_->Write(capture_buf_.get(), capture_len_);
+  // No poller is left, the send side magazines are free to use.
+  auto free_cmd = [this](NbdCmd *cmd) {
+    FreeStreamChunks(cmd);
+    FreeData(cmd);
+    cmd->completion_cb = NbdCompletionCb;
+    cmd_cache_.Free(&send_mags_, cmd);
+  };
+  // A write chunk still being received.
+  if (rcv_chunk_ != nullptr) {
+    free_cmd(rcv_chunk_);
+    rcv_chunk_ = nullptr;
+  }
   if (rcv_cmd_ != nullptr) {
-    if (rcv_cmd_->data_buf != nullptr) {
-      params_.free_data_mem(rcv_cmd_->data_buf);
-      rcv_cmd_->data_buf = nullptr;
-    }
-    cmd_cache_.Free(&l, rcv_cmd_);
+    free_cmd(rcv_cmd_);
     rcv_cmd_ = nullptr;
   }
   if (send_cmd_ != nullptr) {
-    if (send_cmd_->data_buf != nullptr) {
-      params_.free_data_mem(send_cmd_->data_buf);
-      send_cmd_->data_buf = nullptr;
-    }
-    cmd_cache_.Free(&l, send_cmd_);
+    free_cmd(send_cmd_);
     send_cmd_ = nullptr;
   }
   NbdCmd *cmd;
-  while ((cmd = send_cmds_.PopFront()) != nullptr) {
-    if (cmd->data_buf != nullptr) {
-      params_.free_data_mem(cmd->data_buf);
-      cmd->data_buf = nullptr;
+  while ((cmd = send_batch_.PopFront()) != nullptr)
+    free_cmd(cmd);
+  // The socket is closed, whatever the kernel still has pinned is going
+  // nowhere.
+  while ((cmd = zc_cmds_.PopFront()) != nullptr)
+    free_cmd(cmd);
+  // Nothing is being pushed anymore, so this drains the queue.
+  while ((cmd = send_cmds_.Pop()) != nullptr)
+    free_cmd(cmd);
+  while ((cmd = merge_free_.Pop()) != nullptr) {
+    cmd->completion_cb = NbdCompletionCb;
+    cmd_cache_.Free(&send_mags_, cmd);
+  }
+  cmd_cache_.Drain(&rcv_mags_);
+  cmd_cache_.Drain(&send_mags_);
+}
+
+NbdCmd *NbdServer::AllocCmd(void *arg) {
+  if (cmd_slab_) {
+    unique_lock<mutex> l(slab_lock_);
+    if (!slab_free_.empty()) {
+      NbdCmd *cmd = &cmd_slab_[slab_free_.back()];
+      slab_free_.pop_back();
+      return cmd;
     }
-    cmd_cache_.Free(&l, cmd);
   }
-  l.unlock();
+  NbdCmd *cmd = new NbdCmd();
+  init_nbd_cmd_(arg, cmd);
+  return cmd;
+}
+
+void NbdServer::FreeCmd(NbdCmd *cmd) {
+  if (cmd_slab_ && (cmd >= &cmd_slab_[0]) &&
+      (cmd < &cmd_slab_[cmd_slab_size_])) {
+    unique_lock<mutex> l(slab_lock_);
+    slab_free_.push_back(cmd - &cmd_slab_[0]);
+    return;
+  }
+  delete cmd;
 }
 
 void NbdServer::CompletionCb(NbdCmd *cmd) {
-  // Prepare reply, magic is set already.
-  cmd->reply.error = htobe32(cmd->ret_error);
-  bcopy(cmd->req.handle, cmd->reply.handle, 8);
-  cmd->cur_state = NBDCMD_STATE_SEND_REPLY;
-  cmd->cur_io_ptr = (void *)&cmd->reply;
-  cmd->io_size_remaining = sizeof(cmd->reply);
-  unique_lock<mutex> l(lock_);
-  pending_backend_cmds_.Remove(cmd);
-  send_cmds_.PushBack(cmd);
+  if (stats_)
+    cmd->done_ticks = NbdStatsCounters::Now();
+  // Before the client can hear of the write and read it back.
+  if (prefetcher_ && (cmd->req.type != NBD_CMD_READ))
+    prefetcher_->Invalidate(cmd->io_offset, cmd->io_size);
+  PrepareReply(cmd);
+  send_cmds_.Push(cmd);
+  // Pairs with the increment of *sleepers before PrepareWait() looks at
+  // send_cmds_, either it sees this cmd or we see the sleeper.
+  if (wakeup_sleepers_ && (*wakeup_sleepers_ > 0))
+    eventfd_write(wakeup_fd_, 1);
+  // Has to be last, the server may be deleted as soon as this hits 0.
+  pending_backend_cmds_--;
+}
+
+void NbdServer::CompletionCb(NbdCmd **cmds, unsigned n) {
+  uint64_t now = stats_ ? NbdStatsCounters::Now() : 0;
+  for (unsigned i = 0; i < n; i++) {
+    cmds[i]->done_ticks = now;
+    if (prefetcher_ && (cmds[i]->req.type != NBD_CMD_READ))
+      prefetcher_->Invalidate(cmds[i]->io_offset, cmds[i]->io_size);
+    PrepareReply(cmds[i]);
+  }
+  send_cmds_.PushBatch(cmds, n);
+  // See above.
+  if (wakeup_sleepers_ && (*wakeup_sleepers_ > 0))
+    eventfd_write(wakeup_fd_, 1);
+  pending_backend_cmds_ -= n;
+}
+
+void NbdServer::MergedCompletionCb(NbdCmd *merged) {
+  NbdCmd *cmds[kMaxMergeWindow];
+  unsigned n = 0;
+  size_t off = 0;
+  bool read = (merged->req.type == NBD_CMD_READ);
+  for (NbdCmd *cmd = merged->merge_next; cmd != nullptr;
+       cmd = cmd->merge_next) {
+    cmd->ret_error = merged->ret_error;
+    if (read && (merged->ret_error == 0))
+      memcpy(cmd->data_buf, (char *)merged->data_buf + off, cmd->io_size);
+    off += cmd->io_size;
+    cmds[n++] = cmd;
+  }
+  params_.free_data_mem(merged->data_buf);
+  merged->data_buf = nullptr;
+  // Before the original cmds complete, the server may go away after.
+  merge_free_.Push(merged);
+  CompletionCb(cmds, n);
+}
+
+void NbdServer::StreamCompletionCb(NbdCmd *chunk) {
+  NbdCmd *parent = chunk->stream_parent;
+  if (parent->req.type == NBD_CMD_WRITE) {
+    unsigned no_error = 0;
+    if (chunk->ret_error != 0)
+      parent->stream_error.compare_exchange_strong(no_error, chunk->ret_error);
+    // Chunks of a write received whole point into its buffer.
+    if ((chunk->data_buf != nullptr) && (parent->data_buf == nullptr))
+      params_.free_data_mem(chunk->data_buf);
+    chunk->data_buf = nullptr;
+    merge_free_.Push(chunk);
+    // The last chunk, or the end of the payload, completes the write.
+    if (parent->stream_left.fetch_sub(1) == 1) {
+      parent->ret_error = parent->stream_error;
+      CompletionCb(parent);
+    }
+    pending_backend_cmds_--;
+    return;
+  }
+  // Read chunks stay chained to the read, the sender frees them once it
+  // has passed them. Neither may be touched after stream_left drops,
+  // the sender may free them from then on.
+  bool first = (chunk->io_offset == parent->io_offset);
+  bool failed = (chunk->ret_error != 0);
+  if (first) {
+    parent->ret_error = chunk->ret_error;
+    PrepareReply(parent);
+  }
+  chunk->stream_left.store(0, memory_order_release);
+  uint32_t left;
+  if (first && failed) {
+    // No data follows, the reply waits until no chunk uses the buffer.
+    left = parent->stream_left.fetch_add(kStreamFailed - 1) +
+           kStreamFailed - 1;
+  } else {
+    left = parent->stream_left.fetch_sub(1) - 1;
+  }
+  // The first chunk starts the reply, unless it failed, then the last
+  // one does.
+  if ((first && !failed) || (left == kStreamFailed)) {
+    send_cmds_.Push(parent);
+  } else {
+    stream_kick_ = true;
+  }
+  // See CompletionCb().
+  if (wakeup_sleepers_ && (*wakeup_sleepers_ > 0))
+    eventfd_write(wakeup_fd_, 1);
+  // The read itself counts until its reply is queued.
+  if ((first && !failed) || (left == kStreamFailed))
+    pending_backend_cmds_--;
+  pending_backend_cmds_--;
+}
+
+void NbdServer::PrefetchCompletionCb(NbdCmd *cmd) {
+  NbdPrefetch *pf = cmd->prefetch;
+  unsigned error = cmd->ret_error;
+  cmd->prefetch = nullptr;
+  cmd->data_buf = nullptr;  // Owned by the prefetcher.
+  merge_free_.Push(cmd);
+  vector<NbdCmd *> waiters;
+  prefetcher_->Done(pf, error, &waiters);
+  PrefetchWaitersDone(error, &waiters);
+  pending_backend_cmds_--;
+}
+
+// static
+void NbdServer::PrefetchWaitersDone(unsigned error,
+                                    vector<NbdCmd *> *waiters) {
+  if (waiters->empty())
+    return;
+  // Waiters may be reads of other connections of the device. A read
+  // must not fail just because the speculative one for it did.
+  if (error == 0) {
+    NbdCompleteCmds(waiters->data(), waiters->size());
+    return;
+  }
+  for (NbdCmd *cmd : *waiters)
+    cmd->server->RetryRead(cmd);
+}
+
+void NbdServer::RetryRead(NbdCmd *cmd) {
+  retry_reads_.Push(cmd);
+  // See CompletionCb().
+  if (wakeup_sleepers_ && (*wakeup_sleepers_ > 0))
+    eventfd_write(wakeup_fd_, 1);
+}
+
+void NbdServer::SubmitRetryReads() {
+  NbdCmd *cmd;
+  while ((cmd = retry_reads_.Pop()) != nullptr) {
+    if (shutdown_) {
+      cmd->ret_error = EIO;
+      CompletionCb(cmd);
+    } else {
+      SubmitCmd(cmd);
+    }
+  }
+}
+
+void NbdServer::GetMergeStats(NbdMergeStats *stats) {
+  stats->cmds = merge_cmds_;
+  stats->merged_cmds = merge_merged_cmds_;
+  stats->merges = merge_merges_;
+  stats->merged_bytes = merge_bytes_;
+}
+
+void NbdServer::GetStats(NbdStats *stats) {
+  if (stats_) {
+    stats_->Snapshot(stats);
+  } else {
+    *stats = NbdStats();
+  }
+}
+
+void NbdServer::GetPrefetchStats(NbdPrefetchStats *stats) {
+  if (prefetcher_) {
+    prefetcher_->GetStats(stats);
+  } else {
+    *stats = NbdPrefetchStats();
+  }
+}
+
+void NbdCompleteCmds(NbdCmd **cmds, unsigned n) {
+  unsigned i = 0;
+  while (i < n) {
+    NbdServer *server = cmds[i]->server;
+    UblkQueue *queue = cmds[i]->ublk_queue;
+    if (OwnCompletion(cmds[i])) {
+      // A merged cmd, a chunk, a prefetch or a cmd of a layer in front
+      // of the backend, completes on its own.
+      cmds[i]->completion_cb(cmds[i]);
+      i++;
+      continue;
+    }
+    unsigned j = i + 1;
+    while ((j < n) && (cmds[j]->server == server) &&
+           (cmds[j]->ublk_queue == queue) && !OwnCompletion(cmds[j]))
+      j++;
+    if (server)
+      server->CompletionCb(cmds + i, j - i);
+    else
+      queue->CompletionCb(cmds + i, j - i);
+    i = j;
+  }
+}
+
+bool NbdServer::PrepareWait(int *fd, uint32_t *events) {
+  if (shutdown_) {
+    *fd = uring_ ? uring_->fd() : fd_;
+    *events = 0;
+    return true;
+  }
+  if (!retry_reads_.Empty())
+    return false;
+  if (uring_) {
+    // The ring fd becomes readable on completions. Anything the last poll
+    // could not submit has to be retried by polling.
+    unique_lock<mutex> rl(uring_->lock());
+    if ((!send_cmds_.Empty() && (uring_sends_ == 0)) ||
+        !uring_recv_armed_ || !uring_free_bids_.empty() ||
+        (uring_->SqPending() > 0))
+      return false;
+    *fd = uring_->fd();
+    *events = EPOLLIN;
+    return true;
+  }
+  // A streamed reply waiting for chunks which have completed since.
+  if (stream_kick_)
+    return false;
+  *fd = fd_;
+  *events = EPOLLIN;
+  if (!send_cmds_.Empty() || send_blocked_)
+    *events |= EPOLLOUT;
+  return true;
 }
 
 bool NbdServer::CheckShutdown(string *reason) {
@@ -133,11 +495,167 @@ int NbdServer::New(
     return errno;
   }
   server->params_ = params;  // Object copy.
+  if (params.max_io_size == 0) {
+    return EINVAL;
+  }
+  server->max_io_size_ = params.max_io_size;
+  if ((params.stream_chunk_size > 0) &&
+      (params.stream_chunk_size < params.max_io_size)) {
+    server->stream_chunk_size_ = params.stream_chunk_size;
+  }
+  if ((params.zero_detect_size > 0) && params.write_zeroes &&
+      (params.block_size > 0)) {
+    // Whole blocks.
+    server->zero_detect_size_ =
+        (params.zero_detect_size + params.block_size - 1) /
+        params.block_size * params.block_size;
+  }
+  if (!server->params_.prefetcher && (params.prefetch_size > 0)) {
+    int st = NbdPrefetcher::New(params, &server->params_.prefetcher);
+    if (st != 0) {
+      return st;
+    }
+  }
+  server->prefetcher_ = server->params_.prefetcher.get();
+  if (params.stats)
+    server->stats_.reset(new NbdStatsCounters());
+  if (params.capture) {
+    server->capture_ = params.capture.get();
+    server->capture_conn_ = server->capture_->NewConn();
+    server->capture_buf_.reset(new NbdCaptureRecord[kCaptureBatch]);
+  }
+  if (params.cmd_slab && (params.queue_depth > 0)) {
+    server->cmd_slab_size_ = params.queue_depth;
+    server->cmd_slab_.reset(new NbdCmd[params.queue_depth]);
+    server->slab_free_.reserve(params.queue_depth);
+    // Hand out the start of the array first.
+    for (uint32_t i = params.queue_depth; i > 0; i--) {
+      init_nbd_cmd_(params.arg, &server->cmd_slab_[i - 1]);
+      server->slab_free_.push_back(i - 1);
+    }
+  }
+  if ((params.rcv_buf_size > 0) &&
+      (params.io_engine == NBD_IO_ENGINE_SOCKET)) {
+    // Has to hold at least one request header.
+    server->rcv_buf_size_ = max<uint32_t>(params.rcv_buf_size,
+                                          sizeof(struct nbd_request));
+    server->rcv_buf_.reset(new char[server->rcv_buf_size_]);
+  }
+  if (params.send_batch_size > 0) {
+    // Two iovecs (reply and read data) per cmd, as many as writev() takes
+    // if the data can be an iovec list.
+    server->send_batch_size_ = min<uint32_t>(params.send_batch_size,
+                                             IOV_MAX / 2);
+    server->send_iov_size_ = params.alloc_data_iov ?
+                             IOV_MAX : server->send_batch_size_ * 2;
+    server->send_iov_.reset(new struct iovec[server->send_iov_size_]);
+  }
+  if (params.alloc_data_iov) {
+    server->rcv_iov_.reset(new struct iovec[NBD_MAX_DATA_IOV + 1]);
+    server->send_data_iov_.reset(new struct iovec[NBD_MAX_DATA_IOV]);
+  }
+  if (params.merge_max_size > 0) {
+    server->merge_max_size_ = params.merge_max_size;
+    server->merge_window_ = max<uint32_t>(
+        1, min<uint32_t>(params.merge_window, kMaxMergeWindow));
+  }
+  if (params.submit_batch || server->merge_max_size_) {
+    server->rcv_batch_.reserve(kMaxMergeWindow);
+    server->merge_batch_.reserve(kMaxMergeWindow);
+  }
+  if (params.zerocopy_threshold > 0) {
+    // Fails on sockets which cannot do zerocopy, they just copy.
+    int one = 1;
+    if (setsockopt(server->fd_, SOL_SOCKET, SO_ZEROCOPY, &one,
+                   sizeof(one)) == 0) {
+      server->zc_threshold_ = params.zerocopy_threshold;
+    }
+  }
+  if (params.io_engine == NBD_IO_ENGINE_URING) {
+    server->uring_free_bids_.reserve(kUringRecvBufs);
+    int st = server->UringInit();
+    if (st != 0) {
+      return st;
+    }
+  } else if (params.io_engine != NBD_IO_ENGINE_SOCKET) {
+    return EINVAL;
+  }
 
   *ret_server = move(server);
   return 0;
 }
 
+void NbdServer::PrepareReply(NbdCmd *cmd) {
+  cmd->cur_state = NBDCMD_STATE_SEND_REPLY;
+  NbdTrace(cmd, NBD_TRACE_SEND_REPLY);
+  cmd->reply_data_off = 0;
+  cmd->reply_data_len = 0;
+  bool read = (cmd->req.type == NBD_CMD_READ);
+  if (read && (cmd->ret_error == 0))
+    cmd->reply_data_len = be32toh(cmd->req.len);
+  if (read && params_.structured_replies) {
+    PrepareStructuredReply(cmd);
+  } else {
+    struct nbd_reply *reply = (struct nbd_reply *)cmd->reply;
+    reply->magic = kNbdReplyMagic;
+    reply->error = htobe32(cmd->ret_error);
+    bcopy(cmd->req.handle, reply->handle, 8);
+    cmd->reply_len = sizeof(*reply);
+  }
+  cmd->cur_io_ptr = (void *)cmd->reply;
+  cmd->io_size_remaining = cmd->reply_len;
+}
+
+void NbdServer::PrepareStructuredReply(NbdCmd *cmd) {
+  char *p = cmd->reply;
+  uint32_t len = cmd->reply_data_len;
+  if (cmd->ret_error != 0) {
+    p = PutChunkHdr(p, cmd, kNbdReplyFlagDone, kNbdReplyTypeError, 6);
+    p = Put32(p, cmd->ret_error);
+    p = Put16(p, 0);  // No message.
+  } else if (len == 0) {
+    p = PutChunkHdr(p, cmd, kNbdReplyFlagDone, kNbdReplyTypeNone, 0);
+  } else {
+    // Whole zero blocks at either end go as holes. The data of streamed
+    // reads is not in yet, and iovecs are sent as they are.
+    uint32_t lead = 0;
+    uint32_t end = len;
+    uint32_t bs = params_.block_size;
+    if (!cmd->stream && (cmd->data_iovcnt == 0) && (bs > 0)) {
+      const char *buf = (const char *)cmd->data_buf;
+      while ((lead < len) && IsZeroBuf(buf + lead, min(bs, len - lead)))
+        lead += min(bs, len - lead);
+      while (end > lead) {
+        uint32_t start = max((end - 1) / bs * bs, lead);
+        if (!IsZeroBuf(buf + start, end - start))
+          break;
+        end = start;
+      }
+    }
+    // Chunks may come in any order, the holes go first so that the data
+    // is last on the wire.
+    if (lead > 0) {
+      p = PutChunkHdr(p, cmd, (lead == len) ? kNbdReplyFlagDone : 0,
+                      kNbdReplyTypeOffsetHole, 12);
+      p = Put64(p, cmd->io_offset);
+      p = Put32(p, lead);
+    }
+    if (end < len) {
+      p = PutChunkHdr(p, cmd, 0, kNbdReplyTypeOffsetHole, 12);
+      p = Put64(p, cmd->io_offset + end);
+      p = Put32(p, len - end);
+    }
+    if (lead < end) {
+      p = PutChunkHdr(p, cmd, kNbdReplyFlagDone, kNbdReplyTypeOffsetData,
+                      8 + end - lead);
+      p = Put64(p, cmd->io_offset + lead);
+    }
+    cmd->reply_data_off = lead;
+    cmd->reply_data_len = end - lead;
+  }
+  cmd->reply_len = p - cmd->reply;
+}
+
 void NbdServer::MarkShutdown(const string &reason) {
   // Dont remark shutdown
   unique_lock<mutex> l(lock_);
@@ -147,15 +665,67 @@ void NbdServer::MarkShutdown(const string &reason) {
 }
 
 void NbdServer::PostRcvdCmd() {
-  // Assumed to be called from Rcv Poller
-  assert(rcv_running_ == true);
+  // Assumed to be called from Rcv Poller, or with the ring locked.
+  assert(rcv_running_ || uring_);
   NbdCmd *cmd = rcv_cmd_;
   rcv_cmd_ = nullptr;
+  if (capture_ && capture_->hash_payload() &&
+      (cmd->req.type == NBD_CMD_WRITE) && !cmd->stream) {
+    CaptureCmd(cmd, true);
+  }
   cmd->cur_state = NBDCMD_STATE_CMD_SUBMITTED;
-  if (cmd->req.type != NBD_CMD_DISC) {
-    unique_lock<mutex> l(lock_);
-    pending_backend_cmds_.PushBack(cmd);
+  NbdTrace(cmd, NBD_TRACE_CMD_SUBMITTED);
+  if (stats_) {
+    cmd->submit_ticks = NbdStatsCounters::Now();
+    stats_->Handed(cmd->submit_ticks - cmd->rcv_ticks);
   }
+  if (cmd->req.type != NBD_CMD_DISC)
+    pending_backend_cmds_++;
+  if (cmd->req.type == NBD_CMD_DISC) {
+    // Whatever came before the disconnect goes to the backend first.
+    SubmitRcvBatch();
+    if (params_.disconnect)
+      params_.disconnect(cmd->arg, cmd);
+    MarkShutdown("Disconnect received");
+    cmd_cache_.Free(&rcv_mags_, cmd);
+    return;
+  }
+  // Read data in backend iovecs may be the backend's own storage, which
+  // prefetched data must not be copied over.
+  if (prefetcher_ && (cmd->req.type == NBD_CMD_READ) &&
+      (cmd->data_iovcnt == 0) && PrefetchRead(cmd)) {
+    return;
+  }
+  if (zero_detect_size_ && (cmd->req.type == NBD_CMD_WRITE) &&
+      (cmd->data_buf != nullptr) && SubmitZeroSplit(cmd)) {
+    return;
+  }
+  if (cmd->stream) {
+    if (cmd->req.type == NBD_CMD_READ) {
+      SubmitReadChunks(cmd);
+      return;
+    }
+    // The whole write payload is in, drop the hold on the write.
+    if (cmd->stream_left.fetch_sub(1) == 1) {
+      cmd->ret_error = cmd->stream_error;
+      CompletionCb(cmd);
+    }
+    return;
+  }
+  SubmitCmd(cmd);
+}
+
+void NbdServer::SubmitCmd(NbdCmd *cmd) {
+  if (params_.submit_batch || merge_max_size_) {
+    rcv_batch_.push_back(cmd);
+    if (merge_max_size_ && (rcv_batch_.size() >= merge_window_))
+      SubmitRcvBatch();
+    return;
+  }
+  DispatchCmd(cmd);
+}
+
+void NbdServer::DispatchCmd(NbdCmd *cmd) {
   switch (cmd->req.type) {
     case NBD_CMD_READ:
       params_.read(cmd->arg, cmd);
@@ -163,60 +733,429 @@ void NbdServer::PostRcvdCmd() {
     case NBD_CMD_WRITE:
       params_.write(cmd->arg, cmd);
       break;
-    case NBD_CMD_DISC:
-      if (params_.disconnect)
-        params_.disconnect(cmd->arg, cmd);
-      MarkShutdown("Disconnect received");
-      {
-        unique_lock<mutex> l(lock_);
-        cmd_cache_.Free(&l, cmd);
-      }
-      break;
     case NBD_CMD_FLUSH:
       params_.flush(cmd->arg, cmd);
       break;
     case NBD_CMD_TRIM:
       params_.trim(cmd->arg, cmd);
       break;
+    case NBD_CMD_WRITE_ZEROES:
+      params_.write_zeroes(cmd->arg, cmd);
+      break;
     default:
       cmd->ret_error = EINVAL;
       CompletionCb(cmd);
   }  // switch (cmd->req.type)
 }
 
-void NbdServer::PollRecv() {
-  if (shutdown_)
+void NbdServer::SubmitRcvBatch() {
+  if (rcv_batch_.empty())
     return;
-  if (rcv_cmd_ == nullptr) {
-    unique_lock<mutex> l(lock_);
-    rcv_cmd_ = cmd_cache_.Alloc(&l);
-    l.unlock();
-    if (rcv_cmd_ == nullptr)
-      return;
-    rcv_cmd_->Reset();
-    rcv_cmd_->server = this;
+  if (merge_max_size_)
+    MergeRcvBatch();
+  if (params_.submit_batch) {
+    params_.submit_batch(params_.arg, rcv_batch_.data(), rcv_batch_.size());
+  } else {
+    for (NbdCmd *cmd : rcv_batch_)
+      DispatchCmd(cmd);
   }
-  assert(rcv_cmd_->io_size_remaining > 0);
-  ssize_t ret = read(fd_, rcv_cmd_->cur_io_ptr, rcv_cmd_->io_size_remaining);
-  if (ret <= 0) {
-    if (ret < 0) {
-      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-        return;
+  rcv_batch_.clear();
+}
+
+void NbdServer::MergeRcvBatch() {
+  merge_batch_.clear();
+  size_t i = 0;
+  while (i < rcv_batch_.size()) {
+    NbdCmd *first = rcv_batch_[i];
+    uint32_t type = first->req.type;
+    // Chunks were split off on purpose, iovec lists are the backend's,
+    // prefetches the prefetcher's.
+    bool mergeable = ((type == NBD_CMD_READ) ||
+                      ((type == NBD_CMD_WRITE) && !first->fua)) &&
+                     (first->stream_parent == nullptr) &&
+                     (first->prefetch == nullptr) &&
+                     (first->data_iovcnt == 0);
+    size_t j = i + 1;
+    uint64_t bytes = first->io_size;
+    while (mergeable && (j < rcv_batch_.size())) {
+      NbdCmd *prev = rcv_batch_[j - 1];
+      NbdCmd *cmd = rcv_batch_[j];
+      if ((cmd->req.type != type) || cmd->fua ||
+          (cmd->stream_parent != nullptr) || (cmd->prefetch != nullptr) ||
+          (cmd->data_iovcnt > 0) ||
+          (cmd->io_offset != prev->io_offset + prev->io_size) ||
+          (bytes + cmd->io_size > merge_max_size_))
+        break;
+      bytes += cmd->io_size;
+      j++;
     }
-    MarkShutdown((ret == 0) ?
-                 string("Remote end closed connection during read") :
-                 string("Failed to read from socket"));
-    return;
+    if (mergeable)
+      merge_cmds_.fetch_add(j - i, memory_order_relaxed);
+    NbdCmd *merged = nullptr;
+    if (j - i > 1) {
+      merged = merge_free_.Pop();
+      if (merged == nullptr)
+        merged = cmd_cache_.Alloc(&rcv_mags_);
+    }
+    if (merged != nullptr) {
+      merged->Reset();
+      merged->data_buf = params_.alloc_data_mem(bytes);
+      if (merged->data_buf == nullptr) {
+        merged->completion_cb = NbdCompletionCb;
+        cmd_cache_.Free(&rcv_mags_, merged);
+        merged = nullptr;
+      }
+    }
+    if (merged == nullptr) {
+      // Not mergeable, or out of memory, pass them on as they are.
+      for (; i < j; i++)
+        merge_batch_.push_back(rcv_batch_[i]);
+      continue;
+    }
+    merged->server = this;
+    merged->completion_cb = NbdMergedCompletionCb;
+    merged->internal = 1;
+    merged->cur_state = NBDCMD_STATE_CMD_SUBMITTED;
+    merged->req.type = type;
+    merged->rcv_type = type;
+    merged->req.from = htobe64(first->io_offset);
+    merged->req.len = htobe32(bytes);
+    merged->io_offset = first->io_offset;
+    merged->io_size = bytes;
+    merged->fua = 0;
+    merged->client_private = nullptr;
+    size_t off = 0;
+    NbdCmd **tail = &merged->merge_next;
+    for (size_t k = i; k < j; k++) {
+      NbdCmd *cmd = rcv_batch_[k];
+      if (type == NBD_CMD_WRITE)
+        memcpy((char *)merged->data_buf + off, cmd->data_buf, cmd->io_size);
+      off += cmd->io_size;
+      *tail = cmd;
+      tail = &cmd->merge_next;
+    }
+    *tail = nullptr;
+    merge_merged_cmds_.fetch_add(j - i, memory_order_relaxed);
+    merge_merges_.fetch_add(1, memory_order_relaxed);
+    merge_bytes_.fetch_add(bytes, memory_order_relaxed);
+    merge_batch_.push_back(merged);
+    i = j;
   }
-  rcv_cmd_->io_size_remaining -= ret;
-  if (rcv_cmd_->io_size_remaining != 0) {
-    rcv_cmd_->cur_io_ptr = (void *)(((char *)rcv_cmd_->cur_io_ptr) + ret);
+  rcv_batch_.swap(merge_batch_);
+}
+
+NbdCmd *NbdServer::AllocChunk(NbdCmd *parent, uint64_t offset,
+                              uint32_t len) {
+  NbdCmd *chunk = merge_free_.Pop();
+  if (chunk == nullptr)
+    chunk = cmd_cache_.Alloc(&rcv_mags_);
+  if (chunk == nullptr)
+    return nullptr;
+  chunk->Reset();
+  chunk->server = this;
+  chunk->completion_cb = NbdStreamCompletionCb;
+  chunk->internal = 1;
+  chunk->cur_state = NBDCMD_STATE_CMD_SUBMITTED;
+  chunk->req.type = parent->req.type;
+  chunk->rcv_type = parent->rcv_type;
+  chunk->req.from = htobe64(offset);
+  chunk->req.len = htobe32(len);
+  chunk->io_offset = offset;
+  chunk->io_size = len;
+  chunk->fua = parent->fua;
+  chunk->client_private = nullptr;
+  chunk->stream_parent = parent;
+  chunk->stream_left = 1;
+  return chunk;
+}
+
+bool NbdServer::StartWriteChunk(uint64_t offset, uint32_t len) {
+  if (len > stream_chunk_size_)
+    len = stream_chunk_size_;
+  rcv_chunk_ = AllocChunk(rcv_cmd_, offset, len);
+  if (rcv_chunk_ == nullptr) {
+    MarkShutdown("Failed to allocate nbd cmd");
+    return false;
+  }
+  rcv_chunk_->data_buf = params_.alloc_data_mem(len);
+  if (rcv_chunk_->data_buf == nullptr) {
+    MarkShutdown("Failed to allocate DMA memory");
+    return false;
+  }
+  rcv_cmd_->cur_io_ptr = rcv_chunk_->data_buf;
+  rcv_cmd_->io_size_remaining = len;
+  return true;
+}
+
+bool NbdServer::RcvdWriteChunk() {
+  NbdCmd *chunk = rcv_chunk_;
+  rcv_chunk_ = nullptr;
+  uint64_t end = chunk->io_offset + chunk->io_size;
+  if (zero_detect_size_ && IsZeroBuf(chunk->data_buf, chunk->io_size))
+    MakeWriteZeroes(chunk);
+  // Counted before the backend can complete it.
+  rcv_cmd_->stream_left++;
+  pending_backend_cmds_++;
+  SubmitCmd(chunk);
+  uint64_t left = rcv_cmd_->io_offset + rcv_cmd_->io_size - end;
+  if (left == 0)
+    return true;
+  StartWriteChunk(end, left);
+  return false;
+}
+
+void NbdServer::SubmitReadChunks(NbdCmd *cmd) {
+  NbdCmd *first = nullptr;
+  NbdCmd **tail = &first;
+  uint32_t n = 0;
+  for (uint32_t off = 0; off < cmd->io_size; off += stream_chunk_size_) {
+    uint32_t len = min(stream_chunk_size_, cmd->io_size - off);
+    NbdCmd *chunk = AllocChunk(cmd, cmd->io_offset + off, len);
+    if (chunk == nullptr)
+      break;
+    chunk->data_buf = (char *)cmd->data_buf + off;
+    *tail = chunk;
+    tail = &chunk->stream_next;
+    n++;
+  }
+  *tail = nullptr;
+  if ((uint64_t)n * stream_chunk_size_ < cmd->io_size) {
+    // Out of cmds, the read goes as it is.
+    while (first != nullptr) {
+      NbdCmd *chunk = first;
+      first = chunk->stream_next;
+      chunk->data_buf = nullptr;
+      chunk->completion_cb = NbdCompletionCb;
+      cmd_cache_.Free(&rcv_mags_, chunk);
+    }
+    cmd->stream = 0;
+    SubmitCmd(cmd);
     return;
   }
-  if (rcv_cmd_->cur_state == NBDCMD_STATE_RCV_WRITE_DATA) {
-    PostRcvdCmd();
+  cmd->stream_next = first;
+  cmd->stream_ready = 0;
+  cmd->stream_left = n;
+  pending_backend_cmds_ += n;
+  // A chunk may complete, and the sender free it, as soon as it is
+  // submitted.
+  for (NbdCmd *chunk = first; chunk != nullptr;) {
+    NbdCmd *next = chunk->stream_next;
+    SubmitCmd(chunk);
+    chunk = next;
+  }
+}
+
+void NbdServer::MakeWriteZeroes(NbdCmd *cmd) {
+  cmd->req.type = NBD_CMD_WRITE_ZEROES;
+  cmd->no_hole = 1;
+  params_.free_data_mem(cmd->data_buf);
+  cmd->data_buf = nullptr;
+}
+
+bool NbdServer::SubmitZeroSplit(NbdCmd *cmd) {
+  // Zero runs long enough to be worth a call of their own, as (offset,
+  // length) into the payload.
+  zero_runs_.clear();
+  const char *buf = (const char *)cmd->data_buf;
+  uint32_t bs = params_.block_size;
+  uint32_t run = 0;
+  bool in_run = false;
+  auto end_run = [&](uint32_t end) {
+    if ((end - run >= zero_detect_size_) ||
+        ((run == 0) && (end == cmd->io_size)))
+      zero_runs_.emplace_back(run, end - run);
+    in_run = false;
+  };
+  for (uint32_t off = 0; off < cmd->io_size; off += bs) {
+    bool zero = IsZeroBuf(buf + off, min(bs, cmd->io_size - off));
+    if (zero && !in_run) {
+      run = off;
+      in_run = true;
+    } else if (!zero && in_run) {
+      end_run(off);
+    }
+  }
+  if (in_run)
+    end_run(cmd->io_size);
+  if (zero_runs_.empty())
+    return false;
+  if (zero_runs_[0].second == cmd->io_size) {
+    MakeWriteZeroes(cmd);
+    SubmitCmd(cmd);
+    return true;
+  }
+  // Data runs point into cmd's buffer, which goes with cmd.
+  NbdCmd *first = nullptr;
+  NbdCmd **tail = &first;
+  bool failed = false;
+  auto add = [&](uint32_t off, uint32_t len, bool zero) {
+    NbdCmd *chunk = failed ? nullptr :
+                    AllocChunk(cmd, cmd->io_offset + off, len);
+    if (chunk == nullptr) {
+      failed = true;
+      return;
+    }
+    if (zero) {
+      chunk->req.type = NBD_CMD_WRITE_ZEROES;
+      chunk->no_hole = 1;
+    } else {
+      chunk->data_buf = (char *)cmd->data_buf + off;
+    }
+    *tail = chunk;
+    tail = &chunk->stream_next;
+  };
+  uint32_t off = 0;
+  for (auto &zero_run : zero_runs_) {
+    if (zero_run.first > off)
+      add(off, zero_run.first - off, false);
+    add(zero_run.first, zero_run.second, true);
+    off = zero_run.first + zero_run.second;
+  }
+  if (off < cmd->io_size)
+    add(off, cmd->io_size - off, false);
+  *tail = nullptr;
+  if (failed) {
+    // Out of cmds, the write goes as it is.
+    while (first != nullptr) {
+      NbdCmd *chunk = first;
+      first = chunk->stream_next;
+      chunk->data_buf = nullptr;
+      chunk->completion_cb = NbdCompletionCb;
+      cmd_cache_.Free(&rcv_mags_, chunk);
+    }
+    return false;
+  }
+  // Held until every chunk is submitted, like a streamed write.
+  cmd->stream = 1;
+  cmd->stream_left = 1;
+  cmd->stream_error = 0;
+  for (NbdCmd *chunk = first; chunk != nullptr;) {
+    NbdCmd *next = chunk->stream_next;
+    cmd->stream_left++;
+    pending_backend_cmds_++;
+    SubmitCmd(chunk);
+    chunk = next;
+  }
+  if (cmd->stream_left.fetch_sub(1) == 1) {
+    cmd->ret_error = cmd->stream_error;
+    CompletionCb(cmd);
+  }
+  return true;
+}
+
+bool NbdServer::PrefetchRead(NbdCmd *cmd) {
+  // Served whole if at all, never streamed. The cmd may complete as soon
+  // as the prefetcher has it.
+  uint8_t stream = cmd->stream;
+  cmd->stream = 0;
+  prefetch_issue_.clear();
+  int st = prefetcher_->Read(cmd, &prefetch_issue_);
+  for (NbdPrefetch *pf : prefetch_issue_)
+    SubmitPrefetch(pf);
+  if (st == NBD_PREFETCH_HIT)
+    CompletionCb(cmd);
+  if (st != NBD_PREFETCH_MISS)
+    return true;
+  cmd->stream = stream;
+  return false;
+}
+
+void NbdServer::SubmitPrefetch(NbdPrefetch *pf) {
+  NbdCmd *cmd = merge_free_.Pop();
+  if (cmd == nullptr)
+    cmd = cmd_cache_.Alloc(&rcv_mags_);
+  if (cmd == nullptr) {
+    // Whoever found it in flight since reads from the backend.
+    vector<NbdCmd *> waiters;
+    prefetcher_->Done(pf, ENOMEM, &waiters);
+    PrefetchWaitersDone(ENOMEM, &waiters);
     return;
   }
+  cmd->Reset();
+  cmd->server = this;
+  cmd->completion_cb = NbdPrefetchCompletionCb;
+  cmd->internal = 1;
+  cmd->cur_state = NBDCMD_STATE_CMD_SUBMITTED;
+  cmd->req.type = NBD_CMD_READ;
+  cmd->rcv_type = NBD_CMD_READ;
+  cmd->req.from = htobe64(pf->offset);
+  cmd->req.len = htobe32(pf->len);
+  cmd->io_offset = pf->offset;
+  cmd->io_size = pf->len;
+  cmd->fua = 0;
+  cmd->client_private = nullptr;
+  cmd->data_buf = pf->data;
+  cmd->prefetch = pf;
+  pending_backend_cmds_++;
+  SubmitCmd(cmd);
+}
+
+bool NbdServer::AllocRcvCmd() {
+  if (rcv_cmd_ != nullptr)
+    return true;
+  rcv_cmd_ = cmd_cache_.Alloc(&rcv_mags_);
+  if (rcv_cmd_ == nullptr)
+    return false;
+  rcv_cmd_->Reset();
+  rcv_cmd_->server = this;
+  return true;
+}
+
+bool NbdServer::AllocData(NbdCmd *cmd) {
+  if (params_.alloc_data_iov) {
+    if (!cmd->iov_store)
+      cmd->iov_store.reset(new NbdCmd::IovStore());
+    struct iovec *iov = cmd->iov_store->iov;
+    int n = params_.alloc_data_iov(cmd->arg, cmd, iov, NBD_MAX_DATA_IOV);
+    if (n < 0)
+      return false;
+    if (n > 0) {
+      cmd->data_iov = iov;
+      cmd->data_iovcnt = n;
+      uint64_t bytes = 0;
+      bool valid = (n <= NBD_MAX_DATA_IOV);
+      for (int i = 0; valid && (i < n); i++) {
+        valid = (iov[i].iov_len > 0);
+        bytes += iov[i].iov_len;
+      }
+      if (!valid || (bytes != cmd->io_size)) {
+        FreeData(cmd);
+        return false;
+      }
+      cmd->data_iov_idx = 0;
+      cmd->cur_io_ptr = iov[0].iov_base;
+      cmd->io_size_remaining = iov[0].iov_len;
+      return true;
+    }
+  }
+  cmd->cur_io_ptr = cmd->data_buf = params_.alloc_data_mem(cmd->io_size);
+  cmd->io_size_remaining = cmd->io_size;
+  return (cmd->data_buf != nullptr);
+}
+
+void NbdServer::FreeData(NbdCmd *cmd) {
+  if (cmd->data_buf != nullptr) {
+    params_.free_data_mem(cmd->data_buf);
+    cmd->data_buf = nullptr;
+  }
+  if (cmd->data_iovcnt > 0) {
+    if (params_.free_data_iov)
+      params_.free_data_iov(cmd->arg, cmd);
+    cmd->data_iov = nullptr;
+    cmd->data_iovcnt = 0;
+  }
+}
+
+int NbdServer::DataIov(NbdCmd *cmd, struct iovec *iov) {
+  iov[0].iov_base = cmd->cur_io_ptr;
+  iov[0].iov_len = cmd->io_size_remaining;
+  int n = 1;
+  for (uint32_t i = cmd->data_iov_idx + 1; i < cmd->data_iovcnt; i++)
+    iov[n++] = cmd->data_iov[i];
+  return n;
+}
+
+void NbdServer::RcvdReqHeader() {
   assert(rcv_cmd_->cur_state == NBDCMD_STATE_RCV_REQ);
   rcv_cmd_->req.type = be32toh(rcv_cmd_->req.type);
   if (rcv_cmd_->req.type & NBD_CMD_FLAG_FUA) {
@@ -224,83 +1163,606 @@ void NbdServer::PollRecv() {
   } else {
     rcv_cmd_->fua = 0;
   }
+  rcv_cmd_->no_hole = (rcv_cmd_->req.type & NBD_CMD_FLAG_NO_HOLE) ? 1 : 0;
   rcv_cmd_->req.type &= 0xFFFF; // Mask off flags.
+  rcv_cmd_->rcv_type = rcv_cmd_->req.type;
   if ((rcv_cmd_->req.magic != kNbdReqMagic) ||
-      (rcv_cmd_->req.type > NBD_CMD_TRIM)) {
+      ((rcv_cmd_->req.type > NBD_CMD_TRIM) &&
+       ((rcv_cmd_->req.type != NBD_CMD_WRITE_ZEROES) ||
+        !params_.write_zeroes))) {
     MarkShutdown("Invalid cmd received");
     return;
   }
   rcv_cmd_->io_offset = be64toh(rcv_cmd_->req.from);
   rcv_cmd_->io_size = be32toh(rcv_cmd_->req.len);
-  if ((rcv_cmd_->req.type == NBD_CMD_READ) ||
-      (rcv_cmd_->req.type == NBD_CMD_WRITE)) {
+  if (stats_ || capture_) {
+    rcv_cmd_->rcv_ticks = NbdStatsCounters::Now();
+    rcv_cmd_->submit_ticks = rcv_cmd_->rcv_ticks;
+  }
+  if (stats_)
+    stats_->Received(rcv_cmd_->rcv_type, rcv_cmd_->io_size);
+  NbdTrace(rcv_cmd_, NBD_TRACE_RCV_REQ);
+  uint32_t type = rcv_cmd_->req.type;
+  bool data = (type == NBD_CMD_READ) || (type == NBD_CMD_WRITE);
+  // Network clients, unlike the kernel, may send any range.
+  uint64_t dev_size = params_.num_blocks * params_.block_size;
+  if (data && ((rcv_cmd_->io_size == 0) ||
+               (rcv_cmd_->io_size > max_io_size_))) {
+    RejectRcvdCmd(EINVAL);
+    return;
+  }
+  if ((type != NBD_CMD_FLUSH) && (type != NBD_CMD_DISC) &&
+      ((rcv_cmd_->io_offset > dev_size) ||
+       (rcv_cmd_->io_size > dev_size - rcv_cmd_->io_offset))) {
+    RejectRcvdCmd((type == NBD_CMD_WRITE) ? ENOSPC : EINVAL);
+    return;
+  }
+  if (data) {
     rcv_cmd_->io_size_remaining = rcv_cmd_->io_size;
-    if ((rcv_cmd_->io_size_remaining == 0) ||
-        (rcv_cmd_->io_size_remaining > kMaxNbdIOSize)) {
-      rcv_cmd_->ret_error = EINVAL;
-      CompletionCb(rcv_cmd_);
-      rcv_cmd_ = nullptr;
+    // Chunked reads need the socket engine to send the reply in parts.
+    // Backends handing out iovecs get the payload in place anyway.
+    if ((stream_chunk_size_ > 0) && (rcv_cmd_->io_size > stream_chunk_size_) &&
+        ((rcv_cmd_->req.type == NBD_CMD_WRITE) || !uring_) &&
+        !params_.alloc_data_iov) {
+      rcv_cmd_->stream = 1;
+    }
+    if (rcv_cmd_->stream && (rcv_cmd_->req.type == NBD_CMD_WRITE)) {
+      // Held by the receive side until the payload is complete.
+      rcv_cmd_->stream_left = 1;
+      rcv_cmd_->stream_error = 0;
+      rcv_cmd_->cur_state = NBDCMD_STATE_RCV_WRITE_DATA;
+      NbdTrace(rcv_cmd_, NBD_TRACE_RCV_WRITE_DATA);
+      if (capture_)
+        CaptureCmd(rcv_cmd_, false);
+      StartWriteChunk(rcv_cmd_->io_offset, rcv_cmd_->io_size);
       return;
     }
-    rcv_cmd_->cur_io_ptr = rcv_cmd_->data_buf =
-        params_.alloc_data_mem(rcv_cmd_->io_size_remaining);
-    if (rcv_cmd_->data_buf == nullptr) {
+    if (!AllocData(rcv_cmd_)) {
       MarkShutdown("Failed to allocate DMA memory");
       return;
     }
   }
   if (rcv_cmd_->req.type != NBD_CMD_WRITE) {
+    if (capture_)
+      CaptureCmd(rcv_cmd_, false);
     PostRcvdCmd();
     return;
   }
+  // Hashed once the payload is in.
+  if (capture_ && !capture_->hash_payload())
+    CaptureCmd(rcv_cmd_, false);
   // Write command, start receiving data.
   rcv_cmd_->cur_state = NBDCMD_STATE_RCV_WRITE_DATA;
+  NbdTrace(rcv_cmd_, NBD_TRACE_RCV_WRITE_DATA);
 }
 
-void NbdServer::PollSend() {
-  if (send_cmd_ == nullptr) {
-    // Do an early check to avoid the lock.
-    if (send_cmds_.size() == 0) return;
-    unique_lock<mutex> l(lock_);
-    send_cmd_ = send_cmds_.PopFront();
-    if (send_cmd_ == nullptr)
+void NbdServer::RejectRcvdCmd(unsigned error) {
+  rcv_cmd_->ret_error = error;
+  if (capture_)
+    CaptureCmd(rcv_cmd_, false);
+  if ((rcv_cmd_->req.type == NBD_CMD_WRITE) && (rcv_cmd_->io_size > 0)) {
+    // The payload is still coming, the reply waits until it is read.
+    if (!discard_buf_)
+      discard_buf_.reset(new char[kDiscardBufSize]);
+    rcv_discard_left_ = rcv_cmd_->io_size;
+    rcv_cmd_->cur_state = NBDCMD_STATE_RCV_WRITE_DATA;
+    NbdTrace(rcv_cmd_, NBD_TRACE_RCV_WRITE_DATA);
+    DiscardPayload();
+    return;
+  }
+  pending_backend_cmds_++;  // Dropped again by CompletionCb().
+  CompletionCb(rcv_cmd_);
+  rcv_cmd_ = nullptr;
+}
+
+bool NbdServer::DiscardPayload() {
+  if (rcv_discard_left_ == 0)
+    return false;
+  uint32_t len = min(rcv_discard_left_, kDiscardBufSize);
+  rcv_discard_left_ -= len;
+  rcv_cmd_->cur_io_ptr = discard_buf_.get();
+  rcv_cmd_->io_size_remaining = len;
+  return true;
+}
+
+void NbdServer::CaptureCmd(NbdCmd *cmd, bool hash) {
+  NbdCaptureRecord *rec = &capture_buf_[capture_len_++];
+  rec->time_ns = capture_->TimeNs(cmd->rcv_ticks);
+  rec->offset = cmd->io_offset;
+  rec->hash = 0;
+  if (hash && (cmd->data_iovcnt > 0)) {
+    rec->hash = NbdCapture::Hash(cmd->data_iov, cmd->data_iovcnt);
+  } else if (hash) {
+    struct iovec iov = {cmd->data_buf, cmd->io_size};
+    rec->hash = NbdCapture::Hash(&iov, 1);
+  }
+  rec->len = cmd->io_size;
+  rec->conn = capture_conn_;
+  rec->type = cmd->rcv_type;
+  rec->flags = (cmd->fua ? NBD_CAPTURE_FUA : 0) |
+               (cmd->no_hole ? NBD_CAPTURE_NO_HOLE : 0);
+  if (capture_len_ == kCaptureBatch) {
+    capture_->Write(capture_buf_.get(), capture_len_);
+    capture_len_ = 0;
+  }
+}
+
+bool NbdServer::NextDataIov(NbdCmd *cmd) {
+  if (cmd->data_iov_idx + 1 >= cmd->data_iovcnt)
+    return false;
+  cmd->data_iov_idx++;
+  cmd->cur_io_ptr = cmd->data_iov[cmd->data_iov_idx].iov_base;
+  cmd->io_size_remaining = cmd->data_iov[cmd->data_iov_idx].iov_len;
+  return true;
+}
+
+void NbdServer::RcvdBytes(unsigned len) {
+  rcv_cmd_->io_size_remaining -= len;
+  if (rcv_cmd_->io_size_remaining != 0) {
+    rcv_cmd_->cur_io_ptr = (void *)(((char *)rcv_cmd_->cur_io_ptr) + len);
+    return;
+  }
+  if (rcv_cmd_->cur_state == NBDCMD_STATE_RCV_WRITE_DATA) {
+    if (rcv_cmd_->ret_error != 0) {
+      // Payload of a rejected write.
+      if (DiscardPayload())
+        return;
+      pending_backend_cmds_++;  // Dropped again by CompletionCb().
+      CompletionCb(rcv_cmd_);
+      rcv_cmd_ = nullptr;
       return;
+    }
+    if (NextDataIov(rcv_cmd_))
+      return;
+    if ((rcv_chunk_ != nullptr) && !RcvdWriteChunk())
+      return;
+    PostRcvdCmd();
+    return;
+  }
+  RcvdReqHeader();
+}
+
+size_t NbdServer::ConsumeRcvBytes(const char *buf, size_t len) {
+  size_t done = 0;
+  while ((done < len) && !shutdown_) {
+    if (!AllocRcvCmd())
+      break;
+    unsigned n = rcv_cmd_->io_size_remaining;
+    if (n > len - done)
+      n = len - done;
+    memcpy(rcv_cmd_->cur_io_ptr, buf + done, n);
+    done += n;
+    RcvdBytes(n);
+  }
+  return done;
+}
+
+bool NbdServer::PollRecv() {
+  if (shutdown_)
+    return false;
+  if (rcv_buf_) {
+    return PollRecvBuffered();
+  }
+  if (!AllocRcvCmd())
+    return false;
+  assert(rcv_cmd_->io_size_remaining > 0);
+  ssize_t ret;
+  if ((rcv_cmd_->cur_state == NBDCMD_STATE_RCV_WRITE_DATA) &&
+      (rcv_cmd_->data_iovcnt > 0)) {
+    ret = readv(fd_, rcv_iov_.get(), DataIov(rcv_cmd_, rcv_iov_.get()));
+  } else {
+    ret = read(fd_, rcv_cmd_->cur_io_ptr, rcv_cmd_->io_size_remaining);
   }
-  ssize_t ret = write(fd_, send_cmd_->cur_io_ptr,
-                      send_cmd_->io_size_remaining);
   if (ret <= 0) {
     if (ret < 0) {
       if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-        return;
+        return false;
+    }
+    MarkShutdown((ret == 0) ?
+                 string("Remote end closed connection during read") :
+                 string("Failed to read from socket"));
+    return false;
+  }
+  // A readv() may fill several segments of data_iov.
+  while (ret > 0) {
+    unsigned len = min<size_t>(ret, rcv_cmd_->io_size_remaining);
+    ret -= len;
+    RcvdBytes(len);
+  }
+  return true;
+}
+
+bool NbdServer::PollRecvBuffered() {
+  if (rcv_buf_head_ == rcv_buf_tail_) {
+    rcv_buf_head_ = rcv_buf_tail_ = 0;
+  } else if (rcv_buf_head_ > 0) {
+    // Only left behind if we could not allocate a cmd, rare.
+    memmove(rcv_buf_.get(), rcv_buf_.get() + rcv_buf_head_,
+            rcv_buf_tail_ - rcv_buf_head_);
+    rcv_buf_tail_ -= rcv_buf_head_;
+    rcv_buf_head_ = 0;
+  }
+  // One readv() per poll. If we are in the middle of a write payload and
+  // nothing is buffered, the rest of the payload goes straight into
+  // data_buf (or data_iov) and whatever follows it lands in rcv_buf_.
+  struct iovec local_iov[2];
+  struct iovec *iov = rcv_iov_ ? rcv_iov_.get() : local_iov;
+  int iovcnt = 0;
+  size_t direct = 0;
+  if ((rcv_buf_tail_ == 0) && (rcv_cmd_ != nullptr) &&
+      (rcv_cmd_->cur_state == NBDCMD_STATE_RCV_WRITE_DATA)) {
+    iovcnt = DataIov(rcv_cmd_, iov);
+    for (int i = 0; i < iovcnt; i++)
+      direct += iov[i].iov_len;
+  }
+  if (rcv_buf_tail_ < rcv_buf_size_) {
+    iov[iovcnt].iov_base = rcv_buf_.get() + rcv_buf_tail_;
+    iov[iovcnt].iov_len = rcv_buf_size_ - rcv_buf_tail_;
+    iovcnt++;
+  }
+  ssize_t ret = 0;
+  if (iovcnt > 0) {
+    ret = readv(fd_, iov, iovcnt);
+    if (ret <= 0) {
+      if (ret < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+          return false;
+      }
+      MarkShutdown((ret == 0) ?
+                   string("Remote end closed connection during read") :
+                   string("Failed to read from socket"));
+      return false;
+    }
+  }
+  if (direct > (size_t)ret)
+    direct = ret;
+  ret -= direct;
+  while (direct > 0) {
+    unsigned len = min<size_t>(direct, rcv_cmd_->io_size_remaining);
+    direct -= len;
+    RcvdBytes(len);
+  }
+  rcv_buf_tail_ += ret;
+  size_t consumed = ConsumeRcvBytes(rcv_buf_.get() + rcv_buf_head_,
+                                    rcv_buf_tail_ - rcv_buf_head_);
+  rcv_buf_head_ += consumed;
+  return (iovcnt > 0) || (consumed > 0);
+}
+
+bool NbdServer::SentBytes(NbdCmd *cmd, unsigned len) {
+  cmd->io_size_remaining -= len;
+  cmd->cur_io_ptr = (void *)(((char *)cmd->cur_io_ptr) + len);
+  if (cmd->io_size_remaining != 0)
+    return false;
+  if (cmd->cur_state == NBDCMD_STATE_SEND_READ_DATA) {
+    if (NextDataIov(cmd))
+      return false;
+    return StreamRefill(cmd);
+  }
+  if (!HasReadData(cmd))
+    return true;
+  // Send read data.
+  assert(cmd->cur_state == NBDCMD_STATE_SEND_REPLY);
+  cmd->cur_state = NBDCMD_STATE_SEND_READ_DATA;
+  NbdTrace(cmd, NBD_TRACE_SEND_READ_DATA);
+  if (cmd->data_iovcnt > 0) {
+    cmd->data_iov_idx = 0;
+    cmd->cur_io_ptr = cmd->data_iov[0].iov_base;
+    cmd->io_size_remaining = cmd->data_iov[0].iov_len;
+    return false;
+  }
+  cmd->cur_io_ptr = (char *)cmd->data_buf + cmd->reply_data_off;
+  if (cmd->stream) {
+    // As much as the backend has filled so far.
+    return StreamRefill(cmd);
+  }
+  cmd->io_size_remaining = cmd->reply_data_len;
+  return false;
+}
+
+bool NbdServer::StreamRefill(NbdCmd *cmd) {
+  if (!cmd->stream)
+    return true;
+  NbdCmd *chunk;
+  while (((chunk = cmd->stream_next) != nullptr) &&
+         (chunk->stream_left.load(memory_order_acquire) == 0)) {
+    if (chunk->ret_error != 0) {
+      // The reply went out without an error already.
+      MarkShutdown("Read failed after its reply was started");
+      return false;
+    }
+    cmd->stream_ready += chunk->io_size;
+    cmd->io_size_remaining += chunk->io_size;
+    cmd->stream_next = chunk->stream_next;
+    chunk->data_buf = nullptr;
+    chunk->completion_cb = NbdCompletionCb;
+    cmd_cache_.Free(&send_mags_, chunk);
+  }
+  if (cmd->io_size_remaining > 0)
+    return false;
+  // Every byte is out, but a chunk completion may still be on its way
+  // out of cmd.
+  return (cmd->stream_ready == cmd->io_size) &&
+         (cmd->stream_left.load(memory_order_acquire) == 0);
+}
+
+void NbdServer::FreeStreamChunks(NbdCmd *cmd) {
+  NbdCmd *chunk;
+  while ((chunk = cmd->stream_next) != nullptr) {
+    cmd->stream_next = chunk->stream_next;
+    chunk->data_buf = nullptr;
+    chunk->completion_cb = NbdCompletionCb;
+    cmd_cache_.Free(&send_mags_, chunk);
+  }
+}
+
+void NbdServer::FreeSentCmds(List<NbdCmd> *cmds) {
+  if (cmds->size() == 0)
+    return;
+  for (NbdCmd *cmd = cmds->First(); cmd != nullptr; cmd = cmds->Next(cmd)) {
+    NbdTrace(cmd, NBD_TRACE_DONE);
+    if (stats_) {
+      stats_->Replied(cmd->rcv_type, cmd->ret_error, cmd->rcv_ticks,
+                      cmd->submit_ticks, cmd->done_ticks);
+    }
+    FreeStreamChunks(cmd);
+    FreeData(cmd);
+  }
+  NbdCmd *cmd;
+  while ((cmd = cmds->PopFront()) != nullptr)
+    cmd_cache_.Free(&send_mags_, cmd);
+}
+
+bool NbdServer::ZcWanted(NbdCmd *cmd) {
+  return (zc_threshold_ > 0) && HasReadData(cmd) &&
+         (cmd->reply_data_len >= zc_threshold_);
+}
+
+ssize_t NbdServer::SendIov(struct iovec *iov, int iovcnt, bool *zc) {
+  // A remote client going away must not raise SIGPIPE.
+  struct msghdr msg;
+  bzero(&msg, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  if (*zc) {
+    ssize_t ret = sendmsg(fd_, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (ret > 0) {
+      zc_next_id_++;
+      zc_acked_.push_back(false);
+      return ret;
+    }
+    // ENOBUFS means we are over the limit of pinned memory, copy instead.
+    if ((ret == 0) || (errno != ENOBUFS)) {
+      *zc = false;
+      return ret;
+    }
+  }
+  *zc = false;
+  return sendmsg(fd_, &msg, MSG_NOSIGNAL);
+}
+
+bool NbdServer::ZcHold(NbdCmd *cmd) {
+  if (!cmd->zc)
+    return false;
+  cmd->zc_id = zc_next_id_;
+  zc_cmds_.PushBack(cmd);
+  return true;
+}
+
+bool NbdServer::ZcReap() {
+  if (zc_done_id_ == zc_next_id_)
+    return false;
+  bool reaped = false;
+  char control[128];
+  while (1) {
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd_, &msg, MSG_ERRQUEUE) < 0)
+      break;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(((cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR)) ||
+            ((cm->cmsg_level == SOL_IPV6) &&
+             (cm->cmsg_type == IPV6_RECVERR))))
+        continue;
+      struct sock_extended_err *serr =
+          (struct sock_extended_err *)CMSG_DATA(cm);
+      if ((serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || (serr->ee_errno != 0))
+        continue;
+      // The kernel had to copy anyway (e.g. loopback), pinning pages
+      // only costs us.
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        zc_threshold_ = 0;
+      // Acked ids are the range [ee_info, ee_data].
+      for (uint32_t id = serr->ee_info; id != serr->ee_data + 1; id++) {
+        uint32_t idx = id - zc_done_id_;
+        if (idx < zc_acked_.size())
+          zc_acked_[idx] = true;
+      }
+      reaped = true;
+    }
+  }
+  while (!zc_acked_.empty() && zc_acked_.front()) {
+    zc_acked_.pop_front();
+    zc_done_id_++;
+  }
+  List<NbdCmd> done(offsetof(NbdCmd, link));
+  NbdCmd *cmd;
+  while (((cmd = zc_cmds_.First()) != nullptr) &&
+         ((int32_t)(cmd->zc_id - zc_done_id_) <= 0)) {
+    zc_cmds_.PopFront();
+    done.PushBack(cmd);
+  }
+  FreeSentCmds(&done);
+  return reaped;
+}
+
+bool NbdServer::PollSend() {
+  if (send_iov_) {
+    return PollSendBatched();
+  }
+  if (stream_kick_)
+    stream_kick_ = false;
+  if (send_cmd_ == nullptr) {
+    send_cmd_ = send_cmds_.Pop();
+    if (send_cmd_ == nullptr)
+      return false;
+    NbdTrace(send_cmd_, NBD_TRACE_SEND_START);
+  }
+  if (send_cmd_->io_size_remaining == 0) {
+    // A streamed read waiting for its chunks.
+    if (StreamRefill(send_cmd_)) {
+      if (!ZcHold(send_cmd_)) {
+        List<NbdCmd> done(offsetof(NbdCmd, link));
+        done.PushBack(send_cmd_);
+        FreeSentCmds(&done);
+      }
+      send_cmd_ = nullptr;
+      return true;
+    }
+    if (send_cmd_->io_size_remaining == 0)
+      return false;
+  }
+  struct iovec iov;
+  iov.iov_base = send_cmd_->cur_io_ptr;
+  iov.iov_len = send_cmd_->io_size_remaining;
+  bool data = (send_cmd_->cur_state == NBDCMD_STATE_SEND_READ_DATA);
+  bool zc = data && ZcWanted(send_cmd_);
+  ssize_t ret;
+  if (data && (send_cmd_->data_iovcnt > 0)) {
+    ret = SendIov(send_data_iov_.get(),
+                  DataIov(send_cmd_, send_data_iov_.get()), &zc);
+  } else {
+    ret = SendIov(&iov, 1, &zc);
+  }
+  if (ret <= 0) {
+    if (ret < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        send_blocked_ = true;
+        return false;
+      }
     }
     MarkShutdown((ret == 0) ?
                  string("Remote end closed connection during write") :
                  string("Failed to write to socket"));
-    return;
+    return false;
   }
-  send_cmd_->io_size_remaining -= ret;
-  if (send_cmd_->io_size_remaining != 0) {
-    send_cmd_->cur_io_ptr = (void *)(((char *)send_cmd_->cur_io_ptr) + ret);
-    return;
+  send_blocked_ = false;
+  if (zc)
+    send_cmd_->zc = 1;
+  // A writev() may cover several segments of data_iov.
+  bool sent = false;
+  while (ret > 0) {
+    unsigned len = min<size_t>(ret, send_cmd_->io_size_remaining);
+    ret -= len;
+    sent = SentBytes(send_cmd_, len);
   }
-  if ((send_cmd_->cur_state == NBDCMD_STATE_SEND_READ_DATA) ||
-      (send_cmd_->ret_error != 0) ||
-      (send_cmd_->req.type != NBD_CMD_READ) ||
-      (send_cmd_->req.len == 0)) {
-    if (send_cmd_->data_buf) {
-      params_.free_data_mem(send_cmd_->data_buf);
-      send_cmd_->data_buf = nullptr;
+  if (sent) {
+    if (!ZcHold(send_cmd_)) {
+      List<NbdCmd> done(offsetof(NbdCmd, link));
+      done.PushBack(send_cmd_);
+      FreeSentCmds(&done);
     }
-    unique_lock<mutex> l(lock_);
-    cmd_cache_.Free(&l, send_cmd_);
     send_cmd_ = nullptr;
-    return;
   }
-  // Send read data.
-  assert(send_cmd_->cur_state == NBDCMD_STATE_SEND_REPLY);
-  send_cmd_->cur_state = NBDCMD_STATE_SEND_READ_DATA;
-  send_cmd_->cur_io_ptr = send_cmd_->data_buf;
-  send_cmd_->io_size_remaining = be32toh(send_cmd_->req.len);
+  return true;
+}
+
+bool NbdServer::PollSendBatched() {
+  if (stream_kick_)
+    stream_kick_ = false;
+  // Top up the batch with newly completed cmds.
+  NbdCmd *cmd;
+  while ((send_batch_.size() < send_batch_size_) &&
+         ((cmd = send_cmds_.Pop()) != nullptr)) {
+    NbdTrace(cmd, NBD_TRACE_SEND_START);
+    send_batch_.PushBack(cmd);
+  }
+  if (send_batch_.size() == 0)
+    return false;
+  cmd = send_batch_.First();
+  if (cmd->io_size_remaining == 0) {
+    // A streamed read waiting for its chunks.
+    if (StreamRefill(cmd)) {
+      send_batch_.PopFront();
+      if (!ZcHold(cmd)) {
+        List<NbdCmd> done(offsetof(NbdCmd, link));
+        done.PushBack(cmd);
+        FreeSentCmds(&done);
+      }
+      return true;
+    }
+    if (cmd->io_size_remaining == 0)
+      return false;
+  }
+  // Whatever is left of every cmd in the batch, in order. The first cmd
+  // may be partially sent already.
+  int iovcnt = 0;
+  bool zc = false;
+  for (NbdCmd *cmd = send_batch_.First(); cmd != nullptr;
+       cmd = send_batch_.Next(cmd)) {
+    // Room for the reply and all of the data, the first cmd always fits.
+    if (iovcnt + 1 + max(1U, cmd->data_iovcnt) > send_iov_size_)
+      break;
+    // One big read payload makes the whole writev() zerocopy.
+    zc |= ZcWanted(cmd);
+    if (cmd->cur_state == NBDCMD_STATE_SEND_READ_DATA) {
+      iovcnt += DataIov(cmd, &send_iov_[iovcnt]);
+    } else {
+      send_iov_[iovcnt].iov_base = cmd->cur_io_ptr;
+      send_iov_[iovcnt].iov_len = cmd->io_size_remaining;
+      iovcnt++;
+    }
+    // The rest of a streamed read has to wait for its chunks, so does
+    // everything behind it.
+    if (cmd->stream && (cmd->req.type == NBD_CMD_READ))
+      break;
+    if ((cmd->cur_state == NBDCMD_STATE_SEND_REPLY) && HasReadData(cmd)) {
+      if (cmd->data_iovcnt > 0) {
+        for (uint32_t i = 0; i < cmd->data_iovcnt; i++)
+          send_iov_[iovcnt++] = cmd->data_iov[i];
+      } else {
+        send_iov_[iovcnt].iov_base =
+            (char *)cmd->data_buf + cmd->reply_data_off;
+        send_iov_[iovcnt].iov_len = cmd->reply_data_len;
+        iovcnt++;
+      }
+    }
+  }
+  ssize_t ret = SendIov(send_iov_.get(), iovcnt, &zc);
+  if (ret <= 0) {
+    if (ret < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        send_blocked_ = true;
+        return false;
+      }
+    }
+    MarkShutdown((ret == 0) ?
+                 string("Remote end closed connection during write") :
+                 string("Failed to write to socket"));
+    return false;
+  }
+  send_blocked_ = false;
+  // Retire everything that made it onto the wire.
+  List<NbdCmd> done(offsetof(NbdCmd, link));
+  while (ret > 0) {
+    NbdCmd *cmd = send_batch_.First();
+    unsigned len = cmd->io_size_remaining;
+    if (len > ret)
+      len = ret;
+    ret -= len;
+    if (zc)
+      cmd->zc = 1;
+    if (SentBytes(cmd, len)) {
+      send_batch_.PopFront();
+      if (!ZcHold(cmd))
+        done.PushBack(cmd);
+    }
+  }
+  FreeSentCmds(&done);
+  return true;
 }
 
 bool NbdServer::ConfigPoll(time_t t) {
@@ -308,28 +1770,294 @@ bool NbdServer::ConfigPoll(time_t t) {
     return false;
   bool flg = false;
   if (!shutdown_ && config_running_.compare_exchange_weak(flg, true)) {
-    if ((last_config_run_ - t) > 0) {
+    if (t != last_config_run_) {
       last_config_run_ = t;
-      unique_lock<mutex> l(lock_);
-      cmd_cache_.HouseKeeping(&l, t);
+      cmd_cache_.HouseKeeping(t);
+      if (params_.housekeeping)
+        params_.housekeeping(params_.arg, t);
     }
     config_running_ = false;
   }
   return !shutdown_;
 }
 
-bool NbdServer::DataPoll() {
+bool NbdServer::DataPoll(bool *did_work) {
+  bool work = false;
+  if (did_work)
+    *did_work = false;
   if (shutdown_)
     return false;
-  bool flg = false;
-  if (!shutdown_ && rcv_running_.compare_exchange_weak(flg, true)) {
-    PollRecv();
-    rcv_running_ = false;
+  if (uring_) {
+    work = UringPoll();
+  } else {
+    bool flg = false;
+    if (!shutdown_ && rcv_running_.compare_exchange_weak(flg, true)) {
+      SubmitRetryReads();
+      work = PollRecv();
+      SubmitRcvBatch();
+      rcv_running_ = false;
+    }
+    // A failed exchange above leaves flg true.
     flg = false;
+    if (!shutdown_ && send_running_.compare_exchange_weak(flg, true)) {
+      work |= ZcReap();
+      work |= PollSend();
+      send_running_ = false;
+    }
   }
-  if (!shutdown_ && send_running_.compare_exchange_weak(flg, true)) {
-    PollSend();
-    send_running_ = false;
-  }
+  if (did_work)
+    *did_work = work;
   return !shutdown_;
 }
+
+int NbdServer::UringInit() {
+  uring_ = params_.uring;
+  if (!uring_) {
+    int st = NbdUring::New(kUringEntries, 0, &uring_);
+    if (st != 0) {
+      return st;
+    }
+  }
+  uring_buf_size_ = params_.rcv_buf_size ? params_.rcv_buf_size :
+                                           kUringRecvBufSize;
+  uring_bufs_.reset(new char[(size_t)uring_buf_size_ * kUringRecvBufs]);
+  unique_lock<mutex> l(uring_->lock());
+  uring_bgid_ = uring_->AllocBufGroup();
+  // Picked up by the first submit, before the receive is armed.
+  UringProvideBufs(0, kUringRecvBufs);
+  return 0;
+}
+
+void NbdServer::UringProvideBufs(uint16_t bid, unsigned count) {
+  struct io_uring_sqe *sqe = uring_->GetSqe();
+  if (sqe == nullptr) {
+    for (unsigned i = 0; i < count; i++)
+      uring_free_bids_.push_back(bid + i);
+    return;
+  }
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = count;
+  sqe->addr = (uint64_t)(uring_bufs_.get() + (size_t)bid * uring_buf_size_);
+  sqe->len = uring_buf_size_;
+  sqe->off = bid;
+  sqe->buf_group = uring_bgid_;
+  // Only failures post a completion.
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = (uint64_t)this | kUringTagBufs;
+}
+
+bool NbdServer::UringPoll() {
+  // rcv_running_ keeps the destructor waiting while we are in here, the
+  // ring lock serializes everything else.
+  bool flg = false;
+  if (!rcv_running_.compare_exchange_weak(flg, true))
+    return false;
+  unsigned reaped = 0;
+  unique_lock<mutex> l(uring_->lock(), try_to_lock);
+  if (l.owns_lock() && !shutdown_) {
+    // Completions of other servers on a shared ring are handled too.
+    reaped = uring_->Reap(UringDispatch);
+    SubmitRetryReads();
+    SubmitRcvBatch();
+    // Recycle consumed receive buffers. SQEs run in order, so they are
+    // back before a re-armed receive looks for one.
+    while (!uring_free_bids_.empty() && (uring_->SqSpace() > 1)) {
+      UringProvideBufs(uring_free_bids_.back(), 1);
+      uring_free_bids_.pop_back();
+    }
+    if (!uring_recv_armed_)
+      UringArmRecv();
+    UringSubmitSends();
+    int st = uring_->Submit();
+    if ((st != 0) && (st != EAGAIN) && (st != EBUSY))
+      MarkShutdown("Failed to submit to io_uring");
+  }
+  // Someone else, e.g. PrepareWait(), may have had the ring.
+  if (l.owns_lock())
+    l.unlock();
+  rcv_running_ = false;
+  return reaped > 0;
+}
+
+void NbdServer::UringArmRecv() {
+  struct io_uring_sqe *sqe = uring_->GetSqe();
+  if (sqe == nullptr)
+    return;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd_;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = uring_bgid_;
+  sqe->user_data = (uint64_t)this | kUringTagRecv;
+  uring_recv_armed_ = true;
+}
+
+void NbdServer::UringRecvDone(struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    uring_recv_armed_ = false;  // Re-armed by the next poll.
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buf = uring_bufs_.get() + (size_t)bid * uring_buf_size_;
+    if ((cqe->res > 0) && !shutdown_) {
+      // Cmds are never left half parsed, the cmd itself carries partial
+      // headers and payloads over to the next buffer.
+      if (ConsumeRcvBytes(buf, cqe->res) != (size_t)cqe->res)
+        MarkShutdown("Failed to allocate nbd cmd");
+    }
+    // The buffer is done with, the next poll provides it again.
+    uring_free_bids_.push_back(bid);
+    SubmitRcvBatch();
+  }
+  if (cqe->res == 0) {
+    MarkShutdown("Remote end closed connection during read");
+  } else if ((cqe->res < 0) && (cqe->res != -ENOBUFS) &&
+             (cqe->res != -ECANCELED)) {
+    MarkShutdown("Failed to read from socket");
+  }
+}
+
+void NbdServer::UringSubmitSends() {
+  if ((uring_sends_ > 0) || shutdown_ || send_cmds_.Empty())
+    return;
+  unsigned max_cmds = send_batch_size_ ? send_batch_size_ : kUringSendBatch;
+  struct io_uring_sqe *last = nullptr;
+  for (unsigned i = 0; (i < max_cmds) && (uring_->SqSpace() >= 2); i++) {
+    NbdCmd *cmd = send_cmds_.Pop();
+    if (cmd == nullptr)
+      break;
+    NbdTrace(cmd, NBD_TRACE_SEND_START);
+    // MSG_WAITALL makes every send complete in full or fail, which
+    // breaks the chain.
+    struct io_uring_sqe *sqe = uring_->GetSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd_;
+    sqe->addr = (uint64_t)cmd->reply;
+    sqe->len = cmd->reply_len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uint64_t)cmd | kUringTagSendReply;
+    last = sqe;
+    uring_sends_++;
+    if (!HasReadData(cmd))
+      continue;
+    sqe = uring_->GetSqe();
+    sqe->opcode = IORING_OP_SEND;
+    if (ZcWanted(cmd)) {
+      // Posts a second completion, with IORING_CQE_F_NOTIF, once the
+      // kernel is done with data_buf.
+      sqe->opcode = IORING_OP_SEND_ZC;
+      sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+    }
+    sqe->fd = fd_;
+    sqe->addr = (uint64_t)((char *)cmd->data_buf + cmd->reply_data_off);
+    sqe->len = cmd->reply_data_len;
+    if (cmd->data_iovcnt > 0) {
+      // The msghdr has to stay put until the send completes.
+      struct msghdr *msg = &cmd->iov_store->msg;
+      bzero(msg, sizeof(*msg));
+      msg->msg_iov = cmd->data_iov;
+      msg->msg_iovlen = cmd->data_iovcnt;
+      sqe->opcode = (sqe->opcode == IORING_OP_SEND_ZC) ?
+                    IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+      sqe->addr = (uint64_t)msg;
+      sqe->len = 1;
+    }
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uint64_t)cmd | kUringTagSendData;
+    last = sqe;
+    uring_sends_++;
+  }
+  if (last)
+    last->flags &= ~IOSQE_IO_LINK;
+}
+
+void NbdServer::UringSendDone(NbdCmd *cmd, bool data,
+                              struct io_uring_cqe *cqe) {
+  if (cqe->flags & IORING_CQE_F_NOTIF) {
+    uring_notifs_--;
+    // The kernel had to copy anyway, pinning pages only costs us.
+    if (cqe->res & IORING_NOTIF_USAGE_ZC_COPIED)
+      zc_threshold_ = 0;
+  } else {
+    uring_sends_--;
+    int expected = data ? cmd->reply_data_len : cmd->reply_len;
+    if ((cqe->res != expected) && !shutdown_) {
+      MarkShutdown((cqe->res >= 0) ?
+                   string("Remote end closed connection during write") :
+                   string("Failed to write to socket"));
+    }
+    // A broken chain still completes every SQE (with -ECANCELED), so the
+    // cmd is released on the completion of its last SQE either way.
+    if (!data && HasReadData(cmd))
+      return;
+    if (cqe->flags & IORING_CQE_F_MORE) {
+      uring_notifs_++;
+      return;
+    }
+  }
+  NbdTrace(cmd, NBD_TRACE_DONE);
+  if (stats_) {
+    stats_->Replied(cmd->rcv_type, cmd->ret_error, cmd->rcv_ticks,
+                    cmd->submit_ticks, cmd->done_ticks);
+  }
+  FreeData(cmd);
+  cmd_cache_.Free(&send_mags_, cmd);
+}
+
+// static
+void NbdServer::UringDispatch(struct io_uring_cqe *cqe) {
+  uint64_t tag = cqe->user_data & kUringTagMask;
+  void *ptr = (void *)(cqe->user_data & ~kUringTagMask);
+  switch (tag) {
+    case kUringTagRecv:
+      ((NbdServer *)ptr)->UringRecvDone(cqe);
+      break;
+    case kUringTagSendReply:
+    case kUringTagSendData: {
+      NbdCmd *cmd = (NbdCmd *)ptr;
+      cmd->server->UringSendDone(cmd, tag == kUringTagSendData, cqe);
+      break;
+    }
+    case kUringTagCancel:
+      ((NbdServer *)ptr)->uring_cancel_done_ = true;
+      break;
+    case kUringTagBufs:
+      ((NbdServer *)ptr)->MarkShutdown("Failed to provide receive buffers");
+      break;
+  }
+}
+
+void NbdServer::UringDrain() {
+  while (1) {
+    unique_lock<mutex> l(uring_->lock());
+    if (!uring_cancel_sent_) {
+      struct io_uring_sqe *sqe = uring_->GetSqe();
+      if (sqe != nullptr) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd_;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = (uint64_t)this | kUringTagCancel;
+        uring_cancel_sent_ = true;
+      }
+    }
+    uring_->Submit();
+    uring_->Reap(UringDispatch);
+    if (uring_cancel_done_ && !uring_recv_armed_ && (uring_sends_ == 0) &&
+        (uring_notifs_ == 0))
+      break;
+    l.unlock();
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  // Take back whatever buffers the kernel still holds, no completion
+  // needed as the group is never used again.
+  unique_lock<mutex> l(uring_->lock());
+  struct io_uring_sqe *sqe = uring_->GetSqe();
+  if (sqe != nullptr) {
+    sqe->opcode = IORING_OP_REMOVE_BUFFERS;
+    sqe->fd = kUringRecvBufs;
+    sqe->buf_group = uring_bgid_;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    uring_->Submit();
+  }
+}
@@ -0,0 +1,153 @@
+#include "nbd_stats.h"
+
+#include <math.h>
+#include <linux/nbd.h>
+
+#include <algorithm>
+
+namespace {
+
+uint64_t MonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Clock ticks and ns at the first use, the tick rate is measured against
+// it.
+struct ClockAnchor {
+  ClockAnchor() : ticks(NbdStatsCounters::Now()), ns(MonotonicNs()) {}
+  uint64_t ticks;
+  uint64_t ns;
+};
+
+ClockAnchor *Anchor() {
+  static ClockAnchor anchor;
+  return &anchor;
+}
+
+}  // anonymous namespace
+
+// static
+void NbdStatsCounters::StartClock() {
+  Anchor();
+}
+
+// static
+double NbdStatsCounters::NsPerTick() {
+#if defined(__x86_64__) || defined(__i386__)
+  ClockAnchor *anchor = Anchor();
+  // 10ms is plenty for a precise rate, only a call right after the
+  // clock was started waits for it.
+  uint64_t ns;
+  while ((ns = MonotonicNs()) - anchor->ns < 10000000)
+    ;
+  uint64_t ticks = NbdStatsCounters::Now();
+  return (double)(ns - anchor->ns) / (ticks - anchor->ticks);
+#else
+  return 1.0;
+#endif
+}
+
+// static
+uint64_t NbdHistogram::BucketStart(unsigned bucket) {
+  if (bucket < (1U << NBD_HIST_SUB_BITS))
+    return bucket;
+  unsigned shift = (bucket >> NBD_HIST_SUB_BITS) - 1;
+  uint64_t sub = bucket & ((1U << NBD_HIST_SUB_BITS) - 1);
+  return ((1ULL << NBD_HIST_SUB_BITS) + sub) << shift;
+}
+
+uint64_t NbdHistogram::Percentile(double pct) const {
+  if (count == 0)
+    return 0;
+  uint64_t target = max<uint64_t>(1, ceil(pct / 100 * count));
+  uint64_t seen = 0;
+  for (unsigned b = 0; b < NBD_HIST_BUCKETS - 1; b++) {
+    seen += counts[b];
+    if (seen >= target)
+      return min(max_ns, BucketStart(b + 1) - 1);
+  }
+  return max_ns;
+}
+
+void NbdHistogram::Add(const NbdHistogram &other) {
+  for (unsigned b = 0; b < NBD_HIST_BUCKETS; b++)
+    counts[b] += other.counts[b];
+  count += other.count;
+  sum_ns += other.sum_ns;
+  max_ns = max(max_ns, other.max_ns);
+}
+
+void NbdStats::Add(const NbdStats &other) {
+  for (unsigned op = 0; op < NBD_STATS_OPS; op++) {
+    ops[op].ops += other.ops[op].ops;
+    ops[op].bytes += other.ops[op].bytes;
+    ops[op].errors += other.ops[op].errors;
+  }
+  inflight += other.inflight;
+  max_inflight += other.max_inflight;
+  for (unsigned p = 0; p < NBD_NUM_PHASES; p++)
+    latency[p].Add(other.latency[p]);
+}
+
+NbdStatsCounters::NbdStatsCounters() {
+  StartClock();
+  for (unsigned op = 0; op < NBD_STATS_OPS; op++) {
+    rcvd_ops_[op] = 0;
+    rcvd_bytes_[op] = 0;
+    replied_ops_[op] = 0;
+    errors_[op] = 0;
+  }
+  max_inflight_ = 0;
+  for (Hist *h : {&recv_, &backend_, &send_, &total_}) {
+    for (unsigned b = 0; b < NBD_HIST_BUCKETS; b++)
+      h->counts[b] = 0;
+    h->sum = 0;
+    h->max = 0;
+  }
+}
+
+uint64_t NbdStatsCounters::Inflight() {
+  // A disconnect gets no reply.
+  uint64_t rcvd = 0;
+  uint64_t replied = 0;
+  for (unsigned op = 0; op < NBD_STATS_OPS; op++) {
+    if (op != NBD_CMD_DISC)
+      rcvd += rcvd_ops_[op].load(memory_order_relaxed);
+    replied += replied_ops_[op].load(memory_order_relaxed);
+  }
+  return (rcvd > replied) ? rcvd - replied : 0;
+}
+
+void NbdStatsCounters::Snapshot(NbdStats *stats) {
+  *stats = NbdStats();
+  for (unsigned op = 0; op < NBD_STATS_OPS; op++) {
+    stats->ops[op].ops = rcvd_ops_[op].load(memory_order_relaxed);
+    stats->ops[op].bytes = rcvd_bytes_[op].load(memory_order_relaxed);
+    stats->ops[op].errors = errors_[op].load(memory_order_relaxed);
+  }
+  stats->inflight = Inflight();
+  stats->max_inflight = max_inflight_.load(memory_order_relaxed);
+  double ns_per_tick = NsPerTick();
+  recv_.Snapshot(ns_per_tick, &stats->latency[NBD_PHASE_RECV]);
+  backend_.Snapshot(ns_per_tick, &stats->latency[NBD_PHASE_BACKEND]);
+  send_.Snapshot(ns_per_tick, &stats->latency[NBD_PHASE_SEND]);
+  total_.Snapshot(ns_per_tick, &stats->latency[NBD_PHASE_TOTAL]);
+}
+
+void NbdStatsCounters::Hist::Snapshot(double ns_per_tick,
+                                      NbdHistogram *hist) {
+  // Each bucket of ticks moves to the ns bucket of its middle.
+  for (unsigned b = 0; b < NBD_HIST_BUCKETS; b++) {
+    uint64_t n = counts[b].load(memory_order_relaxed);
+    if (n == 0)
+      continue;
+    uint64_t start = NbdHistogram::BucketStart(b);
+    uint64_t mid = start + (NbdHistogram::BucketStart(b + 1) - start) / 2;
+    hist->counts[NbdHistogram::Bucket(mid * ns_per_tick)] += n;
+    hist->count += n;
+  }
+  hist->sum_ns = sum.load(memory_order_relaxed) * ns_per_tick;
+  hist->max_ns = max.load(memory_order_relaxed) * ns_per_tick;
+}
@@ -0,0 +1,238 @@
+#include "nbd_trace.h"
+
+#include "nbd_server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+atomic<bool> g_nbd_trace_on(false);
+
+namespace {
+
+struct TraceEvent {
+  uint64_t ticks;
+  uint64_t handle;
+  uint64_t offset;
+  const void *server;
+  uint32_t size;
+  uint8_t type;
+  uint8_t event;
+};
+
+// The ring of one thread. Only the owner writes, head is the number of
+// events it has written.
+struct TraceRing {
+  unique_ptr<TraceEvent[]> events;
+  uint64_t mask;
+  atomic<uint64_t> head;
+  uint64_t gen;  // Of the NbdTraceStart() it was created after.
+  pid_t tid;
+  bool owned;  // False once the thread is gone or got a new ring.
+};
+
+// Slice names, by the event which starts the slice.
+const char *kSliceNames[NBD_TRACE_NUM_EVENTS] = {
+  "RCV_REQ", "RCV_WRITE_DATA", "CMD_SUBMITTED", "SEND_REPLY queued",
+  "SEND_REPLY", "SEND_READ_DATA", "DONE",
+};
+
+const char *kOpNames[] = {
+  "READ", "WRITE", "DISC", "FLUSH", "TRIM", "CACHE", "WRITE_ZEROES",
+};
+
+mutex g_trace_lock;
+vector<unique_ptr<TraceRing>> g_rings;
+uint64_t g_ring_events;
+atomic<uint64_t> g_trace_gen(0);
+
+// Drops a ring nobody writes to any more, unless a dump still wants it.
+void ReleaseRing(TraceRing *ring) {
+  unique_lock<mutex> l(g_trace_lock);
+  ring->owned = false;
+  if (ring->gen == g_trace_gen.load(memory_order_relaxed))
+    return;
+  for (auto it = g_rings.begin(); it != g_rings.end(); ++it) {
+    if (it->get() == ring) {
+      g_rings.erase(it);
+      break;
+    }
+  }
+}
+
+struct ThreadRing {
+  ~ThreadRing() {
+    if (ring)
+      ReleaseRing(ring);
+  }
+  TraceRing *ring = nullptr;
+};
+
+thread_local ThreadRing t_ring;
+
+TraceRing *NewRing() {
+  if (t_ring.ring) {
+    ReleaseRing(t_ring.ring);
+    t_ring.ring = nullptr;
+  }
+  unique_lock<mutex> l(g_trace_lock);
+  if (g_ring_events == 0)
+    return nullptr;
+  unique_ptr<TraceRing> ring(new TraceRing());
+  ring->events.reset(new (nothrow) TraceEvent[g_ring_events]);
+  if (!ring->events)
+    return nullptr;
+  ring->mask = g_ring_events - 1;
+  ring->head = 0;
+  ring->gen = g_trace_gen.load(memory_order_relaxed);
+  ring->tid = syscall(SYS_gettid);
+  ring->owned = true;
+  t_ring.ring = ring.get();
+  g_rings.push_back(move(ring));
+  return t_ring.ring;
+}
+
+struct DumpEvent {
+  TraceEvent ev;
+  pid_t tid;
+};
+
+}  // anonymous namespace
+
+int NbdTraceStart(unsigned ring_events) {
+  if (ring_events == 0)
+    return EINVAL;
+  NbdStatsCounters::StartClock();
+  unique_lock<mutex> l(g_trace_lock);
+  uint64_t n = 1;
+  while (n < ring_events)
+    n <<= 1;
+  g_ring_events = n;
+  // Threads move to new rings as they record their next event, the ones
+  // of threads which are gone can go right away.
+  g_trace_gen.fetch_add(1, memory_order_relaxed);
+  g_rings.erase(remove_if(g_rings.begin(), g_rings.end(),
+                          [](const unique_ptr<TraceRing> &ring) {
+                            return !ring->owned;
+                          }),
+                g_rings.end());
+  g_nbd_trace_on.store(true, memory_order_relaxed);
+  return 0;
+}
+
+void NbdTraceStop() {
+  g_nbd_trace_on.store(false, memory_order_relaxed);
+}
+
+void NbdTraceRecord(const NbdCmd *cmd, uint8_t event) {
+  // Would land on the track of whichever request had the handle before.
+  if (cmd->internal)
+    return;
+  TraceRing *ring = t_ring.ring;
+  if ((ring == nullptr) ||
+      (ring->gen != g_trace_gen.load(memory_order_relaxed))) {
+    ring = NewRing();
+    if (ring == nullptr)
+      return;
+  }
+  uint64_t head = ring->head.load(memory_order_relaxed);
+  TraceEvent *ev = &ring->events[head & ring->mask];
+  ev->ticks = NbdStatsCounters::Now();
+  memcpy(&ev->handle, cmd->req.handle, sizeof(ev->handle));
+  ev->offset = cmd->io_offset;
+  ev->server = cmd->server;
+  ev->size = cmd->io_size;
+  ev->type = cmd->rcv_type;
+  ev->event = event;
+  ring->head.store(head + 1, memory_order_release);
+}
+
+int NbdTraceDump(const string &path) {
+  vector<DumpEvent> events;
+  {
+    unique_lock<mutex> l(g_trace_lock);
+    uint64_t gen = g_trace_gen.load(memory_order_relaxed);
+    for (auto &ring : g_rings) {
+      if (ring->gen != gen)
+        continue;
+      uint64_t size = ring->mask + 1;
+      uint64_t head = ring->head.load(memory_order_acquire);
+      uint64_t first = (head > size) ? head - size : 0;
+      size_t start = events.size();
+      for (uint64_t i = first; i < head; i++)
+        events.push_back({ring->events[i & ring->mask], ring->tid});
+      // Whatever the owner got to overwrite meanwhile is torn, and so is
+      // the slot it may be writing right now.
+      head = ring->head.load(memory_order_acquire);
+      if (head + 1 > first + size) {
+        uint64_t torn = min(head + 1 - first - size,
+                            (uint64_t)(events.size() - start));
+        events.erase(events.begin() + start,
+                     events.begin() + start + torn);
+      }
+    }
+  }
+  // The events of a cmd one after the other, each starts a slice which
+  // the next one ends.
+  stable_sort(events.begin(), events.end(),
+              [](const DumpEvent &a, const DumpEvent &b) {
+                if (a.ev.server != b.ev.server)
+                  return a.ev.server < b.ev.server;
+                if (a.ev.handle != b.ev.handle)
+                  return a.ev.handle < b.ev.handle;
+                return a.ev.ticks < b.ev.ticks;
+              });
+  uint64_t base = UINT64_MAX;
+  for (auto &e : events)
+    base = min(base, e.ev.ticks);
+  double us_per_tick = NbdStatsCounters::NsPerTick() / 1000;
+  map<const void *, unsigned> servers;
+
+  FILE *f = fopen(path.c_str(), "w");
+  if (f == nullptr)
+    return errno;
+  pid_t pid = getpid();
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  bool first = true;
+  for (size_t i = 0; i < events.size(); i++) {
+    const TraceEvent &ev = events[i].ev;
+    if ((ev.event == NBD_TRACE_DONE) || (ev.event >= NBD_TRACE_NUM_EVENTS))
+      continue;
+    unsigned server =
+        servers.emplace(ev.server, servers.size()).first->second;
+    const char *op = (ev.type < sizeof(kOpNames) / sizeof(kOpNames[0])) ?
+                     kOpNames[ev.type] : "UNKNOWN";
+    fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"nbd\",\"ph\":\"b\","
+            "\"id\":\"%u.%lx\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+            "\"args\":{\"op\":\"%s\",\"handle\":\"%lx\",\"offset\":%lu,"
+            "\"size\":%u,\"conn\":%u}}",
+            first ? "" : ",\n", kSliceNames[ev.event], server, ev.handle,
+            pid, events[i].tid, (ev.ticks - base) * us_per_tick, op,
+            ev.handle, ev.offset, ev.size, server);
+    first = false;
+    // Left open if this was the last state the cmd got to.
+    if ((i + 1 < events.size()) &&
+        (events[i + 1].ev.server == ev.server) &&
+        (events[i + 1].ev.handle == ev.handle) &&
+        (events[i + 1].ev.event > ev.event)) {
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"nbd\",\"ph\":\"e\","
+              "\"id\":\"%u.%lx\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+              kSliceNames[ev.event], server, ev.handle, pid,
+              events[i + 1].tid,
+              (events[i + 1].ev.ticks - base) * us_per_tick);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  int st = ferror(f) ? EIO : 0;
+  if ((fclose(f) != 0) && (st == 0))
+    st = errno;
+  return st;
+}
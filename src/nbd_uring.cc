@@ -0,0 +1,127 @@
+#include "nbd_uring.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+NbdUring::~NbdUring() {
+  if (sqes_ != nullptr)
+    munmap(sqes_, sqes_size_);
+  if ((cq_ring_ != nullptr) && (cq_ring_ != sq_ring_))
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != nullptr)
+    munmap(sq_ring_, sq_ring_size_);
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+// static
+int NbdUring::New(unsigned entries, unsigned setup_flags,
+                  shared_ptr<NbdUring> *ret_ring) {
+  shared_ptr<NbdUring> ring(new NbdUring());
+
+  bzero(&ring->params_, sizeof(ring->params_));
+  ring->params_.flags = setup_flags | IORING_SETUP_CQSIZE;
+  ring->params_.cq_entries = entries * 4;
+  ring->fd_ = syscall(__NR_io_uring_setup, entries, &ring->params_);
+  if (ring->fd_ < 0) {
+    return errno;
+  }
+  struct io_uring_params &p = ring->params_;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    return ENOTSUP;
+  }
+  ring->sqe_shift_ = (setup_flags & IORING_SETUP_SQE128) ? 7 : 6;
+  ring->sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size_ = p.cq_off.cqes +
+                        p.cq_entries * sizeof(struct io_uring_cqe);
+  // With a single mmap, SQ and CQ rings share one mapping.
+  ring->sq_ring_size_ = max(ring->sq_ring_size_, ring->cq_ring_size_);
+  ring->sq_ring_ = mmap(nullptr, ring->sq_ring_size_,
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd_, IORING_OFF_SQ_RING);
+  if (ring->sq_ring_ == MAP_FAILED) {
+    ring->sq_ring_ = nullptr;
+    return errno;
+  }
+  ring->cq_ring_ = ring->sq_ring_;
+  ring->sqes_size_ = p.sq_entries << ring->sqe_shift_;
+  void *sqes = mmap(nullptr, ring->sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return errno;
+  }
+  ring->sqes_ = (char *)sqes;
+
+  char *sq = (char *)ring->sq_ring_;
+  ring->sq_head_ = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail_ = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask_ = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_flags_ = (unsigned *)(sq + p.sq_off.flags);
+  ring->sq_array_ = (unsigned *)(sq + p.sq_off.array);
+  ring->sq_local_tail_ = ring->sq_submitted_ = *ring->sq_tail_;
+  char *cq = (char *)ring->cq_ring_;
+  ring->cq_head_ = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail_ = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask_ = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes_ = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  *ret_ring = move(ring);
+  return 0;
+}
+
+unsigned NbdUring::SqSpace() {
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  return params_.sq_entries - (sq_local_tail_ - head);
+}
+
+struct io_uring_sqe *NbdUring::GetSqe() {
+  if (SqSpace() == 0)
+    return nullptr;
+  unsigned idx = sq_local_tail_ & *sq_mask_;
+  struct io_uring_sqe *sqe =
+      (struct io_uring_sqe *)(sqes_ + ((size_t)idx << sqe_shift_));
+  bzero(sqe, 1 << sqe_shift_);
+  sq_array_[idx] = idx;
+  sq_local_tail_++;
+  return sqe;
+}
+
+int NbdUring::Enter(unsigned to_submit, unsigned min_complete,
+                    unsigned flags) {
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags,
+                  nullptr, 0);
+  } while ((ret < 0) && (errno == EINTR));
+  return (ret < 0) ? -errno : ret;
+}
+
+int NbdUring::Submit() {
+  unsigned to_submit = SqPending();
+  if (to_submit == 0)
+    return 0;
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  int ret = Enter(to_submit, 0, 0);
+  if (ret < 0)
+    return -ret;
+  // The kernel may take fewer, the rest go with the next call.
+  sq_submitted_ += ret;
+  return 0;
+}
+
+int NbdUring::Wait() {
+  unsigned head = *cq_head_;
+  if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+    return 0;
+  int ret = Enter(0, 1, IORING_ENTER_GETEVENTS);
+  return (ret < 0) ? -ret : 0;
+}
+
+uint16_t NbdUring::AllocBufGroup() {
+  return next_bgid_++;
+}
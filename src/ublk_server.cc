@@ -0,0 +1,453 @@
+#include "ublk_server.h"
+#include "nbd_uring.h"
+#include <unistd.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#include <chrono>
+
+namespace {
+
+static constexpr unsigned kUblkCtrlEntries = 4;
+
+#ifndef UBLK_F_CMD_IOCTL_ENCODE
+#define UBLK_F_CMD_IOCTL_ENCODE	(1ULL << 6)
+#endif
+
+static void UblkCompletionCb(NbdCmd *cmd) {
+  cmd->ublk_queue->CompletionCb(cmd);
+}
+
+static size_t RoundUpToPage(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (size + page - 1) & ~(page - 1);
+}
+
+}  // anonymous namespace
+
+UblkQueue::UblkQueue(UblkServer *dev, unsigned q_id) :
+    dev_(dev), q_id_(q_id),
+    done_cmds_(offsetof(NbdCmd, send_link)),
+    commit_cmds_(offsetof(NbdCmd, link)) {
+  pending_backend_cmds_ = 0;
+  owner_ = thread::id();
+}
+
+UblkQueue::~UblkQueue() {
+  // Closing the ring cancels the fetches still held by the kernel.
+  ring_.reset();
+  if (descs_ != nullptr) {
+    munmap(descs_, descs_size_);
+    descs_ = nullptr;
+  }
+  if (cmds_) {
+    for (unsigned tag = 0; tag < dev_->params_.queue_depth; tag++) {
+      if (cmds_[tag].data_buf != nullptr)
+        dev_->params_.free_data_mem(cmds_[tag].data_buf);
+    }
+  }
+}
+
+int UblkQueue::Init() {
+  const NbdParams &params = dev_->params_;
+  int st = NbdUring::New(params.queue_depth, 0, &ring_);
+  if (st != 0) {
+    return st;
+  }
+  size_t desc_size = sizeof(struct ublksrv_io_desc);
+  descs_size_ = RoundUpToPage(params.queue_depth * desc_size);
+  off_t off = UBLKSRV_CMD_BUF_OFFSET +
+              q_id_ * RoundUpToPage(UBLK_MAX_QUEUE_DEPTH * desc_size);
+  void *descs = mmap(nullptr, descs_size_, PROT_READ,
+                     MAP_SHARED | MAP_POPULATE, dev_->cdev_fd_, off);
+  if (descs == MAP_FAILED) {
+    return errno;
+  }
+  descs_ = (struct ublksrv_io_desc *)descs;
+  // The buffers stay with their tag for the life of the queue, the
+  // kernel copies write data in before and read data out after each
+  // request.
+  cmds_.reset(new NbdCmd[params.queue_depth]);
+  for (unsigned tag = 0; tag < params.queue_depth; tag++) {
+    NbdCmd *cmd = &cmds_[tag];
+    cmd->server = nullptr;
+    cmd->ublk_queue = this;
+    cmd->completion_cb = UblkCompletionCb;
+    cmd->arg = params.arg;
+    cmd->data_buf = params.alloc_data_mem(dev_->max_io_size_);
+    if (cmd->data_buf == nullptr) {
+      return ENOMEM;
+    }
+  }
+  return 0;
+}
+
+void UblkQueue::CompletionCb(NbdCmd *cmd) {
+  done_cmds_.Push(cmd);
+  // See NbdServer::CompletionCb().
+  if (wakeup_sleepers_ && (*wakeup_sleepers_ > 0))
+    eventfd_write(wakeup_fd_, 1);
+  // Has to be last, the queue may be deleted as soon as this hits 0.
+  pending_backend_cmds_--;
+}
+
+void UblkQueue::CompletionCb(NbdCmd **cmds, unsigned n) {
+  done_cmds_.PushBatch(cmds, n);
+  if (wakeup_sleepers_ && (*wakeup_sleepers_ > 0))
+    eventfd_write(wakeup_fd_, 1);
+  pending_backend_cmds_ -= n;
+}
+
+bool UblkQueue::QueueIoCmd(unsigned tag, uint32_t op, int32_t result) {
+  struct io_uring_sqe *sqe = ring_->GetSqe();
+  if (sqe == nullptr)
+    return false;
+  sqe->opcode = IORING_OP_URING_CMD;
+  sqe->fd = dev_->cdev_fd_;
+  sqe->cmd_op = dev_->ioctl_encode_ ?
+                _IOWR('u', op, struct ublksrv_io_cmd) : op;
+  sqe->user_data = tag;
+  struct ublksrv_io_cmd *io_cmd = (struct ublksrv_io_cmd *)sqe->cmd;
+  io_cmd->q_id = q_id_;
+  io_cmd->tag = tag;
+  io_cmd->result = result;
+  io_cmd->addr = (uint64_t)cmds_[tag].data_buf;
+  return true;
+}
+
+void UblkQueue::RcvdReq(unsigned tag) {
+  const struct ublksrv_io_desc *iod = &descs_[tag];
+  const NbdParams &params = dev_->params_;
+  NbdCmd *cmd = &cmds_[tag];
+  cmd->cur_state = NBDCMD_STATE_CMD_SUBMITTED;
+  cmd->ret_error = 0;
+  cmd->fua = (iod->op_flags & UBLK_IO_F_FUA) ? 1 : 0;
+  cmd->no_hole = (iod->op_flags & UBLK_IO_F_NOUNMAP) ? 1 : 0;
+  cmd->io_offset = iod->start_sector << 9;
+  cmd->io_size = iod->nr_sectors << 9;
+  // Same as what an nbd request would carry, for backends looking at it.
+  cmd->req.from = htobe64(cmd->io_offset);
+  cmd->req.len = htobe32(cmd->io_size);
+  pending_backend_cmds_++;
+  switch (ublksrv_get_op(iod)) {
+    case UBLK_IO_OP_READ:
+      cmd->req.type = NBD_CMD_READ;
+      break;
+    case UBLK_IO_OP_WRITE:
+      cmd->req.type = NBD_CMD_WRITE;
+      break;
+    case UBLK_IO_OP_FLUSH:
+      cmd->req.type = NBD_CMD_FLUSH;
+      break;
+    case UBLK_IO_OP_DISCARD:
+      cmd->req.type = NBD_CMD_TRIM;
+      break;
+    case UBLK_IO_OP_WRITE_ZEROES:
+      if (params.write_zeroes) {
+        cmd->req.type = NBD_CMD_WRITE_ZEROES;
+        break;
+      }
+      cmd->ret_error = EOPNOTSUPP;
+      CompletionCb(cmd);
+      return;
+    default:
+      cmd->ret_error = EOPNOTSUPP;
+      CompletionCb(cmd);
+      return;
+  }  // switch (op)
+  if (params.submit_batch) {
+    rcv_batch_.push_back(cmd);
+    return;
+  }
+  switch (cmd->req.type) {
+    case NBD_CMD_READ:
+      params.read(cmd->arg, cmd);
+      break;
+    case NBD_CMD_WRITE:
+      params.write(cmd->arg, cmd);
+      break;
+    case NBD_CMD_FLUSH:
+      params.flush(cmd->arg, cmd);
+      break;
+    case NBD_CMD_TRIM:
+      params.trim(cmd->arg, cmd);
+      break;
+    case NBD_CMD_WRITE_ZEROES:
+      params.write_zeroes(cmd->arg, cmd);
+      break;
+  }  // switch (cmd->req.type)
+}
+
+bool UblkQueue::DataPoll(bool *did_work) {
+  if (did_work)
+    *did_work = false;
+  if (shutdown_)
+    return false;
+  thread::id self = this_thread::get_id();
+  thread::id none;
+  if ((owner_ != self) && !owner_.compare_exchange_strong(none, self))
+    return true;
+  unsigned work = 0;
+  if (!fetched_) {
+    // The SQ has room for every tag.
+    for (unsigned tag = 0; tag < dev_->params_.queue_depth; tag++)
+      QueueIoCmd(tag, UBLK_IO_FETCH_REQ, -1);
+    fetched_ = true;
+  }
+  work += ring_->Reap([this](struct io_uring_cqe *cqe) {
+      if (cqe->res == UBLK_IO_RES_OK) {
+        RcvdReq(cqe->user_data);
+      } else if (cqe->res != UBLK_IO_RES_ABORT) {
+        // ABORT just means the device is going away.
+        shutdown_ = true;
+      }
+    });
+  if (!rcv_batch_.empty()) {
+    dev_->params_.submit_batch(dev_->params_.arg, rcv_batch_.data(),
+                               rcv_batch_.size());
+    rcv_batch_.clear();
+  }
+  NbdCmd *cmd;
+  while ((cmd = done_cmds_.Pop()) != nullptr)
+    commit_cmds_.PushBack(cmd);
+  while ((cmd = commit_cmds_.First()) != nullptr) {
+    int32_t result = 0;
+    if (cmd->ret_error != 0) {
+      result = -(int32_t)cmd->ret_error;
+    } else if ((cmd->req.type == NBD_CMD_READ) ||
+               (cmd->req.type == NBD_CMD_WRITE)) {
+      result = cmd->io_size;
+    }
+    if (!QueueIoCmd(cmd - cmds_.get(), UBLK_IO_COMMIT_AND_FETCH_REQ, result))
+      break;
+    commit_cmds_.PopFront();
+    work++;
+  }
+  int st = ring_->Submit();
+  if ((st != 0) && (st != EAGAIN) && (st != EBUSY))
+    shutdown_ = true;
+  if (did_work)
+    *did_work = (work > 0);
+  return !shutdown_;
+}
+
+bool UblkQueue::PrepareWait(int *fd, uint32_t *events) {
+  *fd = ring_->fd();
+  if (shutdown_) {
+    *events = 0;
+    return true;
+  }
+  if (!fetched_ || !done_cmds_.Empty() || (commit_cmds_.size() > 0))
+    return false;
+  *events = EPOLLIN;
+  return true;
+}
+
+UblkServer::UblkServer(const NbdParams &params) : params_(params) {
+  max_io_size_ = params.max_io_size;
+}
+
+UblkServer::~UblkServer() {
+  Stop();
+  for (auto &queue : queues_) {
+    queue->shutdown_ = true;
+    while (queue->pending_backend_cmds_ > 0)
+      this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  queues_.clear();
+  if (cdev_fd_ >= 0) {
+    close(cdev_fd_);
+    cdev_fd_ = -1;
+  }
+  if (added_) {
+    // Waits for the kernel to let go of the char device.
+    CtrlCmd(UBLK_CMD_DEL_DEV, 0, 0, 0, true);
+    added_ = false;
+  }
+  ctrl_ring_.reset();
+  if (ctrl_fd_ >= 0) {
+    close(ctrl_fd_);
+    ctrl_fd_ = -1;
+  }
+}
+
+// static
+int UblkServer::New(const NbdParams &params, int dev_id,
+                    unique_ptr<UblkServer> *ret_server) {
+  if ((params.queue_depth == 0) ||
+      (params.queue_depth > UBLK_MAX_QUEUE_DEPTH)) {
+    return EINVAL;
+  }
+  unique_ptr<UblkServer> server(new UblkServer(params));
+  int st = server->Init(dev_id);
+  if (st != 0) {
+    return st;
+  }
+  *ret_server = move(server);
+  return 0;
+}
+
+int UblkServer::Init(int dev_id) {
+  ctrl_fd_ = open("/dev/ublk-control", O_RDWR | O_CLOEXEC);
+  if (ctrl_fd_ < 0) {
+    system("/sbin/modprobe ublk_drv >/dev/null 2>&1");
+    ctrl_fd_ = open("/dev/ublk-control", O_RDWR | O_CLOEXEC);
+    if (ctrl_fd_ < 0) {
+      return errno;
+    }
+  }
+
+  struct ublksrv_ctrl_dev_info info;
+  bzero(&info, sizeof(info));
+  info.nr_hw_queues = params_.num_connections;
+  info.queue_depth = params_.queue_depth;
+  info.max_io_buf_bytes = max_io_size_;
+  info.dev_id = dev_id;
+  info.ublksrv_pid = getpid();
+  info.flags = UBLK_F_CMD_IOCTL_ENCODE;
+  dev_id_ = dev_id;
+  int st = CtrlCmd(UBLK_CMD_ADD_DEV, (uint64_t)&info, sizeof(info), 0, true);
+  if (st != 0) {
+    // Older kernels only take the plain opcodes.
+    ioctl_encode_ = false;
+    info.flags = 0;
+    st = CtrlCmd(UBLK_CMD_ADD_DEV, (uint64_t)&info, sizeof(info), 0, true);
+    if (st != 0) {
+      return st;
+    }
+  }
+  added_ = true;
+  dev_id_ = info.dev_id;
+  // The driver caps the buffer size.
+  if ((info.max_io_buf_bytes > 0) && (info.max_io_buf_bytes < max_io_size_))
+    max_io_size_ = info.max_io_buf_bytes;
+
+  struct ublk_params p;
+  bzero(&p, sizeof(p));
+  p.len = sizeof(p);
+  p.types = UBLK_PARAM_TYPE_BASIC | UBLK_PARAM_TYPE_DISCARD;
+  // Backends get flush and FUA, same as with nbd.
+  p.basic.attrs = UBLK_ATTR_VOLATILE_CACHE | UBLK_ATTR_FUA;
+  uint8_t bs_shift = __builtin_ctz(params_.block_size);
+  p.basic.logical_bs_shift = bs_shift;
+  p.basic.physical_bs_shift = bs_shift;
+  p.basic.io_min_shift = bs_shift;
+  p.basic.io_opt_shift = bs_shift;
+  p.basic.max_sectors = max_io_size_ >> 9;
+  p.basic.dev_sectors = (params_.num_blocks * params_.block_size) >> 9;
+  p.discard.discard_granularity = params_.block_size;
+  p.discard.max_discard_sectors = UINT_MAX >> 9;
+  p.discard.max_discard_segments = 1;
+  if (params_.write_zeroes)
+    p.discard.max_write_zeroes_sectors = UINT_MAX >> 9;
+  st = CtrlCmd(UBLK_CMD_SET_PARAMS, (uint64_t)&p, sizeof(p), 0, true);
+  if (st != 0) {
+    return st;
+  }
+
+  // udev may take a moment to create the char device.
+  string cdev = string("/dev/ublkc") + to_string(dev_id_);
+  for (int i = 0; (i < 100) && (cdev_fd_ < 0); i++) {
+    cdev_fd_ = open(cdev.c_str(), O_RDWR | O_CLOEXEC);
+    if (cdev_fd_ < 0) {
+      if (errno != ENOENT) {
+        return errno;
+      }
+      this_thread::sleep_for(chrono::milliseconds(10));
+    }
+  }
+  if (cdev_fd_ < 0) {
+    return ENOENT;
+  }
+  for (unsigned q = 0; q < params_.num_connections; q++) {
+    unique_ptr<UblkQueue> queue(new UblkQueue(this, q));
+    st = queue->Init();
+    if (st != 0) {
+      return st;
+    }
+    queues_.push_back(move(queue));
+  }
+
+  // Completes once every queue has fetched its first requests, i.e.
+  // after each one has been polled.
+  st = CtrlCmd(UBLK_CMD_START_DEV, 0, 0, getpid(), false);
+  if (st != 0) {
+    return st;
+  }
+  start_sent_ = true;
+  return 0;
+}
+
+int UblkServer::CtrlCmd(uint32_t op, uint64_t addr, uint16_t len,
+                        uint64_t data, bool wait) {
+  if (!ctrl_ring_) {
+    int st = NbdUring::New(kUblkCtrlEntries, IORING_SETUP_SQE128,
+                           &ctrl_ring_);
+    if (st != 0) {
+      return st;
+    }
+  }
+  struct io_uring_sqe *sqe = ctrl_ring_->GetSqe();
+  if (sqe == nullptr) {
+    return EBUSY;
+  }
+  sqe->opcode = IORING_OP_URING_CMD;
+  sqe->fd = ctrl_fd_;
+  sqe->cmd_op = ioctl_encode_ ? _IOWR('u', op, struct ublksrv_ctrl_cmd) : op;
+  sqe->user_data = op;
+  struct ublksrv_ctrl_cmd *cmd = (struct ublksrv_ctrl_cmd *)sqe->cmd;
+  cmd->dev_id = dev_id_;
+  cmd->queue_id = (uint16_t)-1;
+  cmd->addr = addr;
+  cmd->len = len;
+  cmd->data[0] = data;
+  int st = ctrl_ring_->Submit();
+  if ((st != 0) || !wait) {
+    return st;
+  }
+  while (1) {
+    int ret = CtrlReap(op);
+    if (ret <= 0) {
+      return -ret;
+    }
+    st = ctrl_ring_->Wait();
+    if (st != 0) {
+      return st;
+    }
+  }
+}
+
+int UblkServer::CtrlReap(uint32_t op) {
+  int ret = 1;
+  ctrl_ring_->Reap([this, op, &ret](struct io_uring_cqe *cqe) {
+      if (cqe->user_data == UBLK_CMD_START_DEV) {
+        start_sent_ = false;
+        started_ = (cqe->res == 0);
+      }
+      if (cqe->user_data == op)
+        ret = (cqe->res > 0) ? 0 : cqe->res;
+    });
+  return ret;
+}
+
+int UblkServer::Stop() {
+  if (!added_ || stopped_)
+    return 0;
+  stopped_ = true;
+  if (start_sent_)
+    CtrlReap(UBLK_CMD_START_DEV);
+  if (start_sent_) {
+    // Some queue was never polled and the device never went live.
+    // Tearing down the ring aborts the START_DEV still waiting for it.
+    ctrl_ring_.reset();
+    start_sent_ = false;
+  }
+  return CtrlCmd(UBLK_CMD_STOP_DEV, 0, 0, 0, true);
+}
@@ -0,0 +1,74 @@
+#include "zero_detect.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZERO_DETECT_X86	1
+#endif
+
+namespace {
+
+bool IsZeroGeneric(const char *p, size_t len) {
+  uint64_t acc = 0;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    acc |= v;
+    if (acc != 0)
+      return false;
+  }
+  for (; len > 0; p++, len--)
+    acc |= *(const uint8_t *)p;
+  return (acc == 0);
+}
+
+#ifdef ZERO_DETECT_X86
+// 128 bytes per iteration, checked once per iteration.
+__attribute__((target("avx2")))
+bool IsZeroAvx2(const char *p, size_t len) {
+  for (; len >= 128; p += 128, len -= 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(p + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(p + 96));
+    __m256i acc = _mm256_or_si256(_mm256_or_si256(a, b),
+                                  _mm256_or_si256(c, d));
+    if (!_mm256_testz_si256(acc, acc))
+      return false;
+  }
+  return IsZeroGeneric(p, len);
+}
+
+bool IsZeroSse2(const char *p, size_t len) {
+  const __m128i zero = _mm_setzero_si128();
+  for (; len >= 128; p += 128, len -= 128) {
+    __m128i acc = _mm_loadu_si128((const __m128i *)p);
+    for (unsigned i = 16; i < 128; i += 16)
+      acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+      return false;
+  }
+  return IsZeroGeneric(p, len);
+}
+#endif
+
+bool (*PickIsZero())(const char *, size_t) {
+#ifdef ZERO_DETECT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return IsZeroAvx2;
+  if (__builtin_cpu_supports("sse2"))
+    return IsZeroSse2;
+#endif
+  return IsZeroGeneric;
+}
+
+bool (*const g_is_zero)(const char *, size_t) = PickIsZero();
+
+}  // anonymous namespace
+
+bool IsZeroBuf(const void *buf, size_t len) {
+  return g_is_zero((const char *)buf, len);
+}